@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Compact position encoding for metered links, an alternative to one
+// VehiclePosition protobuf per update. Vehicles are identified by a numeric
+// index instead of the string ID, coordinates are fixed-point int32 (1e-7
+// degrees, ~1 cm) and lat/lon/timestamp are sent as zigzag varint deltas from
+// the vehicle's previous record; every keyframe_interval records (and on the
+// first) a keyframe carries absolute values so a consumer can join mid-stream
+// or resynchronize after a lost message. The decoder rebuilds the encoder's
+// quantized values exactly, so deltas never drift.
+//
+// Record layout (self-delimiting, records are simply concatenated):
+//   byte    flags: bit 0 = keyframe
+//   varint  vehicle index
+//   keyframe: zigzag lat, zigzag lon, varint timestamp ms, varint seq
+//   delta:    zigzag dlat, zigzag dlon, zigzag dtimestamp, byte seq & 0xFF
+//   varint  speed in cm/s, varint heading in 0.1 degrees
+//
+// A delta record is typically 14 bytes against ~70 for the protobuf.
+namespace compact {
+
+constexpr double kCoordScale = 1e7;
+constexpr uint8_t kKeyframe = 0x01;
+// Upper bound on one encoded record (every field at its longest varint)
+constexpr size_t kMaxRecordSize = 64;
+constexpr uint32_t kDefaultKeyframeInterval = 30;
+
+struct Sample {
+    uint32_t vehicle;
+    double lat;
+    double lon;
+    double speed;    // m/s
+    double heading;  // degrees
+    int64_t timestamp;
+    uint32_t seq;
+};
+
+inline uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+inline uint8_t* putVarint(uint8_t* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+// False on truncated or overlong input
+inline bool getVarint(const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && in < end; shift += 7) {
+        uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+inline int32_t toFixed(double degrees) { return static_cast<int32_t>(std::lround(degrees * kCoordScale)); }
+
+// Encode one record into out (at least kMaxRecordSize bytes); returns its
+// length. A delta record takes dtimestamp and the fixed-point coordinates of
+// the vehicle's previous record, which the caller keeps (CompactEncoder, or
+// VehicleState in a fleet).
+inline size_t encodeRecord(uint32_t vehicle, bool keyframe, int32_t lat_e7, int32_t lon_e7, int32_t prev_lat_e7,
+                           int32_t prev_lon_e7, int64_t timestamp, int64_t dtimestamp, uint32_t seq, double speed,
+                           double heading, uint8_t* out) {
+    uint8_t* p = out;
+    *p++ = keyframe ? kKeyframe : 0;
+    p = putVarint(p, vehicle);
+    if (keyframe) {
+        p = putVarint(p, zigzag(lat_e7));
+        p = putVarint(p, zigzag(lon_e7));
+        p = putVarint(p, static_cast<uint64_t>(timestamp));
+        p = putVarint(p, seq);
+    } else {
+        p = putVarint(p, zigzag(static_cast<int64_t>(lat_e7) - prev_lat_e7));
+        p = putVarint(p, zigzag(static_cast<int64_t>(lon_e7) - prev_lon_e7));
+        p = putVarint(p, zigzag(dtimestamp));
+        *p++ = static_cast<uint8_t>(seq);
+    }
+    p = putVarint(p, static_cast<uint64_t>(std::lround(std::max(speed, 0.0) * 100.0)));
+    p = putVarint(p, static_cast<uint64_t>(std::lround(std::max(heading, 0.0) * 10.0)));
+    return static_cast<size_t>(p - out);
+}
+
+}  // namespace compact
+
+// Per-vehicle encoder state for a single stream
+class CompactEncoder {
+private:
+    uint32_t vehicle_;
+    uint32_t keyframe_interval_;
+    uint32_t since_keyframe_;
+    int32_t lat_;
+    int32_t lon_;
+    int64_t timestamp_;
+
+public:
+    explicit CompactEncoder(uint32_t vehicle = 0, uint32_t keyframe_interval = compact::kDefaultKeyframeInterval)
+        : vehicle_(vehicle), keyframe_interval_(keyframe_interval > 0 ? keyframe_interval : 1),
+          since_keyframe_(keyframe_interval_), lat_(0), lon_(0), timestamp_(0) {}
+
+    uint32_t vehicle() const { return vehicle_; }
+
+    // Make the next record a keyframe (e.g. after a reconnect)
+    void forceKeyframe() { since_keyframe_ = keyframe_interval_; }
+
+    // Encode one update into out (at least compact::kMaxRecordSize bytes); returns its length
+    size_t encode(double lat, double lon, double speed, double heading, int64_t timestamp, uint32_t seq,
+                  uint8_t* out) {
+        int32_t lat_e7 = compact::toFixed(lat);
+        int32_t lon_e7 = compact::toFixed(lon);
+        bool keyframe = since_keyframe_ >= keyframe_interval_;
+        size_t size = compact::encodeRecord(vehicle_, keyframe, lat_e7, lon_e7, lat_, lon_, timestamp,
+                                            timestamp - timestamp_, seq, speed, heading, out);
+        since_keyframe_ = keyframe ? 1 : since_keyframe_ + 1;
+        lat_ = lat_e7;
+        lon_ = lon_e7;
+        timestamp_ = timestamp;
+        return size;
+    }
+};
+
+// Consumer side: rebuilds absolute positions from a stream of records,
+// tracking every vehicle it has seen. A delta for a vehicle without a prior
+// keyframe, or whose sequence byte shows a missed record, is dropped until the
+// vehicle's next keyframe.
+class CompactDecoder {
+private:
+    struct Track {
+        int32_t lat;
+        int32_t lon;
+        int64_t timestamp;
+        uint32_t seq;
+        bool synced;
+    };
+
+    std::unordered_map<uint32_t, Track> tracks_;
+    uint64_t dropped_;
+
+public:
+    CompactDecoder() : dropped_(0) {}
+
+    // Records skipped because their vehicle was out of sync
+    uint64_t dropped() const { return dropped_; }
+
+    // Decode every record in [data, data + size) and append the recovered
+    // samples. Returns false if the input is malformed; samples decoded before
+    // the bad record are kept.
+    bool decode(const uint8_t* data, size_t size, std::vector<compact::Sample>& out) {
+        const uint8_t* p = data;
+        const uint8_t* end = data + size;
+        while (p < end) {
+            uint8_t flags = *p++;
+            uint64_t vehicle, a, b, c, speed, heading;
+            if (!compact::getVarint(p, end, vehicle) || !compact::getVarint(p, end, a) ||
+                !compact::getVarint(p, end, b) || !compact::getVarint(p, end, c)) {
+                return false;
+            }
+            uint64_t seq = 0;
+            if (flags & compact::kKeyframe) {
+                if (!compact::getVarint(p, end, seq)) return false;
+            } else {
+                if (p >= end) return false;
+                seq = *p++;
+            }
+            if (!compact::getVarint(p, end, speed) || !compact::getVarint(p, end, heading)) return false;
+
+            Track& track = tracks_[static_cast<uint32_t>(vehicle)];
+            if (flags & compact::kKeyframe) {
+                track.lat = static_cast<int32_t>(compact::unzigzag(a));
+                track.lon = static_cast<int32_t>(compact::unzigzag(b));
+                track.timestamp = static_cast<int64_t>(c);
+                track.seq = static_cast<uint32_t>(seq);
+                track.synced = true;
+            } else if (track.synced && static_cast<uint8_t>(track.seq + 1) == seq) {
+                track.lat = static_cast<int32_t>(track.lat + compact::unzigzag(a));
+                track.lon = static_cast<int32_t>(track.lon + compact::unzigzag(b));
+                track.timestamp += compact::unzigzag(c);
+                track.seq++;
+            } else {
+                track.synced = false;
+                dropped_++;
+                continue;
+            }
+
+            out.push_back({static_cast<uint32_t>(vehicle), track.lat / compact::kCoordScale,
+                           track.lon / compact::kCoordScale, static_cast<double>(speed) / 100.0,
+                           static_cast<double>(heading) / 10.0, track.timestamp, track.seq});
+        }
+        return true;
+    }
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#ifdef GEOVAN_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef GEOVAN_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "logger.h"
+#include "metrics.h"
+
+// Compression applied to a batched frame's body (everything after the header).
+// Each codec is only available when the build found its library (see
+// CMakeLists.txt); compressionAvailable() tells which ones are.
+enum class Compression {
+    None,
+    Lz4,   // fast, modest ratio
+    Zstd,  // better ratio, more CPU; optionally with a trained dictionary
+};
+
+inline bool parseCompression(const std::string& name, Compression& compression) {
+    if (name == "none") {
+        compression = Compression::None;
+    } else if (name == "lz4") {
+        compression = Compression::Lz4;
+    } else if (name == "zstd") {
+        compression = Compression::Zstd;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool compressionAvailable(Compression compression) {
+    switch (compression) {
+    case Compression::None:
+        return true;
+    case Compression::Lz4:
+#ifdef GEOVAN_HAVE_LZ4
+        return true;
+#else
+        return false;
+#endif
+    case Compression::Zstd:
+#ifdef GEOVAN_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+// Compressed body layout: varint(uncompressed body size) + codec output. The
+// codec is named by a flag in the frame header (PositionBatcher), so frames
+// below the threshold, or that would not shrink, go out uncompressed.
+//
+// One instance per batcher: it keeps codec contexts between frames and is not
+// thread-safe.
+class FrameCompressor {
+private:
+    Compression compression_;
+    int level_;
+    size_t threshold_;
+#ifdef GEOVAN_HAVE_ZSTD
+    struct ZstdFree {
+        void operator()(ZSTD_CCtx* ctx) const { ZSTD_freeCCtx(ctx); }
+        void operator()(ZSTD_CDict* dict) const { ZSTD_freeCDict(dict); }
+    };
+    std::unique_ptr<ZSTD_CCtx, ZstdFree> zstd_ctx_;
+    std::unique_ptr<ZSTD_CDict, ZstdFree> zstd_dict_;
+#endif
+
+public:
+    // level: zstd compression level, or LZ4 acceleration (higher is faster)
+    FrameCompressor(Compression compression, int level, size_t threshold)
+        : compression_(compression), level_(level), threshold_(threshold) {
+#ifdef GEOVAN_HAVE_ZSTD
+        if (compression_ == Compression::Zstd) zstd_ctx_.reset(ZSTD_createCCtx());
+#endif
+    }
+
+    FrameCompressor(const FrameCompressor&) = delete;
+    FrameCompressor& operator=(const FrameCompressor&) = delete;
+
+    Compression compression() const { return compression_; }
+    size_t threshold() const { return threshold_; }
+
+    // Use a dictionary trained on sample frames (zstd --train) for zstd.
+    // Consumers must load the same dictionary to decompress.
+    bool loadDictionary(const std::string& filename) {
+        std::ifstream file(filename, std::ios::binary);
+        std::string dict((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file.good() && !file.eof()) {
+            logger().error("Could not read compression dictionary: ", filename);
+            return false;
+        }
+#ifdef GEOVAN_HAVE_ZSTD
+        if (compression_ == Compression::Zstd && !dict.empty()) {
+            zstd_dict_.reset(ZSTD_createCDict(dict.data(), dict.size(), level_));
+            if (zstd_dict_) return true;
+        }
+#endif
+        logger().error("Could not load compression dictionary: ", filename);
+        return false;
+    }
+
+    // Worst-case compressed body size for an input of size bytes
+    size_t bound(size_t size) const {
+        size_t header = 10;
+        switch (compression_) {
+#ifdef GEOVAN_HAVE_LZ4
+        case Compression::Lz4:
+            return header + static_cast<size_t>(LZ4_compressBound(static_cast<int>(size)));
+#endif
+#ifdef GEOVAN_HAVE_ZSTD
+        case Compression::Zstd:
+            return header + ZSTD_compressBound(size);
+#endif
+        default:
+            return header + size;
+        }
+    }
+
+    // Append the compressed form of [src, src + size) to out, which must have
+    // capacity for bound(size) more bytes. Returns false (out unchanged) if the
+    // body is below the threshold, failed to compress or would not shrink.
+    bool compress(const char* src, size_t size, std::string& out) {
+        if (compression_ == Compression::None || size < threshold_) return false;
+        uint64_t started = metrics::nowNanos();
+        size_t start = out.size();
+        for (uint64_t v = size; ; v >>= 7) {
+            if (v < 0x80) {
+                out.push_back(static_cast<char>(v));
+                break;
+            }
+            out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+        }
+        size_t offset = out.size();
+        size_t capacity = bound(size) - (offset - start);
+        out.resize(offset + capacity);
+
+        size_t written = 0;
+        switch (compression_) {
+#ifdef GEOVAN_HAVE_LZ4
+        case Compression::Lz4: {
+            int n = LZ4_compress_fast(src, &out[offset], static_cast<int>(size), static_cast<int>(capacity),
+                                      level_ > 0 ? level_ : 1);
+            written = n > 0 ? static_cast<size_t>(n) : 0;
+            break;
+        }
+#endif
+#ifdef GEOVAN_HAVE_ZSTD
+        case Compression::Zstd: {
+            size_t n = zstd_dict_
+                ? ZSTD_compress_usingCDict(zstd_ctx_.get(), &out[offset], capacity, src, size, zstd_dict_.get())
+                : ZSTD_compressCCtx(zstd_ctx_.get(), &out[offset], capacity, src, size, level_);
+            written = ZSTD_isError(n) ? 0 : n;
+            break;
+        }
+#endif
+        default:
+            (void)src;
+            break;
+        }
+
+        if (written == 0 || offset - start + written >= size) {
+            out.resize(start);
+            return false;
+        }
+        out.resize(offset + written);
+
+        metrics::Registry& m = metrics::registry();
+        m.compress_time.record(metrics::nowNanos() - started);
+        m.compress_bytes_in.add(size);
+        m.compress_bytes_out.add(offset - start + written);
+        return true;
+    }
+};
+
+// Consumer side counterpart to FrameCompressor
+class FrameDecompressor {
+private:
+#ifdef GEOVAN_HAVE_ZSTD
+    struct ZstdFree {
+        void operator()(ZSTD_DCtx* ctx) const { ZSTD_freeDCtx(ctx); }
+        void operator()(ZSTD_DDict* dict) const { ZSTD_freeDDict(dict); }
+    };
+    std::unique_ptr<ZSTD_DCtx, ZstdFree> zstd_ctx_;
+    std::unique_ptr<ZSTD_DDict, ZstdFree> zstd_dict_;
+#endif
+
+public:
+    FrameDecompressor() {
+#ifdef GEOVAN_HAVE_ZSTD
+        zstd_ctx_.reset(ZSTD_createDCtx());
+#endif
+    }
+
+    // The dictionary the frames were compressed with (zstd only)
+    bool setDictionary(const std::string& dict) {
+#ifdef GEOVAN_HAVE_ZSTD
+        zstd_dict_.reset(ZSTD_createDDict(dict.data(), dict.size()));
+        return zstd_dict_ != nullptr;
+#else
+        (void)dict;
+        return false;
+#endif
+    }
+
+    // Replace out with the decompressed body. False on corrupt input or a
+    // codec this build lacks.
+    bool decompress(Compression compression, const uint8_t* data, size_t size, std::string& out) {
+        uint64_t original = 0;
+        unsigned shift = 0;
+        while (true) {
+            if (size == 0 || shift > 35) return false;
+            uint8_t byte = *data++;
+            size--;
+            original |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+            if (byte < 0x80) break;
+        }
+        out.resize(original);
+
+        switch (compression) {
+#ifdef GEOVAN_HAVE_LZ4
+        case Compression::Lz4: {
+            int n = LZ4_decompress_safe(reinterpret_cast<const char*>(data), &out[0], static_cast<int>(size),
+                                        static_cast<int>(original));
+            return n >= 0 && static_cast<uint64_t>(n) == original;
+        }
+#endif
+#ifdef GEOVAN_HAVE_ZSTD
+        case Compression::Zstd: {
+            size_t n = zstd_dict_
+                ? ZSTD_decompress_usingDDict(zstd_ctx_.get(), &out[0], original, data, size, zstd_dict_.get())
+                : ZSTD_decompressDCtx(zstd_ctx_.get(), &out[0], original, data, size);
+            return !ZSTD_isError(n) && n == original;
+        }
+#endif
+        default:
+            (void)data;
+            return false;
+        }
+    }
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mqtt/async_client.h>
+#include "logger.h"
+#include "metrics.h"
+
+// Delay before the n-th reconnect attempt: "full jitter" exponential backoff,
+// uniform in [0, min(max, initial * 2^n)], so connections that dropped at the
+// same moment (a broker restart) spread their retries instead of arriving as
+// one storm.
+struct BackoffPolicy {
+    std::chrono::milliseconds initial{500};
+    std::chrono::milliseconds max{30000};
+
+    template <class Rng>
+    std::chrono::milliseconds delay(unsigned attempt, Rng& rng) const {
+        auto ceiling = initial.count() << std::min(attempt, 20u);
+        ceiling = std::min<decltype(ceiling)>(std::max<decltype(ceiling)>(ceiling, 1), max.count());
+        return std::chrono::milliseconds(std::uniform_int_distribution<long long>(0, ceiling)(rng));
+    }
+};
+
+// Connects a set of MQTT clients and keeps them connected. Every connect is
+// started asynchronously, so a fleet's handshakes overlap, and a failed or
+// lost connection is retried from one background thread with BackoffPolicy.
+// Nothing waits on a connection except waitConnected(); publishers check
+// is_connected() and buffer (StoreForward) or count the message as failed.
+//
+// With QoS > 0 the session is persistent (clean session off), so the broker
+// and client resume unacknowledged publishes after a reconnect.
+class ConnectionManager {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    enum class State { Waiting, Connecting, Connected, Stopped };
+
+    struct Link : public mqtt::iaction_listener {
+        ConnectionManager* owner;
+        std::shared_ptr<mqtt::async_client> client;
+        State state;
+        unsigned attempts;
+        bool ever_connected;
+        Clock::time_point first_connected;
+        Clock::time_point retry_at;
+
+        void on_success(const mqtt::token&) override { owner->connected(*this); }
+        void on_failure(const mqtt::token&) override { owner->failed(*this, "connect failed"); }
+    };
+
+    mqtt::connect_options options_;
+    BackoffPolicy backoff_;
+    std::vector<std::unique_ptr<Link>> links_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::mt19937_64 rng_;
+    bool stopping_;
+    std::thread thread_;
+
+public:
+    ConnectionManager(int qos, size_t max_in_flight, BackoffPolicy backoff = BackoffPolicy())
+        : backoff_(backoff), rng_(std::random_device{}()), stopping_(false) {
+        options_.set_keep_alive_interval(20);
+        options_.set_clean_session(qos == 0);
+        options_.set_max_inflight(static_cast<int>(max_in_flight));
+    }
+
+    ~ConnectionManager() { stop(); }
+
+    ConnectionManager(const ConnectionManager&) = delete;
+    ConnectionManager& operator=(const ConnectionManager&) = delete;
+
+    // Register a client before start(). Replaces its connected and
+    // connection-lost handlers.
+    void add(std::shared_ptr<mqtt::async_client> client) {
+        auto link = std::make_unique<Link>();
+        link->owner = this;
+        link->client = std::move(client);
+        link->state = State::Waiting;
+        link->attempts = 0;
+        link->ever_connected = false;
+        link->retry_at = Clock::now();
+        Link* raw = link.get();
+        link->client->set_connection_lost_handler([this, raw](const std::string& cause) {
+            metrics::registry().connection_losses.add();
+            failed(*raw, cause.empty() ? "connection lost" : cause);
+        });
+        links_.push_back(std::move(link));
+    }
+
+    // Start connecting every client; returns immediately
+    void start() {
+        thread_ = std::thread([this] { run(); });
+    }
+
+    // Wait until every client is connected or timeout passes; the number connected
+    size_t waitConnected(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait_for(lock, timeout, [this] { return connectedLocked() == links_.size(); });
+        return connectedLocked();
+    }
+
+    size_t connected() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return connectedLocked();
+    }
+
+    size_t size() const { return links_.size(); }
+
+    // Clients that have connected at least once; first and last are set to
+    // when the earliest and the latest of them first connected
+    size_t firstConnects(Clock::time_point& first, Clock::time_point& last) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t count = 0;
+        for (auto& link : links_) {
+            if (!link->ever_connected) continue;
+            first = count == 0 ? link->first_connected : std::min(first, link->first_connected);
+            last = count == 0 ? link->first_connected : std::max(last, link->first_connected);
+            count++;
+        }
+        return count;
+    }
+
+    // Stop reconnecting; clients are left as they are for the caller to
+    // disconnect. Waits briefly for connects still in progress, whose
+    // listeners point into this object.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) return;
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        if (thread_.joinable()) thread_.join();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait_for(lock, std::chrono::seconds(2), [this] {
+            return std::none_of(links_.begin(), links_.end(),
+                                [](const std::unique_ptr<Link>& l) { return l->state == State::Connecting; });
+        });
+        for (auto& link : links_) {
+            link->client->set_connection_lost_handler([](const std::string&) {});
+        }
+    }
+
+private:
+    size_t connectedLocked() const {
+        return static_cast<size_t>(std::count_if(links_.begin(), links_.end(),
+                                                 [](const std::unique_ptr<Link>& l) { return l->state == State::Connected; }));
+    }
+
+    void connected(Link& link) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                link.state = State::Stopped;
+                changed_.notify_all();
+                return;
+            }
+            link.state = State::Connected;
+            link.attempts = 0;
+            metrics::Registry& m = metrics::registry();
+            m.connects.add();
+            if (link.ever_connected) {
+                m.reconnects.add();
+            } else {
+                link.first_connected = Clock::now();
+            }
+            link.ever_connected = true;
+        }
+        logger().info("Connected ", link.client->get_client_id(), " to ", link.client->get_server_uri());
+        changed_.notify_all();
+    }
+
+    void failed(Link& link, const std::string& cause) {
+        std::chrono::milliseconds delay;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                link.state = State::Stopped;
+                changed_.notify_all();
+                return;
+            }
+            if (link.state == State::Waiting) return;
+            delay = backoff_.delay(link.attempts++, rng_);
+            link.state = State::Waiting;
+            link.retry_at = Clock::now() + delay;
+        }
+        static LogRateLimit limit(5, std::chrono::seconds(1));
+        logger().limited(limit, LogLevel::Warn, link.client->get_client_id(), ": ", cause, ", retrying in ",
+                         delay.count(), "ms");
+        changed_.notify_all();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopping_) {
+            auto now = Clock::now();
+            auto wake = Clock::time_point::max();
+            for (auto& link : links_) {
+                if (link->state != State::Waiting) continue;
+                if (link->retry_at > now) {
+                    wake = std::min(wake, link->retry_at);
+                    continue;
+                }
+                link->state = State::Connecting;
+                // The listener may run before connect() returns, so call it unlocked
+                lock.unlock();
+                try {
+                    link->client->connect(options_, nullptr, *link);
+                } catch (const mqtt::exception& exc) {
+                    failed(*link, exc.what());
+                }
+                lock.lock();
+                if (stopping_) break;
+                // It may have failed already and be due for a retry
+                if (link->state == State::Waiting) wake = std::min(wake, link->retry_at);
+            }
+            if (wake == Clock::time_point::max()) {
+                changed_.wait(lock);
+            } else {
+                changed_.wait_until(lock, wake);
+            }
+        }
+        for (auto& link : links_) {
+            if (link->state != State::Connecting) link->state = State::Stopped;
+        }
+    }
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <mqtt/async_client.h>
+#include "logger.h"
+#include "metrics.h"
+
+// Fire-and-forget UDP transport for position beacons, an alternative to MQTT
+// where a position is stale within a few hundred milliseconds and retransmits
+// or head-of-line blocking behind a lost TCP segment only add latency. Each
+// payload (serialized VehiclePosition or GV frame) is one datagram on a
+// connected non-blocking socket; there are no acknowledgements, and a full
+// socket buffer drops the datagram rather than block the tick.
+//
+// Datagrams are queued and written batch_size at a time with one sendmmsg
+// call, straight from the pooled payload buffers: a queued message keeps its
+// PayloadPool slot busy until the batch is written, so nothing is copied.
+// Callers flush() at the end of each tick so no beacon waits for the next one.
+//
+// One instance per fleet shard; not thread-safe.
+class DatagramSender {
+public:
+    // Largest payload sent in one datagram without IP fragmentation on a 1500 byte MTU
+    static constexpr size_t kMaxDatagram = 1472;
+    static constexpr size_t kDefaultBatch = 64;
+
+private:
+    int fd_;
+    std::string destination_;
+    size_t batch_size_;
+    std::vector<mqtt::const_message_ptr> pending_;
+    std::vector<iovec> iov_;
+    std::vector<mmsghdr> headers_;
+    uint64_t sent_;
+    uint64_t dropped_;
+
+public:
+    explicit DatagramSender(size_t batch_size = kDefaultBatch)
+        : fd_(-1), batch_size_(std::min<size_t>(std::max<size_t>(batch_size, 1), UIO_MAXIOV)),
+          iov_(batch_size_), headers_(batch_size_), sent_(0), dropped_(0) {
+        pending_.reserve(batch_size_);
+        for (size_t i = 0; i < batch_size_; i++) {
+            headers_[i].msg_hdr = {};
+            headers_[i].msg_hdr.msg_iov = &iov_[i];
+            headers_[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    ~DatagramSender() {
+        if (fd_ >= 0) {
+            flush();
+            ::close(fd_);
+        }
+    }
+
+    DatagramSender(const DatagramSender&) = delete;
+    DatagramSender& operator=(const DatagramSender&) = delete;
+
+    // Resolve host:port ([v6addr]:port for IPv6 literals) and connect to it
+    bool open(const std::string& destination) {
+        destination_ = destination;
+        size_t colon = destination.rfind(':');
+        if (colon == std::string::npos || colon + 1 == destination.size()) {
+            logger().error("Expected host:port for the UDP destination, got ", destination);
+            return false;
+        }
+        std::string host = destination.substr(0, colon);
+        std::string port = destination.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo* results = nullptr;
+        int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &results);
+        if (rc != 0) {
+            logger().error("Could not resolve ", destination, ": ", gai_strerror(rc));
+            return false;
+        }
+        for (addrinfo* ai = results; ai; ai = ai->ai_next) {
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                fd_ = fd;
+                break;
+            }
+            ::close(fd);
+        }
+        freeaddrinfo(results);
+        if (fd_ < 0) {
+            logger().error("Could not open a UDP socket to ", destination, ": ", std::strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    const std::string& destination() const { return destination_; }
+    size_t batchSize() const { return batch_size_; }
+    uint64_t sent() const { return sent_; }
+    // Datagrams larger than kMaxDatagram, or that the kernel would not take
+    // (socket buffer full, no route, oversize)
+    uint64_t dropped() const { return dropped_; }
+
+    // Queue message's payload, writing the batch once it is full. A payload
+    // over kMaxDatagram would be fragmented, so it is dropped instead and
+    // false returned.
+    bool send(mqtt::const_message_ptr message) {
+        const auto& payload = message->get_payload();
+        if (payload.size() > kMaxDatagram) {
+            dropped_++;
+            metrics::registry().datagram_drops.add();
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Warn, "Dropping a ", payload.size(), "-byte datagram to ", destination_,
+                             ", over the ", kMaxDatagram, "-byte limit");
+            return false;
+        }
+        iov_[pending_.size()].iov_base = const_cast<char*>(payload.data());
+        iov_[pending_.size()].iov_len = payload.size();
+        pending_.push_back(std::move(message));
+        if (pending_.size() == batch_size_) flush();
+        return true;
+    }
+
+    // Write every queued datagram, as few sendmmsg calls as the kernel allows
+    void flush() {
+        size_t done = 0;
+        metrics::Registry& m = metrics::registry();
+        while (done < pending_.size()) {
+            uint64_t started = metrics::nowNanos();
+            int n = sendmmsg(fd_, &headers_[done], static_cast<unsigned>(pending_.size() - done),
+                             MSG_DONTWAIT | MSG_NOSIGNAL);
+            int err = errno;
+            m.datagram_send.record(metrics::nowNanos() - started);
+            m.datagram_batches.add();
+            if (n > 0) {
+                done += static_cast<size_t>(n);
+                sent_ += static_cast<uint64_t>(n);
+                m.datagrams_sent.add(static_cast<uint64_t>(n));
+                continue;
+            }
+            // The datagram at done failed; a full buffer fails the rest too
+            size_t lost = err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS ? pending_.size() - done : 1;
+            done += lost;
+            dropped_ += lost;
+            m.datagram_drops.add(lost);
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Warn, "UDP send to ", destination_, " failed: ", std::strerror(err));
+        }
+        // Releasing the messages frees their pool slots
+        pending_.clear();
+    }
+};
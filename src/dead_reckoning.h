@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include "geo.h"
+#include "vehicle_state.h"
+
+// When a vehicle in adaptive reporting mode publishes: only once the
+// backend's prediction of where it is has drifted far enough from where it
+// really is, or it has been silent for a heartbeat.
+struct DeadReckoningPolicy {
+    double distance_m = 0.0;   // predicted position error that forces a report; 0 reports every tick
+    double heading_deg = 15.0; // change of heading since the last report that forces one
+    std::chrono::milliseconds heartbeat{30000};
+
+    bool enabled() const { return distance_m > 0; }
+};
+
+// The backend's model of a vehicle between reports: from the last reported
+// fix it keeps going at the reported speed along the reported heading (a
+// great circle). The agent runs the same model on what it has sent, kept in
+// the vehicle's VehicleState, so it knows what the backend currently believes
+// and publishes only the positions that would correct it. On a straight
+// stretch at steady speed the prediction holds and nothing is sent until the
+// heartbeat. Only the policy lives here, so one instance serves a whole fleet
+// shard.
+class DeadReckoning {
+private:
+    DeadReckoningPolicy policy_;
+
+public:
+    const DeadReckoningPolicy& policy() const { return policy_; }
+    bool enabled() const { return policy_.enabled(); }
+
+    void setPolicy(const DeadReckoningPolicy& policy) { policy_ = policy; }
+
+    // Where the backend places a vehicle last reported as v at timestamp (ms)
+    static void predict(const VehicleState& v, int64_t timestamp, double& lat, double& lon) {
+        double seconds = static_cast<double>(v.millisSincePublished(timestamp)) / 1000.0;
+        if (seconds <= 0 || v.speed_cms == 0) {
+            lat = v.lat();
+            lon = v.lon();
+            return;
+        }
+        geo::destination(v.lat(), v.lon(), v.heading(), v.speed() * seconds, lat, lon);
+    }
+
+    // Whether the state at timestamp must be published; if so the caller
+    // records it in v as the new basis of the prediction. Always true while
+    // disabled.
+    bool shouldReport(const VehicleState& v, double lat, double lon, double heading, int64_t timestamp) const {
+        if (!enabled() || !v.hasBasis()) return true;
+        if (v.millisSincePublished(timestamp) >= policy_.heartbeat.count() ||
+            geo::bearingDifference(heading, v.heading()) > policy_.heading_deg) {
+            return true;
+        }
+        double predicted_lat, predicted_lon;
+        predict(v, timestamp, predicted_lat, predicted_lon);
+        return geo::distanceMeters(lat, lon, predicted_lat, predicted_lon) > policy_.distance_m;
+    }
+};
@@ -0,0 +1,762 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <mqtt/async_client.h>
+#include "compression.h"
+#include "connection_manager.h"
+#include "datagram_sender.h"
+#include "fleet_kinematics.h"
+#include "fleet_snapshot.h"
+#include "hash_ring.h"
+#include "histogram.h"
+#include "logger.h"
+#include "message_auth.h"
+#include "metrics.h"
+#include "outbound_queue.h"
+#include "payload_pool.h"
+#include "position_batcher.h"
+#include "publish_path.h"
+#include "publish_window.h"
+#include "route.h"
+#include "spatial_index.h"
+#include "store_forward.h"
+#include "vehicle_state.h"
+#include "worker_pool.h"
+
+// Drives many logical vehicles from one process. The fleet is split into
+// shards, one per MQTT connection, each with its own in-flight window, payload
+// pools, batcher, PublishPath and FleetKinematics state (including RNG). A
+// vehicle is nothing but its slot in these arrays: kinematics, its
+// VehicleState and its fleet index, about 60 bytes in all. Connections are
+// spread round-robin over the broker list and vehicles are assigned to them by
+// consistent hashing of their client ID, so a vehicle always publishes over the
+// same connection (keeping its messages in order) and resizing the pool only
+// moves a fraction of the fleet. Shards share only the read-only route, so a
+// worker pool steps them in parallel without locks; each shard is stepped by
+// one worker at a time.
+class Fleet {
+private:
+    struct Shard {
+        std::shared_ptr<mqtt::async_client> client;
+        std::shared_ptr<PublishWindow> window;
+        std::vector<std::shared_ptr<PayloadPool>> pools;  // one per topic shard
+        std::shared_ptr<PositionBatcher> batcher;
+        std::shared_ptr<OutboundQueue> outbound;
+        std::unique_ptr<OutboundPublisher> publisher;
+        std::shared_ptr<StoreForward> spool;
+        std::shared_ptr<DatagramSender> datagram;
+        std::shared_ptr<MessageAuthenticator> auth;  // the connection's stream, batched or not
+        PublishPath path;  // publishes for every vehicle of the shard
+        FleetKinematics kin;
+        std::vector<VehicleState> states;  // publish state of each kinematics slot
+        std::vector<uint32_t> vehicles;    // fleet index of each kinematics slot
+        // Slot s publishes the shard's vehicles [phase_bounds[s], phase_bounds[s + 1])
+        std::vector<size_t> phase_bounds;
+        // When each slot was last stepped; default-constructed until its first tick
+        std::vector<std::chrono::steady_clock::time_point> slot_stepped;
+        std::chrono::steady_clock::duration kinematics_time;
+        // Ticked once its connection first came up (or the wait for it ran out)
+        bool ready;
+
+        Shard(std::shared_ptr<mqtt::async_client> shard_client, size_t max_in_flight,
+              const std::vector<std::string>& topics, int qos, std::vector<uint32_t> members, uint64_t seed,
+              const VehicleIds& ids)
+            : client(std::move(shard_client)),
+              window(std::make_shared<PublishWindow>(max_in_flight)),
+              pools(makePools(topics, qos, max_in_flight)),
+              path(client, window, pools, ids),
+              kin(members.size(), seed), states(members.size()), vehicles(std::move(members)),
+              kinematics_time(std::chrono::steady_clock::duration::zero()), ready(true) {}
+
+        static std::vector<std::shared_ptr<PayloadPool>> makePools(const std::vector<std::string>& topics, int qos,
+                                                                   size_t max_in_flight) {
+            std::vector<std::shared_ptr<PayloadPool>> pools;
+            for (auto& topic : topics) {
+                // One slot per in-flight message plus one being filled
+                pools.push_back(std::make_shared<PayloadPool>(
+                    topic, qos, PublishPath::kPayloadCapacity, max_in_flight + 1));
+            }
+            return pools;
+        }
+    };
+
+    std::shared_ptr<const Route> route_;
+    std::vector<Shard> shards_;
+    std::vector<std::shared_ptr<PositionBatcher>> batchers_;
+    VehicleIds ids_;
+    size_t vehicle_count_;
+    size_t broker_count_;
+    size_t phase_slots_;
+    double fixed_step_;  // seconds a slot's motion advances per tick; 0 follows the clock
+    int qos_;
+    std::unique_ptr<ConnectionManager> connections_;
+    std::chrono::steady_clock::time_point ready_deadline_;  // unconnected shards are ticked from here on
+    std::unique_ptr<SpatialEvents> spatial_;
+    std::string event_topic_;
+    std::vector<double> event_lat_, event_lon_;  // every vehicle's position, by fleet index
+    std::vector<uint8_t> event_placed_;          // whether its slot has been stepped yet
+    std::vector<uint32_t> shard_of_;             // shards_ index of each vehicle, for events
+    WorkerPool workers_;
+
+public:
+    // One shard per connection; connection_count is raised to the broker and
+    // thread counts so every broker gets a connection and every worker a shard.
+    // With topic_shards > 1 each vehicle publishes on <topic>/<k>, k picked by
+    // hashing its client ID.
+    Fleet(const std::string& base_id, const std::vector<std::string>& broker_urls, const std::string& topic,
+          std::shared_ptr<const Route> route, size_t vehicle_count, size_t connection_count,
+          int qos, size_t max_in_flight, size_t threads = 1, uint32_t topic_shards = 1)
+        : route_(route), ids_(VehicleIds::numbered(base_id)), vehicle_count_(vehicle_count),
+          broker_count_(broker_urls.size()), phase_slots_(1), fixed_step_(0), qos_(qos), workers_(threads) {
+        connection_count = std::max({connection_count, threads, broker_urls.size(), size_t{1}});
+        if (connection_count > vehicle_count) connection_count = std::max<size_t>(vehicle_count, 1);
+
+        std::vector<std::string> connection_ids;
+        for (size_t c = 0; c < connection_count; c++) {
+            connection_ids.push_back(base_id + "-conn-" + std::to_string(c));
+        }
+        std::vector<std::string> topics;
+        for (uint32_t k = 0; k < std::clamp<uint32_t>(topic_shards, 1, VehicleState::kMaxTopics); k++) {
+            topics.push_back(topic_shards > 1 ? topic + "/" + std::to_string(k) : topic);
+        }
+
+        // Place every vehicle on a connection and a topic by its client ID
+        HashRing ring(connection_ids);
+        std::vector<std::vector<uint32_t>> members(connection_count);
+        std::vector<uint16_t> topic_of(vehicle_count);
+        std::string vehicle_id;
+        for (size_t i = 0; i < vehicle_count; i++) {
+            ids_.format(static_cast<uint32_t>(i), vehicle_id);
+            members[ring.nodeFor(vehicle_id)].push_back(static_cast<uint32_t>(i));
+            topic_of[i] = topics.size() > 1 ? static_cast<uint16_t>(sharding::jumpHash(
+                                                  sharding::hashKey(vehicle_id), static_cast<uint32_t>(topics.size())))
+                                            : 0;
+        }
+
+        std::mt19937 seeder(std::random_device{}());
+        shards_.reserve(connection_count);
+        for (size_t c = 0; c < connection_count; c++) {
+            shards_.emplace_back(std::make_shared<mqtt::async_client>(
+                                     broker_urls[c % broker_urls.size()], connection_ids[c]),
+                                 max_in_flight, topics, qos, std::move(members[c]), seeder(), ids_);
+        }
+
+        // Spread vehicles evenly along the route so they don't move in lockstep
+        for (auto& shard : shards_) {
+            for (size_t j = 0; j < shard.kin.size(); j++) {
+                shard.states[j].topic = topic_of[shard.vehicles[j]];
+                shard.kin.place(j, startIndex(shard.vehicles[j], vehicle_count));
+            }
+        }
+        assignPhases(1);
+    }
+
+    size_t size() const { return vehicle_count_; }
+    const Route& route() const { return *route_; }
+    size_t connectionCount() const { return shards_.size(); }
+    size_t threadCount() const { return workers_.threadCount(); }
+    uint64_t steals() const { return workers_.steals(); }
+    const std::vector<std::shared_ptr<PositionBatcher>>& batchers() const { return batchers_; }
+    size_t phaseSlots() const { return phase_slots_; }
+    bool vectorized() const { return shards_.front().kin.vectorized(); }
+
+    // Per-vehicle state held across all shards (kinematics, publish state and
+    // indexes, plus the event positions when enabled), in bytes; the spatial
+    // index and what is shared per shard come on top
+    size_t stateBytes() const {
+        size_t total = (event_lat_.capacity() + event_lon_.capacity()) * sizeof(double) +
+                       event_placed_.capacity() + shard_of_.capacity() * sizeof(uint32_t);
+        for (auto& shard : shards_) {
+            total += shard.kin.stateBytes() + shard.states.capacity() * sizeof(VehicleState) +
+                     shard.vehicles.capacity() * sizeof(uint32_t);
+        }
+        return total;
+    }
+
+    // Summed over shards, so with several workers this is CPU time rather than wall time
+    std::chrono::steady_clock::duration kinematicsTime() const {
+        auto total = std::chrono::steady_clock::duration::zero();
+        for (auto& shard : shards_) total += shard.kinematics_time;
+        return total;
+    }
+
+    void resetKinematicsTime() {
+        for (auto& shard : shards_) shard.kinematics_time = std::chrono::steady_clock::duration::zero();
+    }
+
+    // Split each publish period into slots, each owning an equal contiguous range
+    // of every shard's vehicles, so the fleet's publishes are spread across the
+    // period instead of bursting and every slot steps one dense run of
+    // kinematics state per shard. Start positions are spread along the route
+    // independently of the slot.
+    void assignPhases(size_t slots) {
+        if (slots == 0) slots = 1;
+        phase_slots_ = slots;
+        for (auto& shard : shards_) {
+            shard.phase_bounds.resize(slots + 1);
+            for (size_t s = 0; s <= slots; s++) {
+                shard.phase_bounds[s] = s * shard.kin.size() / slots;
+            }
+            shard.slot_stepped.assign(slots, {});
+        }
+    }
+
+    // Replace the route, e.g. with one loaded while the connections came up,
+    // and spread the vehicles along it again. Call before the first publish.
+    void setRoute(std::shared_ptr<const Route> route) {
+        route_ = std::move(route);
+        for (auto& shard : shards_) {
+            for (size_t j = 0; j < shard.kin.size(); j++) {
+                shard.kin.place(j, startIndex(shard.vehicles[j], vehicle_count_));
+            }
+        }
+    }
+
+    void setMotion(MotionModel model, double max_accel) {
+        for (auto& shard : shards_) {
+            shard.kin.setMotion(model, max_accel);
+        }
+    }
+
+    // Draw every vehicle's randomness from seed instead of a random device;
+    // each shard's generator is seeded from seed and its index, each vehicle's
+    // stream from that and its slot. With the same layout and fixed step the
+    // fleet then drives the same way on every run.
+    void setSeed(uint64_t seed) {
+        for (size_t k = 0; k < shards_.size(); k++) {
+            shards_[k].kin.reseed(seed + k * 0x9E3779B97F4A7C15ull);
+        }
+    }
+
+    // Advance each slot's vehicles by step seconds per tick instead of the time
+    // since its previous tick, so motion depends on the tick count alone
+    void setFixedStep(double step) { fixed_step_ = step; }
+
+    // Write the fleet's evolving state (see fleet_snapshot.h) to filename,
+    // replacing it only once complete. Call between ticks, while no worker is
+    // stepping.
+    bool saveSnapshot(const std::string& filename) const {
+        std::string partial = filename + ".tmp";
+        SnapshotWriter out(partial);
+        if (!out.ok()) {
+            logger().error("Could not create snapshot file: ", partial);
+            return false;
+        }
+        FleetSnapshotHeader header = {};
+        std::memcpy(header.magic, FleetSnapshotHeader::kMagic, sizeof(header.magic));
+        header.version = FleetSnapshotHeader::kVersion;
+        header.shard_count = static_cast<uint32_t>(shards_.size());
+        header.vehicle_count = vehicle_count_;
+        header.route_points = route_->size();
+        header.route_length = route_->loopLength();
+        header.taken_at = PublishPath::wallClockMillis();
+        out.value(header);
+        for (auto& shard : shards_) {
+            shard.kin.save(out);
+            out.array(shard.states);
+        }
+        if (!out.finish() || std::rename(partial.c_str(), filename.c_str()) != 0) {
+            logger().error("Could not write snapshot file: ", filename);
+            std::remove(partial.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Continue from a snapshot taken by a fleet of the same layout: vehicles,
+    // connections and route. Call after setRoute and before the first publish.
+    // Every vehicle's next position goes out in full (a compact keyframe, never
+    // suppressed by dead reckoning), since whoever consumes the restored fleet
+    // has not seen the records before it.
+    bool loadSnapshot(const std::string& filename) {
+        SnapshotReader in(filename);
+        FleetSnapshotHeader header;
+        if (!in.ok() || !in.value(header) ||
+            std::memcmp(header.magic, FleetSnapshotHeader::kMagic, sizeof(header.magic)) != 0) {
+            logger().error("Not a fleet snapshot: ", filename);
+            return false;
+        }
+        if (header.version != FleetSnapshotHeader::kVersion) {
+            logger().error("Unsupported fleet snapshot version ", header.version, ": ", filename);
+            return false;
+        }
+        if (header.vehicle_count != vehicle_count_ || header.shard_count != shards_.size() ||
+            header.route_points != route_->size() || header.route_length != route_->loopLength()) {
+            logger().error("Snapshot ", filename, " is of ", header.vehicle_count, " vehicles over ",
+                           header.shard_count, " connection(s) on a ", header.route_points,
+                           "-point route; this fleet has ", vehicle_count_, " over ", shards_.size(), " on ",
+                           route_->size());
+            return false;
+        }
+        for (auto& shard : shards_) {
+            if (!shard.kin.load(in) || !in.array(shard.states)) {
+                logger().error("Truncated or corrupt fleet snapshot: ", filename);
+                return false;
+            }
+            for (size_t j = 0; j < shard.kin.size(); j++) {
+                if (shard.kin.segment(j) >= route_->size() || shard.states[j].topic >= shard.pools.size()) {
+                    logger().error("Corrupt fleet snapshot: ", filename);
+                    return false;
+                }
+                shard.states[j].basisLost();
+            }
+        }
+        if (!in.atEnd()) {
+            logger().warn("Ignoring trailing data in fleet snapshot: ", filename);
+        }
+        return true;
+    }
+
+    void setDeadReckoning(const DeadReckoningPolicy& policy) {
+        for (auto& shard : shards_) {
+            shard.path.setDeadReckoning(policy);
+        }
+    }
+
+    // Batch positions into one frame stream per shard
+    void enableBatching(const std::string& batch_topic, int qos, size_t max_count, size_t max_bytes,
+                        std::chrono::milliseconds flush_window) {
+        batchers_.clear();
+        for (auto& shard : shards_) {
+            shard.batcher = std::make_shared<PositionBatcher>(
+                shard.client, shard.window, batch_topic, qos, max_count, max_bytes, flush_window);
+            if (shard.outbound) shard.batcher->setOutbound(shard.outbound);
+            batchers_.push_back(shard.batcher);
+            shard.path.setBatcher(shard.batcher);
+        }
+    }
+
+    // Give every connection a store-and-forward buffer; with spill_dir set each
+    // spills to <spill_dir>/<connection id>.spill. Call before enableOutboundQueue.
+    bool enableStoreForward(StoreForwardOptions options, const std::string& spill_dir) {
+        for (auto& shard : shards_) {
+            if (!spill_dir.empty()) options.spill_file = spill_dir + "/" + shard.client->get_client_id() + ".spill";
+            shard.spool = std::make_shared<StoreForward>(options);
+            if (!shard.spool->open()) return false;
+            if (shard.batcher) shard.batcher->setStoreForward(shard.spool);
+            shard.path.setStoreForward(shard.spool);
+        }
+        return true;
+    }
+
+    bool hasStoreForward() const { return shards_.front().spool != nullptr; }
+
+    // Unsent messages held across all connections
+    size_t backlog() const {
+        size_t total = 0;
+        for (auto& shard : shards_) total += shard.spool ? shard.spool->backlog() : 0;
+        return total;
+    }
+
+    uint64_t backlogDrops() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) total += shard.spool ? shard.spool->dropped() : 0;
+        return total;
+    }
+
+    // Compress each shard's batched frames; call after enableBatching
+    bool enableCompression(Compression compression, int level, size_t threshold, const std::string& dictionary) {
+        for (auto& shard : shards_) {
+            if (!shard.batcher) return false;
+            auto compressor = std::make_unique<FrameCompressor>(compression, level, threshold);
+            if (!dictionary.empty() && !compressor->loadDictionary(dictionary)) return false;
+            shard.batcher->setCompressor(std::move(compressor));
+        }
+        return true;
+    }
+
+    // Publish compact records; vehicle i is numbered first_index + i
+    void enableCompact(uint32_t first_index, uint32_t keyframe_interval) {
+        for (auto& shard : shards_) {
+            shard.path.setCompact(first_index, keyframe_interval);
+        }
+    }
+
+    // Send positions as UDP datagrams to destination (host:port) instead of
+    // publishing over MQTT, one socket per shard writing batch_size at a time
+    bool enableDatagram(const std::string& destination, size_t batch_size) {
+        for (auto& shard : shards_) {
+            shard.datagram = std::make_shared<DatagramSender>(batch_size);
+            if (!shard.datagram->open(destination)) return false;
+            // Queued datagrams hold their pool slots until the batch is written
+            for (auto& pool : shard.pools) {
+                pool->reserveSlots(pool->slotCount() + shard.datagram->batchSize());
+            }
+            shard.path.setDatagram(shard.datagram);
+        }
+        return true;
+    }
+
+    bool hasDatagram() const { return shards_.front().datagram != nullptr; }
+
+    uint64_t datagramDrops() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) total += shard.datagram ? shard.datagram->dropped() : 0;
+        return total;
+    }
+
+    // Sign or MAC every payload (see message_auth.h), one stream per
+    // connection identified by its client ID's hash; checkpoints go to
+    // checkpoint_topic. Call after enableBatching. Authentication runs inline
+    // on the worker stepping the shard, so it spreads over the worker pool.
+    bool enableAuthentication(Authentication mode, std::shared_ptr<const SigningKey> key,
+                              const std::string& hmac_key, const std::string& checkpoint_topic,
+                              uint32_t checkpoint_interval) {
+        for (auto& shard : shards_) {
+            uint32_t stream = static_cast<uint32_t>(sharding::hashKey(shard.client->get_client_id()));
+            shard.auth = std::make_shared<MessageAuthenticator>(mode, key, hmac_key, stream, checkpoint_topic, qos_,
+                                                                checkpoint_interval);
+            if (!shard.auth->ok()) return false;
+            if (shard.batcher) shard.batcher->setAuthenticator(shard.auth);
+            shard.path.setAuthenticator(shard.auth);
+        }
+        return true;
+    }
+
+    // Publish JSON events on event_topic when vehicles come within proximity_m
+    // of each other (0 to disable) or cross one of geofences (may be null); see
+    // updateSpatialEvents
+    void enableSpatialEvents(double proximity_m, std::shared_ptr<const GeofenceSet> geofences,
+                             const std::string& event_topic) {
+        spatial_ = std::make_unique<SpatialEvents>(proximity_m, std::move(geofences));
+        event_topic_ = event_topic;
+        event_lat_.resize(vehicle_count_);
+        event_lon_.resize(vehicle_count_);
+        event_placed_.resize(vehicle_count_);
+        shard_of_.resize(vehicle_count_);
+        for (size_t k = 0; k < shards_.size(); k++) {
+            for (uint32_t vehicle : shards_[k].vehicles) shard_of_[vehicle] = static_cast<uint32_t>(k);
+        }
+    }
+
+    bool hasSpatialEvents() const { return spatial_ != nullptr; }
+
+    // Index the fleet at its current positions and publish the proximity and
+    // geofence events since the previous call, over each event's vehicle's
+    // connection. Vehicles not stepped yet (their shard is not ready, or their
+    // phase slot has not come round) have no position and are left out. Call
+    // between ticks, while no worker is stepping; returns the number of events.
+    size_t updateSpatialEvents() {
+        if (!spatial_) return 0;
+        uint64_t started = metrics::nowNanos();
+        for (auto& shard : shards_) {
+            for (size_t s = 0; s < shard.slot_stepped.size(); s++) {
+                uint8_t placed = shard.slot_stepped[s] != std::chrono::steady_clock::time_point{};
+                for (size_t j = shard.phase_bounds[s]; j < shard.phase_bounds[s + 1]; j++) {
+                    event_lat_[shard.vehicles[j]] = shard.kin.lat(j);
+                    event_lon_[shard.vehicles[j]] = shard.kin.lon(j);
+                    event_placed_[shard.vehicles[j]] = placed;
+                }
+            }
+        }
+
+        struct Event {
+            size_t vehicle;
+            size_t other;  // peer vehicle, or geofence
+            double meters;
+            bool entered;
+            bool geofence;
+        };
+        std::vector<Event> events;
+        spatial_->update(
+            event_lat_.data(), event_lon_.data(), vehicle_count_, event_placed_.data(),
+            [&](size_t i, size_t j, double meters) { events.push_back({i, j, meters, true, false}); },
+            [&](size_t i, size_t fence, bool entered) { events.push_back({i, fence, 0.0, entered, true}); });
+        metrics::Registry& m = metrics::registry();
+        m.spatial_update.record(metrics::nowNanos() - started);
+
+        int64_t timestamp = PublishPath::wallClockMillis();
+        for (auto& event : events) {
+            std::string payload;
+            if (event.geofence) {
+                m.geofence_events.add();
+                payload = "{\"event\":\"" + std::string(event.entered ? "geofence_enter" : "geofence_exit") +
+                          "\",\"vehicle\":\"" + ids_(static_cast<uint32_t>(event.vehicle)) + "\",\"geofence\":\"" +
+                          spatial::jsonEscape((*spatial_->geofences())[event.other].name) +
+                          "\",\"timestamp\":" + std::to_string(timestamp) + "}";
+            } else {
+                m.proximity_events.add();
+                char distance[32];
+                std::snprintf(distance, sizeof(distance), "%.1f", event.meters);
+                payload = "{\"event\":\"proximity\",\"vehicle\":\"" + ids_(static_cast<uint32_t>(event.vehicle)) +
+                          "\",\"peer\":\"" + ids_(static_cast<uint32_t>(event.other)) + "\",\"distance_m\":" + distance +
+                          ",\"timestamp\":" + std::to_string(timestamp) + "}";
+            }
+            logger().debug("Event: ", payload);
+            publishEvent(shards_[shard_of_[event.vehicle]], std::move(payload));
+        }
+        for (auto& shard : shards_) {
+            if (shard.datagram) shard.datagram->flush();
+        }
+        return events.size();
+    }
+
+    // Decouple the tick workers from network I/O: each shard serializes into a
+    // bounded queue drained by its own publisher thread
+    void enableOutboundQueue(size_t capacity, QueueFullPolicy policy) {
+        for (auto& shard : shards_) {
+            shard.outbound = std::make_shared<OutboundQueue>(capacity, policy);
+            // Queued messages hold their pool slots until published
+            for (auto& pool : shard.pools) {
+                pool->reserveSlots(shard.window->maxInFlight() + shard.outbound->capacity() + 1);
+            }
+            shard.publisher = std::make_unique<OutboundPublisher>(shard.outbound, shard.client, shard.window,
+                                                                  shard.spool);
+            if (shard.batcher) shard.batcher->setOutbound(shard.outbound);
+            shard.path.setOutbound(shard.outbound);
+        }
+    }
+
+    bool hasOutboundQueue() const { return shards_.front().outbound != nullptr; }
+
+    size_t queueDepth() const {
+        size_t total = 0;
+        for (auto& shard : shards_) {
+            if (shard.outbound) total += shard.outbound->depth();
+        }
+        return total;
+    }
+
+    // Deepest any one shard's queue got since the last call
+    size_t takeQueueMaxDepth() {
+        size_t deepest = 0;
+        for (auto& shard : shards_) {
+            if (!shard.outbound) continue;
+            deepest = std::max(deepest, shard.outbound->maxDepth());
+            shard.outbound->resetMaxDepth();
+        }
+        return deepest;
+    }
+
+    uint64_t queueDrops() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) {
+            if (shard.outbound) total += shard.outbound->dropped();
+        }
+        return total;
+    }
+
+    uint64_t queueFullWaits() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) {
+            if (shard.outbound) total += shard.outbound->fullWaits();
+        }
+        return total;
+    }
+
+    // Time messages spent queued since the last call, over all shards
+    void takeQueueLatency(LatencyHistogram& into) {
+        for (auto& shard : shards_) {
+            if (shard.publisher) shard.publisher->takeLatency(into);
+        }
+    }
+
+    size_t inFlight() const {
+        size_t total = 0;
+        for (auto& shard : shards_) total += shard.window->inFlight();
+        return total;
+    }
+
+    uint64_t publishFailures() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) total += shard.window->failed();
+        return total;
+    }
+
+    // Payload buffers allocated after startup; stays flat in steady state
+    uint64_t payloadAllocations() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) {
+            for (auto& pool : shard.pools) total += pool->allocations();
+            if (shard.batcher) total += shard.batcher->allocations();
+        }
+        return total;
+    }
+
+    uint64_t publishStalls() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) total += shard.window->stalls();
+        return total;
+    }
+
+    // Start connecting every shard and return at once. Until a shard's
+    // connection first comes up its vehicles are not ticked, so a slow
+    // handshake on one connection delays no other; after timeout the
+    // stragglers are ticked anyway and keep retrying in the background (their
+    // messages spooled or counted as failed meanwhile).
+    void startConnecting(BackoffPolicy backoff, std::chrono::milliseconds timeout) {
+        logger().info("Opening ", shards_.size(), " MQTT connection(s) to ", broker_count_, " broker(s)");
+        connections_ = std::make_unique<ConnectionManager>(qos_, shards_.front().window->maxInFlight(), backoff);
+        for (auto& shard : shards_) {
+            connections_->add(shard.client);
+            shard.ready = false;
+        }
+        ready_deadline_ = std::chrono::steady_clock::now() + timeout;
+        connections_->start();
+    }
+
+    // Start connecting every shard and wait up to timeout for them, then tick
+    // every shard. Returns false only if none connected.
+    bool connect(BackoffPolicy backoff, std::chrono::milliseconds timeout) {
+        startConnecting(backoff, timeout);
+        size_t connected = connections_->waitConnected(timeout);
+        if (connected < shards_.size()) {
+            logger().warn(connected, " of ", shards_.size(), " connection(s) up, retrying the rest in the background");
+        }
+        ready_deadline_ = std::chrono::steady_clock::now();
+        return connected > 0;
+    }
+
+    // Shards whose vehicles are being ticked
+    size_t readyShards() const {
+        return static_cast<size_t>(std::count_if(shards_.begin(), shards_.end(), [](const Shard& s) { return s.ready; }));
+    }
+
+    // Connections up at least once; first and last are when the earliest and
+    // latest of them first came up
+    size_t firstConnects(std::chrono::steady_clock::time_point& first, std::chrono::steady_clock::time_point& last) {
+        return connections_ ? connections_->firstConnects(first, last) : 0;
+    }
+
+    // Connections currently up
+    size_t connected() const { return connections_ ? connections_->connected() : 0; }
+
+    void disconnect() {
+        for (auto& batcher : batchers_) {
+            batcher->flush();
+        }
+        for (auto& shard : shards_) {
+            if (shard.publisher) shard.publisher->stop();
+        }
+        if (connections_) connections_->stop();
+        for (auto& shard : shards_) {
+            if (!shard.client->is_connected()) continue;
+            try {
+                if (!shard.window->drain(std::chrono::seconds(5))) {
+                    logger().warn("Timed out waiting for ", shard.window->inFlight(), " in-flight messages");
+                }
+                shard.client->disconnect()->wait();
+            }
+            catch (const mqtt::exception& exc) {
+                logger().error("Error disconnecting: ", exc.what());
+            }
+        }
+        logger().info("Disconnected from MQTT broker");
+    }
+
+    void publishPositions() {
+        for (size_t slot = 0; slot < phaseSlots(); slot++) {
+            publishSlot(slot);
+        }
+    }
+
+    // Step and publish the vehicles whose phase falls in the given slot, one
+    // worker task per shard; returns how many
+    size_t publishSlot(size_t slot) {
+        slot %= phase_slots_;
+        updateReadiness();
+        auto task = [this, slot](size_t k) {
+            if (shards_[k].ready) publishShardSlot(shards_[k], slot);
+        };
+        workers_.run(shards_.size(), task);
+
+        size_t published = 0;
+        for (auto& shard : shards_) {
+            if (shard.ready) published += shard.phase_bounds[slot + 1] - shard.phase_bounds[slot];
+        }
+        return published;
+    }
+
+    // Step vehicles through count ticks from first that the scheduler skipped
+    // without publishing them, in tick order, so a fixed-step fleet draws and
+    // moves as if it had not overrun. A no-op when following the clock, where
+    // the next tick's step covers the skipped time.
+    void skipTicks(uint64_t first, uint64_t count) {
+        if (fixed_step_ <= 0 || count == 0) return;
+        updateReadiness();
+        auto task = [this, first, count](size_t k) {
+            Shard& shard = shards_[k];
+            if (!shard.ready) return;
+            for (uint64_t tick = first; tick < first + count; tick++) stepShardSlot(shard, tick % phase_slots_);
+        };
+        workers_.run(shards_.size(), task);
+    }
+
+private:
+    // Where vehicle starts when vehicle_count are spread evenly along the route
+    size_t startIndex(size_t vehicle, size_t vehicle_count) const {
+        return route_->empty() ? 0 : vehicle * route_->size() / vehicle_count;
+    }
+
+    void updateReadiness() {
+        bool waited_out = std::chrono::steady_clock::now() >= ready_deadline_;
+        for (auto& shard : shards_) {
+            if (!shard.ready) shard.ready = waited_out || shard.datagram || shard.client->is_connected();
+        }
+    }
+
+    // Events are rare next to positions, so they skip the payload pools and
+    // outbound queue and go straight to the shard's transport
+    void publishEvent(Shard& shard, std::string payload) {
+        auto message = mqtt::make_message(event_topic_, std::move(payload), qos_, false);
+        if (shard.datagram) {
+            shard.datagram->send(std::move(message));
+        } else if (shard.spool) {
+            shard.spool->send(*shard.client, *shard.window, message);
+        } else if (!shard.client->is_connected()) {
+            shard.window->reject();
+        } else {
+            shard.window->acquire();
+            try {
+                shard.client->publish(message, PublishWindow::startContext(), *shard.window);
+            } catch (const mqtt::exception& exc) {
+                shard.window->cancel();
+                static LogRateLimit limit(5, std::chrono::seconds(1));
+                logger().limited(limit, LogLevel::Warn, "Could not publish an event: ", exc.what());
+            }
+        }
+    }
+
+    // Advance the vehicles of one of shard's slots by one tick
+    void stepShardSlot(Shard& shard, size_t slot) {
+        size_t begin = shard.phase_bounds[slot];
+        size_t end = shard.phase_bounds[slot + 1];
+        if (begin == end) return;
+
+        auto now = std::chrono::steady_clock::now();
+        auto& stepped = shard.slot_stepped[slot];
+        double dt = fixed_step_ > 0 ? fixed_step_
+                    : stepped == std::chrono::steady_clock::time_point{} ? 0.0
+                    : std::chrono::duration<double>(now - stepped).count();
+        stepped = now;
+        shard.kin.step(*route_, begin, end, dt);
+        shard.kinematics_time += std::chrono::steady_clock::now() - now;
+    }
+
+    void publishShardSlot(Shard& shard, size_t slot) {
+        size_t begin = shard.phase_bounds[slot];
+        size_t end = shard.phase_bounds[slot + 1];
+        if (begin == end) return;
+        stepShardSlot(shard, slot);
+
+        // Every vehicle of a shard is configured alike, so the publish path is
+        // picked once per slot and one timestamp serves the whole slot
+        const FleetKinematics& kin = shard.kin;
+        int64_t timestamp = PublishPath::wallClockMillis();
+        pipeline::dispatch(shard.path.pipelineConfig(), [&](auto encoding, auto transport) {
+            for (size_t j = begin; j < end; j++) {
+                shard.path.template publishAs<decltype(encoding), decltype(transport)>(
+                    shard.states[j], shard.vehicles[j], kin.lat(j), kin.lon(j), kin.speed(j), kin.heading(j),
+                    timestamp);
+            }
+        });
+        if (shard.datagram) shard.datagram->flush();
+    }
+};
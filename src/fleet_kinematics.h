@@ -0,0 +1,426 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "fleet_snapshot.h"
+#include "kinematics.h"
+#include "route.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEOVAN_HAVE_AVX2_KERNEL 1
+#endif
+
+// Per-tick motion of every fleet vehicle, kept structure-of-arrays so one
+// kernel updates a whole range of vehicles at once: ease speed towards a
+// target, advance along the shared route, interpolate inside the segment and
+// add heading noise.
+//
+// A vehicle's state is 28 bytes, so a million of them stay well inside the
+// caches' reach of DRAM bandwidth: segment index, offset into the segment,
+// speed, target speed and heading as float, and the last position in the
+// route's fixed-point 1e-7 degrees. Arithmetic is done in double and rounded
+// on store, the same way in both kernels. Random numbers are counter-based, a
+// 32-bit hash of (seed, draw, vehicle), so there is no generator state per
+// vehicle at all and the hash vectorizes with shifts, xors and 32-bit
+// multiplies.
+//
+// On x86 an AVX2 kernel is selected at runtime when the CPU supports it. The
+// scalar kernel is written as straight loops over the arrays so compilers can
+// auto-vectorize it elsewhere (e.g. NEON on aarch64).
+class FleetKinematics {
+private:
+    // Vehicle state
+    std::vector<uint32_t> segment_;
+    std::vector<float> offset_;
+    std::vector<float> speed_;
+    std::vector<float> target_;
+    // Outputs of the last step
+    std::vector<int32_t> lat_;  // kFixedPointScale units
+    std::vector<int32_t> lon_;
+    std::vector<float> heading_;
+    // Vehicles that left their segment this step, fixed up after the vector pass
+    std::vector<uint32_t> crossed_;
+    uint32_t seed_;
+    uint32_t draws_;  // random draws taken so far, each one value per vehicle
+
+    MotionModel motion_;
+    double max_accel_;
+    double min_speed_;
+    double speed_span_;
+    double heading_noise_;
+    bool use_avx2_;
+
+public:
+    FleetKinematics(size_t count, uint64_t seed, double min_speed = 8.0, double max_speed = 15.0,
+                    double heading_noise = 5.0)
+        : segment_(count, 0), offset_(count, 0.0f), speed_(count), target_(count),
+          lat_(count, 0), lon_(count, 0), heading_(count, 0.0f),
+          seed_(0), draws_(0), motion_(MotionModel::Interpolate), max_accel_(1.5),
+          min_speed_(min_speed), speed_span_(max_speed - min_speed), heading_noise_(heading_noise),
+          use_avx2_(false) {
+        reseed(seed);
+#ifdef GEOVAN_HAVE_AVX2_KERNEL
+        use_avx2_ = __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    size_t size() const { return segment_.size(); }
+
+    // Bytes held for the vehicles' state
+    size_t stateBytes() const {
+        return segment_.capacity() * sizeof(uint32_t) + crossed_.capacity() * sizeof(uint32_t) +
+               (offset_.capacity() + speed_.capacity() + target_.capacity() + heading_.capacity()) * sizeof(float) +
+               (lat_.capacity() + lon_.capacity()) * sizeof(int32_t);
+    }
+
+    // Restart the random draws from seed and sample new speeds; vehicle i
+    // then draws the same values for the same seed on every run
+    void reseed(uint64_t seed) {
+        seed_ = static_cast<uint32_t>(seed ^ (seed >> 32));
+        draws_ = 0;
+        uint32_t key = drawKey();
+        for (size_t i = 0; i < size(); i++) {
+            speed_[i] = static_cast<float>(min_speed_ + speed_span_ * toUnit(random(key, static_cast<uint32_t>(i))));
+            target_[i] = speed_[i];
+        }
+    }
+
+    // Write the evolving state; motion settings are configuration and not included
+    void save(SnapshotWriter& out) const {
+        out.value(seed_);
+        out.value(draws_);
+        out.array(segment_);
+        out.array(offset_);
+        out.array(speed_);
+        out.array(target_);
+        out.array(lat_);
+        out.array(lon_);
+        out.array(heading_);
+    }
+
+    // Read what save wrote, for the same number of vehicles; segments must be
+    // valid for the route being followed
+    bool load(SnapshotReader& in) {
+        return in.value(seed_) && in.value(draws_) && in.array(segment_) && in.array(offset_) && in.array(speed_) &&
+               in.array(target_) && in.array(lat_) && in.array(lon_) && in.array(heading_);
+    }
+
+    void place(size_t i, size_t segment) {
+        segment_[i] = static_cast<uint32_t>(segment);
+        offset_[i] = 0.0f;
+    }
+
+    void setMotion(MotionModel model, double max_accel) {
+        motion_ = model;
+        max_accel_ = max_accel;
+    }
+
+    // Force the portable kernel (e.g. to compare against the vector one)
+    void setVectorized(bool enabled) {
+#ifdef GEOVAN_HAVE_AVX2_KERNEL
+        use_avx2_ = enabled && __builtin_cpu_supports("avx2");
+#else
+        (void)enabled;
+#endif
+    }
+    bool vectorized() const { return use_avx2_; }
+
+    // First vehicle whose stored state differs bit for bit from other's, or
+    // size() if none; for checking the vector kernel against the scalar one.
+    // Fleets of different sizes or random draws differ from vehicle 0.
+    size_t firstDifference(const FleetKinematics& other) const {
+        if (size() != other.size() || seed_ != other.seed_ || draws_ != other.draws_) return 0;
+        size_t first = size();
+        auto scan = [&first](const auto& a, const auto& b) {
+            for (size_t i = 0; i < first; i++) {
+                if (std::memcmp(&a[i], &b[i], sizeof(a[i])) != 0) {
+                    first = i;
+                    break;
+                }
+            }
+        };
+        scan(segment_, other.segment_);
+        scan(offset_, other.offset_);
+        scan(speed_, other.speed_);
+        scan(target_, other.target_);
+        scan(lat_, other.lat_);
+        scan(lon_, other.lon_);
+        scan(heading_, other.heading_);
+        return first;
+    }
+
+    double lat(size_t i) const { return lat_[i] / kFixedPointScale; }
+    double lon(size_t i) const { return lon_[i] / kFixedPointScale; }
+    double speed(size_t i) const { return speed_[i]; }
+    double heading(size_t i) const { return heading_[i]; }
+    size_t segment(size_t i) const { return segment_[i]; }
+
+    // Advance vehicles [begin, end) by dt seconds along route
+    void step(const Route& route, size_t begin, size_t end, double dt) {
+        if (route.empty() || begin >= end) return;
+        uint32_t target_key = drawKey();
+        uint32_t noise_key = drawKey();
+        if (motion_ == MotionModel::Points) {
+            stepPoints(route, begin, end, target_key, noise_key);
+            return;
+        }
+
+        bool can_move = route.size() >= 2 && route.loopLength() > 0.0;
+        crossed_.clear();
+#ifdef GEOVAN_HAVE_AVX2_KERNEL
+        if (use_avx2_ && can_move) {
+            size_t vector_end = begin + (end - begin) / 4 * 4;
+            stepAvx2(route, begin, vector_end, dt, target_key, noise_key);
+            begin = vector_end;
+        }
+#endif
+        stepScalar(route, begin, end, dt, can_move, target_key, noise_key);
+        fixupCrossings(route);
+    }
+
+private:
+    // lowbias32 (Wellons): a bijective 32-bit integer hash with good avalanche
+    static uint32_t mix(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7FEB352Du;
+        x ^= x >> 15;
+        x *= 0x846CA68Bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    // Key of the next draw; every vehicle's value of it is random(key, vehicle)
+    uint32_t drawKey() { return mix(seed_ + draws_++ * 0x85EBCA6Bu); }
+
+    static uint32_t random(uint32_t key, uint32_t vehicle) { return mix(key + vehicle * 0x9E3779B9u); }
+
+    // Top 31 bits as a double in [0, 1); exact, so the vector kernel matches
+    static double toUnit(uint32_t bits) { return static_cast<int32_t>(bits >> 1) * (1.0 / 2147483648.0); }
+
+    static int32_t toFixed(double degrees) { return static_cast<int32_t>(std::nearbyint(degrees * kFixedPointScale)); }
+
+    void storePosition(size_t i, double lat, double lon) {
+        lat_[i] = toFixed(lat);
+        lon_[i] = toFixed(lon);
+    }
+
+    static double wrapHeading(double heading) {
+        if (heading < 0) heading += 360.0;
+        if (heading >= 360.0) heading -= 360.0;
+        return heading;
+    }
+
+    // Speed update, offset advance and interpolation. Vehicles that leave their
+    // segment are queued in crossed_ with the noise sample parked in heading_.
+    void stepScalar(const Route& route, size_t begin, size_t end, double dt, bool can_move, uint32_t target_key,
+                    uint32_t noise_key) {
+        const double* dist = route.distanceData();
+        const float* bearing = route.bearingData();
+        double max_change = max_accel_ * dt;
+        for (size_t i = begin; i < end; i++) {
+            uint32_t vehicle = static_cast<uint32_t>(i);
+            double u_target = toUnit(random(target_key, vehicle));
+            double u_noise = toUnit(random(noise_key, vehicle));
+            double speed = speed_[i];
+            double target = target_[i];
+            if (std::fabs(target - speed) < 0.1) target = min_speed_ + speed_span_ * u_target;
+            double change = std::min(std::max(target - speed, -max_change), max_change);
+            double new_speed = speed + change;
+            speed_[i] = static_cast<float>(new_speed);
+            target_[i] = static_cast<float>(target);
+            double noise = (2.0 * u_noise - 1.0) * heading_noise_;
+
+            uint32_t seg = segment_[i];
+            double offset = offset_[i];
+            if (can_move) {
+                offset += 0.5 * (speed + new_speed) * dt;
+                offset_[i] = static_cast<float>(offset);
+                if (offset >= dist[seg + 1] - dist[seg]) {
+                    heading_[i] = static_cast<float>(noise);
+                    crossed_.push_back(vehicle);
+                    continue;
+                }
+            }
+            double lat, lon;
+            kinematics::interpolate(route, RouteCursor{seg, offset}, lat, lon);
+            storePosition(i, lat, lon);
+            heading_[i] = static_cast<float>(wrapHeading(bearing[seg] + noise));
+        }
+    }
+
+    // Vehicles whose offset ran past their segment: place them by distance along
+    // the loop with a binary search of the cumulative distance table
+    void fixupCrossings(const Route& route) {
+        const double* dist = route.distanceData();
+        const float* bearing = route.bearingData();
+        size_t n = route.size();
+        double loop = route.loopLength();
+        for (uint32_t i : crossed_) {
+            double along = std::fmod(dist[segment_[i]] + offset_[i], loop);
+            size_t seg = static_cast<size_t>(std::upper_bound(dist, dist + n + 1, along) - dist) - 1;
+            if (seg >= n) seg = n - 1;
+            double offset = along - dist[seg];
+            segment_[i] = static_cast<uint32_t>(seg);
+            offset_[i] = static_cast<float>(offset);
+            double lat, lon;
+            kinematics::interpolate(route, RouteCursor{seg, offset}, lat, lon);
+            storePosition(i, lat, lon);
+            heading_[i] = static_cast<float>(wrapHeading(bearing[seg] + heading_[i]));
+        }
+    }
+
+    // One route point per tick: report the current point, then move to the next
+    void stepPoints(const Route& route, size_t begin, size_t end, uint32_t speed_key, uint32_t noise_key) {
+        const float* bearing = route.bearingData();
+        size_t n = route.size();
+        for (size_t i = begin; i < end; i++) {
+            uint32_t vehicle = static_cast<uint32_t>(i);
+            double u_speed = toUnit(random(speed_key, vehicle));
+            double u_noise = toUnit(random(noise_key, vehicle));
+            uint32_t seg = segment_[i];
+            storePosition(i, route.lat(seg), route.lon(seg));
+            speed_[i] = static_cast<float>(min_speed_ + speed_span_ * u_speed);
+            heading_[i] = static_cast<float>(wrapHeading(bearing[seg] + (2.0 * u_noise - 1.0) * heading_noise_));
+            segment_[i] = static_cast<uint32_t>((seg + 1) % n);
+            offset_[i] = 0.0f;
+        }
+    }
+
+#ifdef GEOVAN_HAVE_AVX2_KERNEL
+    __attribute__((target("avx2")))
+    static __m256i mixAvx2(__m256i x) {
+        x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+        x = _mm256_mullo_epi32(x, _mm256_set1_epi32(static_cast<int>(0x7FEB352Du)));
+        x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+        x = _mm256_mullo_epi32(x, _mm256_set1_epi32(static_cast<int>(0x846CA68Bu)));
+        return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    }
+
+    // toUnit of four 32-bit lanes
+    __attribute__((target("avx2")))
+    static __m256d toUnitAvx2(__m128i bits) {
+        return _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_srli_epi32(bits, 1)), _mm256_set1_pd(1.0 / 2147483648.0));
+    }
+
+    // Masked form with a zeroed source; the plain gather trips -Wmaybe-uninitialized on GCC
+    __attribute__((target("avx2")))
+    static __m256d gatherDouble(const double* base, __m128i index) {
+        __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, index, all, 8);
+    }
+
+    __attribute__((target("avx2")))
+    static __m256d gatherCoord(const void* base, __m128i index, bool fixed_point) {
+        if (fixed_point) {
+            __m128i fixed = _mm_i32gather_epi32(static_cast<const int*>(base), index, 4);
+            return _mm256_div_pd(_mm256_cvtepi32_pd(fixed), _mm256_set1_pd(kFixedPointScale));
+        }
+        return gatherDouble(static_cast<const double*>(base), index);
+    }
+
+    // Four vehicles per iteration; same arithmetic as stepScalar, so both kernels
+    // produce identical results
+    __attribute__((target("avx2")))
+    void stepAvx2(const Route& route, size_t begin, size_t end, double dt, uint32_t target_key, uint32_t noise_key) {
+        const double* dist = route.distanceData();
+        const float* bearing = route.bearingData();
+        const bool fixed = route.isFixedPoint();
+        const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFll));
+        const __m256d resample = _mm256_set1_pd(0.1);
+        const __m256d min_speed = _mm256_set1_pd(min_speed_);
+        const __m256d span = _mm256_set1_pd(speed_span_);
+        const __m256d max_change = _mm256_set1_pd(max_accel_ * dt);
+        const __m256d neg_max_change = _mm256_set1_pd(-max_accel_ * dt);
+        const __m256d half_dt = _mm256_set1_pd(0.5 * dt);
+        const __m256d noise_scale = _mm256_set1_pd(heading_noise_);
+        const __m256d one = _mm256_set1_pd(1.0);
+        const __m256d two = _mm256_set1_pd(2.0);
+        const __m128i count = _mm_set1_epi32(static_cast<int>(route.size()));
+        const __m128i one_i = _mm_set1_epi32(1);
+        const __m256d zero = _mm256_setzero_pd();
+        const __m256d d180 = _mm256_set1_pd(180.0);
+        const __m256d neg180 = _mm256_set1_pd(-180.0);
+        const __m256d d360 = _mm256_set1_pd(360.0);
+        const __m256d fixed_scale = _mm256_set1_pd(kFixedPointScale);
+        // Both draws of four vehicles hashed at once: target keys in the low
+        // lanes, noise keys in the high ones; the vehicle term of random()
+        // advances by addition
+        const __m256i keys = _mm256_setr_epi32(
+            static_cast<int>(target_key), static_cast<int>(target_key), static_cast<int>(target_key),
+            static_cast<int>(target_key), static_cast<int>(noise_key), static_cast<int>(noise_key),
+            static_cast<int>(noise_key), static_cast<int>(noise_key));
+        const __m256i golden = _mm256_set1_epi32(static_cast<int>(0x9E3779B9u));
+        const __m256i spread_step = _mm256_set1_epi32(static_cast<int>(4 * 0x9E3779B9u));
+        __m256i spread = _mm256_mullo_epi32(
+            _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(begin)), _mm256_setr_epi32(0, 1, 2, 3, 0, 1, 2, 3)),
+            golden);
+
+        for (size_t i = begin; i < end; i += 4) {
+            __m256i bits = mixAvx2(_mm256_add_epi32(keys, spread));
+            spread = _mm256_add_epi32(spread, spread_step);
+            __m256d u_target = toUnitAvx2(_mm256_castsi256_si128(bits));
+            __m256d u_noise = toUnitAvx2(_mm256_extracti128_si256(bits, 1));
+
+            // Speed eases towards the target, resampled once reached
+            __m256d speed = _mm256_cvtps_pd(_mm_loadu_ps(&speed_[i]));
+            __m256d target = _mm256_cvtps_pd(_mm_loadu_ps(&target_[i]));
+            __m256d reached = _mm256_cmp_pd(_mm256_and_pd(_mm256_sub_pd(target, speed), abs_mask),
+                                            resample, _CMP_LT_OQ);
+            target = _mm256_blendv_pd(target, _mm256_add_pd(min_speed, _mm256_mul_pd(span, u_target)), reached);
+            __m256d change = _mm256_min_pd(_mm256_max_pd(_mm256_sub_pd(target, speed), neg_max_change),
+                                           max_change);
+            __m256d new_speed = _mm256_add_pd(speed, change);
+            _mm_storeu_ps(&speed_[i], _mm256_cvtpd_ps(new_speed));
+            _mm_storeu_ps(&target_[i], _mm256_cvtpd_ps(target));
+            __m256d noise = _mm256_mul_pd(_mm256_sub_pd(_mm256_mul_pd(two, u_noise), one), noise_scale);
+
+            // Advance inside the segment; lanes that leave it are redone by fixupCrossings
+            __m128i seg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&segment_[i]));
+            __m256d length = _mm256_sub_pd(gatherDouble(dist + 1, seg), gatherDouble(dist, seg));
+            __m256d offset = _mm256_add_pd(_mm256_cvtps_pd(_mm_loadu_ps(&offset_[i])),
+                                           _mm256_mul_pd(_mm256_add_pd(speed, new_speed), half_dt));
+            _mm_storeu_ps(&offset_[i], _mm256_cvtpd_ps(offset));
+            __m256d crossed_mask = _mm256_cmp_pd(offset, length, _CMP_GE_OQ);
+            int crossed = _mm256_movemask_pd(crossed_mask);
+            while (crossed) {
+                int lane = __builtin_ctz(crossed);
+                crossed_.push_back(static_cast<uint32_t>(i + lane));
+                crossed &= crossed - 1;
+            }
+
+            // Interpolate between the segment endpoints
+            __m128i next = _mm_add_epi32(seg, one_i);
+            next = _mm_andnot_si128(_mm_cmpeq_epi32(next, count), next);
+            __m256d has_length = _mm256_cmp_pd(length, zero, _CMP_GT_OQ);
+            __m256d t = _mm256_and_pd(_mm256_div_pd(offset, length), has_length);
+
+            __m256d lat0 = gatherCoord(route.latData(), seg, fixed);
+            __m256d lat1 = gatherCoord(route.latData(), next, fixed);
+            __m256d lon0 = gatherCoord(route.lonData(), seg, fixed);
+            __m256d lon1 = gatherCoord(route.lonData(), next, fixed);
+
+            __m256d dlon = _mm256_sub_pd(lon1, lon0);
+            dlon = _mm256_sub_pd(dlon, _mm256_and_pd(_mm256_cmp_pd(dlon, d180, _CMP_GT_OQ), d360));
+            dlon = _mm256_add_pd(dlon, _mm256_and_pd(_mm256_cmp_pd(dlon, neg180, _CMP_LT_OQ), d360));
+
+            __m256d lat = _mm256_add_pd(lat0, _mm256_mul_pd(_mm256_sub_pd(lat1, lat0), t));
+            __m256d lon = _mm256_add_pd(lon0, _mm256_mul_pd(dlon, t));
+            lon = _mm256_sub_pd(lon, _mm256_and_pd(_mm256_cmp_pd(lon, d180, _CMP_GT_OQ), d360));
+            lon = _mm256_add_pd(lon, _mm256_and_pd(_mm256_cmp_pd(lon, neg180, _CMP_LT_OQ), d360));
+            // Rounded to nearest under the default MXCSR mode, like std::nearbyint
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&lat_[i]), _mm256_cvtpd_epi32(_mm256_mul_pd(lat, fixed_scale)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&lon_[i]), _mm256_cvtpd_epi32(_mm256_mul_pd(lon, fixed_scale)));
+
+            // Segment bearing plus noise, wrapped to [0, 360); crossed lanes keep the raw noise
+            __m256d heading = _mm256_add_pd(_mm256_cvtps_pd(_mm_i32gather_ps(bearing, seg, 4)), noise);
+            heading = _mm256_add_pd(heading, _mm256_and_pd(_mm256_cmp_pd(heading, zero, _CMP_LT_OQ), d360));
+            heading = _mm256_sub_pd(heading, _mm256_and_pd(_mm256_cmp_pd(heading, d360, _CMP_GE_OQ), d360));
+            _mm_storeu_ps(&heading_[i], _mm256_cvtpd_ps(_mm256_blendv_pd(heading, noise, crossed_mask)));
+        }
+    }
+#endif
+};
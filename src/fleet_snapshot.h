@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Fleet snapshot file (host byte order, little endian on every supported target):
+//
+//   FleetSnapshotHeader, then for each shard in order its FleetKinematics
+//   state (seed and draw counter, then its arrays) and its VehicleState
+//   array. Every array is a u64 element count followed by the raw elements.
+//
+// Everything that evolves while a fleet runs is in it: route positions,
+// speeds, random draws and sequence numbers, so a restored fleet carries on
+// where the snapshot was taken. Configuration is not; a snapshot restores only
+// into a fleet of the same layout (vehicle count, connections and route),
+// which the header records.
+struct FleetSnapshotHeader {
+    static constexpr char kMagic[8] = {'G', 'V', 'S', 'N', 'A', 'P', '\0', '\0'};
+    static constexpr uint32_t kVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t shard_count;
+    uint64_t vehicle_count;
+    uint64_t route_points;
+    double route_length;  // meters, the loop length
+    int64_t taken_at;     // ms since the epoch
+    uint64_t reserved[2];
+};
+static_assert(sizeof(FleetSnapshotHeader) == 64, "fleet snapshot header layout");
+
+class SnapshotWriter {
+private:
+    std::ofstream file_;
+
+public:
+    explicit SnapshotWriter(const std::string& filename) : file_(filename, std::ios::binary | std::ios::trunc) {}
+
+    bool ok() const { return file_.good(); }
+
+    template <class T>
+    void value(const T& v) {
+        static_assert(std::is_trivially_copyable_v<T>, "snapshot values are written as raw bytes");
+        file_.write(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    template <class T>
+    void array(const std::vector<T>& v) {
+        static_assert(std::is_trivially_copyable_v<T>, "snapshot arrays are written as raw bytes");
+        value(static_cast<uint64_t>(v.size()));
+        file_.write(reinterpret_cast<const char*>(v.data()), static_cast<std::streamsize>(v.size() * sizeof(T)));
+    }
+
+    // Flush and close; false if any write failed
+    bool finish() {
+        file_.close();
+        return !file_.fail();
+    }
+};
+
+// Reads what SnapshotWriter wrote. Arrays are read into vectors already
+// sized for the fleet, and fail on any other element count.
+class SnapshotReader {
+private:
+    std::ifstream file_;
+
+public:
+    explicit SnapshotReader(const std::string& filename) : file_(filename, std::ios::binary) {}
+
+    bool ok() const { return file_.good(); }
+
+    template <class T>
+    bool value(T& v) {
+        static_assert(std::is_trivially_copyable_v<T>, "snapshot values are read as raw bytes");
+        return static_cast<bool>(file_.read(reinterpret_cast<char*>(&v), sizeof(T)));
+    }
+
+    template <class T>
+    bool array(std::vector<T>& v) {
+        static_assert(std::is_trivially_copyable_v<T>, "snapshot arrays are read as raw bytes");
+        uint64_t count = 0;
+        if (!value(count) || count != v.size()) return false;
+        return static_cast<bool>(
+            file_.read(reinterpret_cast<char*>(v.data()), static_cast<std::streamsize>(v.size() * sizeof(T))));
+    }
+
+    // True once every byte has been read
+    bool atEnd() { return file_.peek() == std::char_traits<char>::eof(); }
+};
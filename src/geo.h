@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cmath>
+
+// Great-circle helpers on a spherical Earth (mean radius), degrees in and out.
+namespace geo {
+
+constexpr double kEarthRadiusMeters = 6371008.8;
+constexpr double kDegToRad = M_PI / 180.0;
+constexpr double kRadToDeg = 180.0 / M_PI;
+
+// Haversine distance in meters
+inline double distanceMeters(double lat1, double lon1, double lat2, double lon2) {
+    double phi1 = lat1 * kDegToRad;
+    double phi2 = lat2 * kDegToRad;
+    double dphi = (lat2 - lat1) * kDegToRad;
+    double dlambda = (lon2 - lon1) * kDegToRad;
+    double a = std::sin(dphi / 2) * std::sin(dphi / 2) +
+               std::cos(phi1) * std::cos(phi2) * std::sin(dlambda / 2) * std::sin(dlambda / 2);
+    return 2.0 * kEarthRadiusMeters * std::asin(std::sqrt(std::fmin(1.0, a)));
+}
+
+// Initial true bearing from point 1 towards point 2, in [0, 360)
+inline double initialBearing(double lat1, double lon1, double lat2, double lon2) {
+    double phi1 = lat1 * kDegToRad;
+    double phi2 = lat2 * kDegToRad;
+    double dlambda = (lon2 - lon1) * kDegToRad;
+    double y = std::sin(dlambda) * std::cos(phi2);
+    double x = std::cos(phi1) * std::sin(phi2) - std::sin(phi1) * std::cos(phi2) * std::cos(dlambda);
+    double bearing = std::atan2(y, x) * kRadToDeg;
+    if (bearing < 0) bearing += 360.0;
+    return bearing;
+}
+
+// Point reached from (lat, lon) after meters along the initial true bearing
+inline void destination(double lat, double lon, double bearing, double meters, double& out_lat, double& out_lon) {
+    double phi1 = lat * kDegToRad;
+    double theta = bearing * kDegToRad;
+    double delta = meters / kEarthRadiusMeters;
+    double sin_phi2 = std::sin(phi1) * std::cos(delta) + std::cos(phi1) * std::sin(delta) * std::cos(theta);
+    double phi2 = std::asin(std::fmax(-1.0, std::fmin(1.0, sin_phi2)));
+    double lambda = std::atan2(std::sin(theta) * std::sin(delta) * std::cos(phi1),
+                               std::cos(delta) - std::sin(phi1) * sin_phi2);
+    out_lat = phi2 * kRadToDeg;
+    out_lon = std::remainder(lon + lambda * kRadToDeg, 360.0);
+}
+
+// Smallest angle between two bearings, in [0, 180]
+inline double bearingDifference(double a, double b) {
+    return std::fabs(std::remainder(a - b, 360.0));
+}
+
+}  // namespace geo
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Stable key hashing for assigning vehicles to connections and topic shards.
+namespace sharding {
+
+// FNV-1a over the key, finished with the splitmix64 mixer so that short keys
+// differing in one character land far apart
+inline uint64_t hashKey(const std::string& key) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (unsigned char c : key) {
+        h ^= c;
+        h *= 0x100000001B3ull;
+    }
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+// Jump consistent hash (Lamping & Veach): a bucket in [0, buckets) that only
+// changes for 1/buckets of the keys when a bucket is appended
+inline uint32_t jumpHash(uint64_t key, uint32_t buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < static_cast<int64_t>(buckets)) {
+        b = j;
+        key = key * 2862933555777941757ull + 1;
+        j = static_cast<int64_t>((b + 1) * (static_cast<double>(1ll << 31) / static_cast<double>((key >> 33) + 1)));
+    }
+    return static_cast<uint32_t>(b);
+}
+
+// Topic a vehicle publishes on when positions are split over that many topics
+// (<topic>/<shard>); the plain topic when shards is 0 or 1
+inline std::string shardedTopic(const std::string& topic, const std::string& key, uint32_t shards) {
+    if (shards <= 1) return topic;
+    return topic + "/" + std::to_string(jumpHash(hashKey(key), shards));
+}
+
+}  // namespace sharding
+
+// Consistent hash ring over named nodes (connections or brokers). Each node is
+// placed at many points on the ring so load spreads evenly, and adding or
+// removing a node only moves the keys that land next to its points.
+class HashRing {
+private:
+    std::vector<std::pair<uint64_t, uint32_t>> points_;  // (ring position, node), sorted
+    size_t nodes_;
+
+public:
+    static constexpr size_t kDefaultReplicas = 160;
+
+    explicit HashRing(const std::vector<std::string>& nodes, size_t replicas = kDefaultReplicas)
+        : nodes_(nodes.size()) {
+        points_.reserve(nodes.size() * replicas);
+        for (size_t n = 0; n < nodes.size(); n++) {
+            for (size_t r = 0; r < replicas; r++) {
+                points_.emplace_back(sharding::hashKey(nodes[n] + "#" + std::to_string(r)),
+                                     static_cast<uint32_t>(n));
+            }
+        }
+        std::sort(points_.begin(), points_.end());
+    }
+
+    size_t nodeCount() const { return nodes_; }
+
+    // Index of the node owning key: the first ring point at or after its hash
+    size_t nodeFor(const std::string& key) const {
+        if (points_.empty()) return 0;
+        auto it = std::lower_bound(points_.begin(), points_.end(),
+                                   std::make_pair(sharding::hashKey(key), uint32_t{0}));
+        if (it == points_.end()) it = points_.begin();
+        return it->second;
+    }
+};
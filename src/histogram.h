@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+// Log-linear latency histogram in microseconds. Each power of two is split into
+// kSubBuckets linear sub-buckets, so any recorded value is reported within
+// 1/kSubBuckets (12.5%) of its true value over the full 64-bit range.
+class LatencyHistogram {
+public:
+    static constexpr unsigned kSubBits = 3;
+    static constexpr unsigned kSubBuckets = 1u << kSubBits;
+    static constexpr size_t kBucketCount = (64 - kSubBits + 1) * kSubBuckets;
+
+private:
+    std::array<uint64_t, kBucketCount> buckets_;
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+
+public:
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t value_us) {
+        buckets_[bucketIndex(value_us)]++;
+        count_++;
+        sum_ += value_us;
+        max_ = std::max(max_, value_us);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < kBucketCount; i++) {
+            buckets_[i] += other.buckets_[i];
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    void reset() {
+        buckets_.fill(0);
+        count_ = 0;
+        sum_ = 0;
+        max_ = 0;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0.0; }
+
+    // Upper bound of the bucket holding the q-th quantile (q in [0, 1])
+    uint64_t percentile(double q) const {
+        if (count_ == 0) return 0;
+        // Smallest rank covering a fraction q of the samples, e.g. p99 of two samples is the larger
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(count_)));
+        rank = std::min(std::max<uint64_t>(rank, 1), count_);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; i++) {
+            seen += buckets_[i];
+            if (seen >= rank) {
+                return std::min(bucketUpperBound(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    // Non-empty buckets as (upper bound, count) pairs, lowest first
+    template <class Fn>
+    void forEachBucket(Fn&& fn) const {
+        for (size_t i = 0; i < kBucketCount; i++) {
+            if (buckets_[i] != 0) fn(bucketUpperBound(i), buckets_[i]);
+        }
+    }
+
+    std::string summary() const {
+        std::ostringstream out;
+        out << "n=" << count_ << " p50=" << percentile(0.50) << "us p99=" << percentile(0.99)
+            << "us p999=" << percentile(0.999) << "us max=" << max_ << "us";
+        return out.str();
+    }
+
+    static size_t bucketIndex(uint64_t value) {
+        if (value < kSubBuckets) return static_cast<size_t>(value);
+        unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(value));
+        unsigned shift = exponent - kSubBits;
+        uint64_t sub = (value >> shift) & (kSubBuckets - 1);
+        return (shift + 1) * kSubBuckets + static_cast<size_t>(sub);
+    }
+
+    static uint64_t bucketUpperBound(size_t index) {
+        if (index < kSubBuckets) return index;
+        unsigned shift = static_cast<unsigned>(index / kSubBuckets) - 1;
+        uint64_t sub = index % kSubBuckets;
+        uint64_t lower = (kSubBuckets + sub) << shift;
+        return lower + ((uint64_t{1} << shift) - 1);
+    }
+};
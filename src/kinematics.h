@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include "route.h"
+
+// How a vehicle moves along its route each tick
+enum class MotionModel {
+    Interpolate,  // drive continuously at the reported speed, interpolating inside segments
+    Points,       // jump one route point per tick (replays dense traces point by point)
+};
+
+inline bool parseMotionModel(const std::string& name, MotionModel& model) {
+    if (name == "interpolate") {
+        model = MotionModel::Interpolate;
+    } else if (name == "points") {
+        model = MotionModel::Points;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Position along a route: a segment index plus meters travelled into it
+struct RouteCursor {
+    size_t segment;
+    double offset;
+};
+
+namespace kinematics {
+
+// Move current speed towards target without exceeding max_accel (m/s^2) over dt seconds
+inline double approachSpeed(double current, double target, double max_accel, double dt) {
+    double max_change = max_accel * dt;
+    double change = target - current;
+    if (change > max_change) change = max_change;
+    if (change < -max_change) change = -max_change;
+    return current + change;
+}
+
+// Advance the cursor by distance meters, wrapping around the route loop
+inline void advance(const Route& route, RouteCursor& cursor, double distance) {
+    double loop = route.loopLength();
+    if (route.size() < 2 || loop <= 0.0 || distance <= 0.0) return;
+
+    // Whole laps don't change the position
+    if (distance >= loop) distance = std::fmod(distance, loop);
+
+    cursor.offset += distance;
+    double length = route.segmentLength(cursor.segment);
+    while (cursor.offset >= length) {
+        cursor.offset -= length;
+        cursor.segment = (cursor.segment + 1) % route.size();
+        length = route.segmentLength(cursor.segment);
+    }
+}
+
+// Linear interpolation of the cursor's position between its segment's endpoints
+inline void interpolate(const Route& route, const RouteCursor& cursor, double& lat, double& lon) {
+    size_t i = cursor.segment;
+    size_t next = (i + 1) % route.size();
+    double length = route.segmentLength(i);
+    double t = length > 0.0 ? cursor.offset / length : 0.0;
+
+    double dlon = route.lon(next) - route.lon(i);
+    if (dlon > 180.0) dlon -= 360.0;
+    if (dlon < -180.0) dlon += 360.0;
+
+    lat = route.lat(i) + (route.lat(next) - route.lat(i)) * t;
+    lon = route.lon(i) + dlon * t;
+    if (lon > 180.0) lon -= 360.0;
+    if (lon < -180.0) lon += 360.0;
+}
+
+}  // namespace kinematics
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class LogLevel {
+    Error,
+    Warn,
+    Info,
+    Debug,
+};
+
+inline bool parseLogLevel(const std::string& name, LogLevel& level) {
+    if (name == "error") {
+        level = LogLevel::Error;
+    } else if (name == "warn") {
+        level = LogLevel::Warn;
+    } else if (name == "info") {
+        level = LogLevel::Info;
+    } else if (name == "debug") {
+        level = LogLevel::Debug;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Lets through at most burst events per period and counts the rest, so a
+// failure repeated on every publish logs a few lines plus a suppressed count
+// instead of one line per message.
+class LogRateLimit {
+private:
+    const uint64_t burst_;
+    const int64_t period_ns_;
+    std::atomic<int64_t> window_start_;
+    std::atomic<uint64_t> in_window_;
+    std::atomic<uint64_t> suppressed_;
+
+public:
+    LogRateLimit(uint64_t burst, std::chrono::milliseconds period)
+        : burst_(burst), period_ns_(std::chrono::duration_cast<std::chrono::nanoseconds>(period).count()),
+          window_start_(0), in_window_(0), suppressed_(0) {}
+
+    // True if this event may be logged; suppressed receives how many were
+    // held back since the last event that was
+    bool allow(uint64_t& suppressed) {
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t start = window_start_.load(std::memory_order_relaxed);
+        if (now - start >= period_ns_ &&
+            window_start_.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+            in_window_.store(0, std::memory_order_relaxed);
+        }
+        if (in_window_.fetch_add(1, std::memory_order_relaxed) >= burst_) {
+            suppressed_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+// Process-wide asynchronous logger. A caller formats its line into a
+// thread-local fixed buffer and copies it into a bounded ring (the same
+// sequence-numbered MPSC cells as OutboundQueue); a background thread writes
+// whatever is queued with one flush per batch. Lines below the level cost one
+// relaxed load, and a full ring drops lines (counted) rather than block.
+class Logger {
+public:
+    static constexpr size_t kLineSize = 256;  // longer lines are truncated
+    static constexpr size_t kCapacity = 4096;
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        LogLevel level;
+        uint16_t length;
+        char text[kLineSize];
+    };
+
+    // ostream target that fills a fixed buffer and silently truncates
+    class LineBuffer : public std::streambuf {
+    public:
+        char data[kLineSize];
+        void reset() { setp(data, data + kLineSize); }
+        size_t length() const { return static_cast<size_t>(pptr() - pbase()); }
+    protected:
+        int_type overflow(int_type) override { return traits_type::eof(); }
+    };
+
+    struct Summary {
+        std::chrono::steady_clock::duration period;
+        std::chrono::steady_clock::time_point next;
+        std::function<std::string()> make;
+    };
+
+    std::vector<Cell> cells_;
+    const size_t mask_;
+    std::atomic<int> level_;
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+    std::atomic<uint64_t> dropped_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::atomic<bool> writer_waiting_;
+    bool stopping_;
+    std::vector<Summary> summaries_;  // guarded by mutex_
+    std::thread writer_;
+
+public:
+    Logger()
+        : cells_(kCapacity), mask_(kCapacity - 1), level_(static_cast<int>(LogLevel::Info)),
+          head_(0), tail_(0), dropped_(0), writer_waiting_(false), stopping_(false) {
+        for (size_t i = 0; i < cells_.size(); i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        writer_ = std::thread([this] { run(); });
+    }
+
+    // Writes out everything still queued
+    ~Logger() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        writer_.join();
+    }
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void setLevel(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+    bool enabled(LogLevel level) const {
+        return static_cast<int>(level) <= level_.load(std::memory_order_relaxed);
+    }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Format args with operator<< into one line; Error and Warn go to stderr
+    template <class... Args>
+    void log(LogLevel level, const Args&... args) {
+        if (!enabled(level)) return;
+        thread_local LineBuffer buffer;
+        thread_local std::ostream line(&buffer);
+        buffer.reset();
+        line.clear();
+        (line << ... << args);
+        push(level, buffer.data, buffer.length());
+    }
+
+    template <class... Args>
+    void error(const Args&... args) { log(LogLevel::Error, args...); }
+    template <class... Args>
+    void warn(const Args&... args) { log(LogLevel::Warn, args...); }
+    template <class... Args>
+    void info(const Args&... args) { log(LogLevel::Info, args...); }
+    template <class... Args>
+    void debug(const Args&... args) { log(LogLevel::Debug, args...); }
+
+    // Log at most limit's burst of these lines per period, noting how many were suppressed
+    template <class... Args>
+    void limited(LogRateLimit& limit, LogLevel level, const Args&... args) {
+        if (!enabled(level)) return;
+        uint64_t suppressed;
+        if (!limit.allow(suppressed)) return;
+        if (suppressed > 0) {
+            log(level, args..., " (", suppressed, " similar suppressed)");
+        } else {
+            log(level, args...);
+        }
+    }
+
+    // Call make on the writer thread every period and log its line at Info
+    // (skipped when empty), e.g. a count of messages since the last summary
+    void summarize(std::chrono::milliseconds period, std::function<std::string()> make) {
+        if (period <= std::chrono::milliseconds::zero()) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        summaries_.push_back({period, std::chrono::steady_clock::now() + period, std::move(make)});
+    }
+
+private:
+    void push(LogLevel level, const char* text, size_t length) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->level = level;
+        cell->length = static_cast<uint16_t>(length);
+        std::memcpy(cell->text, text, length);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        if (writer_waiting_.load()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_.notify_one();
+        }
+    }
+
+    // Write out queued lines; returns whether there were any
+    bool drain() {
+        bool wrote_out = false;
+        bool wrote_err = false;
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & mask_];
+            if (cell.sequence.load(std::memory_order_acquire) != pos + 1) break;
+            bool to_err = cell.level <= LogLevel::Warn;
+            FILE* out = to_err ? stderr : stdout;
+            std::fwrite(cell.text, 1, cell.length, out);
+            std::fputc('\n', out);
+            (to_err ? wrote_err : wrote_out) = true;
+            cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+            pos++;
+            tail_.store(pos, std::memory_order_relaxed);
+        }
+        if (wrote_out) std::fflush(stdout);
+        if (wrote_err) std::fflush(stderr);
+        return wrote_out || wrote_err;
+    }
+
+    void runSummaries() {
+        std::vector<std::string> lines;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto now = std::chrono::steady_clock::now();
+            for (auto& summary : summaries_) {
+                if (now < summary.next) continue;
+                summary.next = std::max(summary.next + summary.period, now);
+                std::string line = summary.make();
+                if (!line.empty()) lines.push_back(std::move(line));
+            }
+        }
+        for (auto& line : lines) {
+            info(line);
+        }
+    }
+
+    void run() {
+        uint64_t reported_drops = 0;
+        while (true) {
+            runSummaries();
+            uint64_t drops = dropped();
+            if (drops != reported_drops) {
+                std::fprintf(stderr, "Log buffer full, dropped %llu line(s)\n",
+                             static_cast<unsigned long long>(drops - reported_drops));
+                reported_drops = drops;
+            }
+            if (drain()) continue;
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (stopping_) {
+                lock.unlock();
+                drain();
+                return;
+            }
+            writer_waiting_.store(true);
+            wake_.wait_for(lock, std::chrono::milliseconds(50), [this] {
+                return stopping_ || cells_[tail_.load(std::memory_order_relaxed) & mask_].sequence.load(
+                    std::memory_order_acquire) == tail_.load(std::memory_order_relaxed) + 1;
+            });
+            writer_waiting_.store(false);
+        }
+    }
+};
+
+inline Logger& logger() {
+    static Logger instance;
+    return instance;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file. Mappings of the same file share the
+// page cache, so many readers cost one copy of the data.
+class MappedFile {
+private:
+    const char* data_;
+    size_t size_;
+
+public:
+    MappedFile() : data_(nullptr), size_(0) {}
+
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept : data_(other.data_), size_(other.size_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            close();
+            data_ = other.data_;
+            size_ = other.size_;
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    // Map filename; advice is passed to madvise (e.g. MADV_SEQUENTIAL for one-pass parsing)
+    bool open(const std::string& filename, int advice = MADV_NORMAL) {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ == 0) {
+            // Nothing to map; an empty file is still a successful open
+            ::close(fd);
+            return true;
+        }
+
+        void* addr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            size_ = 0;
+            return false;
+        }
+        madvise(addr, size_, advice);
+        data_ = static_cast<const char*>(addr);
+        return true;
+    }
+
+    void close() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    // Drop the pages before upto from this process' resident set, e.g. the
+    // part of a large file already parsed; they are read back from the page
+    // cache if touched again
+    void release(const char* upto) {
+        if (!data_ || upto <= data_) return;
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t length = static_cast<size_t>(upto - data_) / page * page;
+        if (length > 0) madvise(const_cast<char*>(data_), length, MADV_DONTNEED);
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+};
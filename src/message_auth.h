@@ -0,0 +1,359 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <mqtt/async_client.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include "logger.h"
+#include "metrics.h"
+
+// Authentication of published payloads, so authenticated fleets pay in load
+// tests the CPU the vehicles pay in production (ARCHITECTURE.md, "Cryptographic
+// Flow").
+//
+// An authenticated payload is a GV frame (see position_batcher.h) with
+// kFlagAuthenticated set and a trailer after its body:
+//   ecdsa: DER ECDSA signature over SHA-256 of the frame before the trailer
+//   hmac:  uint32 stream | uint64 counter | the first 16 bytes of
+//          HMAC-SHA256 over the frame up to the tag (stream and counter included)
+//   then   uint8 length of the above, uint8 kind (kAuthEcdsa or kAuthHmac)
+// so a consumer reads the trailer from the end. Batched frames are signed
+// whole, one signature for every position in them; single positions go out
+// as one-record frames so they have room for a trailer.
+//
+// An HMAC costs about a microsecond but proves nothing to anyone else holding
+// the key, so in hmac mode every checkpoint_interval messages a stream also
+// emits an ECDSA-signed checkpoint frame (kFlagCheckpoint) whose body is
+// uint32 stream | uint64 first counter | uint32 count | SHA-256 over those
+// messages' tags in counter order.
+enum class Authentication {
+    None,
+    Ecdsa,  // sign every payload
+    Hmac,   // MAC every payload, sign periodic checkpoints
+};
+
+inline bool parseAuthentication(const std::string& name, Authentication& mode) {
+    if (name == "none") {
+        mode = Authentication::None;
+    } else if (name == "ecdsa") {
+        mode = Authentication::Ecdsa;
+    } else if (name == "hmac") {
+        mode = Authentication::Hmac;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+namespace auth {
+
+// Frame format pieces shared with PositionBatcher, which owns the layout
+constexpr uint8_t kFrameFormatVersion = 1;
+constexpr uint8_t kFlagAuthenticated = 0x08;
+constexpr uint8_t kFlagCheckpoint = 0x10;
+
+constexpr uint8_t kAuthEcdsa = 1;
+constexpr uint8_t kAuthHmac = 2;
+constexpr size_t kHmacTagSize = 16;
+constexpr uint32_t kDefaultCheckpointInterval = 1000;
+
+inline void logOpenSslError(const char* what) {
+    char reason[256];
+    ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+    logger().error(what, ": ", reason);
+}
+
+// Key bytes from hex, e.g. from openssl rand -hex 32
+inline bool parseHex(const std::string& hex, std::string& bytes) {
+    auto nibble = [](char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    if (hex.empty() || hex.size() % 2 != 0) return false;
+    bytes.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int high = nibble(hex[i]);
+        int low = nibble(hex[i + 1]);
+        if (high < 0 || low < 0) return false;
+        bytes.push_back(static_cast<char>(high << 4 | low));
+    }
+    return true;
+}
+
+inline std::string randomKey(size_t size) {
+    std::string key(size, '\0');
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(&key[0]), static_cast<int>(size)) != 1) return std::string();
+    return key;
+}
+
+inline void appendLittleEndian(std::string& out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+}
+
+}  // namespace auth
+
+// An EC private key for signing, shared by every authenticator of a process
+// (signing only reads it)
+class SigningKey {
+private:
+    EVP_PKEY* key_;
+
+public:
+    SigningKey() : key_(nullptr) {}
+    ~SigningKey() { EVP_PKEY_free(key_); }
+
+    SigningKey(const SigningKey&) = delete;
+    SigningKey& operator=(const SigningKey&) = delete;
+
+    // PEM EC private key (e.g. openssl ecparam -name prime256v1 -genkey -noout)
+    bool load(const std::string& filename) {
+        FILE* file = std::fopen(filename.c_str(), "r");
+        if (!file) {
+            logger().error("Could not open signing key ", filename);
+            return false;
+        }
+        key_ = PEM_read_PrivateKey(file, nullptr, nullptr, nullptr);
+        std::fclose(file);
+        if (!key_) {
+            auth::logOpenSslError("Could not read signing key");
+            return false;
+        }
+        if (!EVP_PKEY_is_a(key_, "EC")) {
+            logger().error("Signing key ", filename, " is not an EC key");
+            return false;
+        }
+        return true;
+    }
+
+    // A fresh P-256 key for this run
+    bool generate() {
+        key_ = EVP_EC_gen("P-256");
+        if (!key_) auth::logOpenSslError("Could not generate a signing key");
+        return key_ != nullptr;
+    }
+
+    EVP_PKEY* get() const { return key_; }
+
+    // Largest DER signature the key makes
+    size_t maxSignatureSize() const { return static_cast<size_t>(EVP_PKEY_get_size(key_)); }
+
+    std::string publicKeyPem() const {
+        BIO* bio = BIO_new(BIO_s_mem());
+        std::string pem;
+        if (bio && PEM_write_bio_PUBKEY(bio, key_)) {
+            char* data = nullptr;
+            long size = BIO_get_mem_data(bio, &data);
+            pem.assign(data, static_cast<size_t>(size));
+        }
+        BIO_free(bio);
+        return pem;
+    }
+};
+
+// Authenticates one stream of frames (one per fleet shard). Everything costly
+// is set up once: the digest is fetched, the signing context initialized and
+// the HMAC keyed, so its padded key blocks are hashed once and each message
+// only resets the context. Not thread-safe; a fleet shard's stream is only
+// used by the worker stepping that shard.
+class MessageAuthenticator {
+private:
+    Authentication mode_;
+    std::shared_ptr<const SigningKey> key_;
+    uint32_t stream_;
+    EVP_MD* sha256_;
+    EVP_PKEY_CTX* sign_ctx_;
+    EVP_MAC* mac_;
+    EVP_MAC_CTX* mac_ctx_;
+    EVP_MD_CTX* chain_;  // tags since the last checkpoint
+    EVP_MD_CTX* closing_;  // copy of chain_ finalized for a checkpoint, so a failed one consumes nothing
+    uint64_t counter_;
+    uint64_t checkpoint_first_;
+    uint32_t checkpoint_interval_;
+    std::string checkpoint_topic_;
+    int qos_;
+    mqtt::message_ptr checkpoint_;
+    bool ok_;
+
+public:
+    // hmac_key is raw bytes; the key signs every payload (ecdsa) or the checkpoints (hmac)
+    MessageAuthenticator(Authentication mode, std::shared_ptr<const SigningKey> key, const std::string& hmac_key,
+                         uint32_t stream, const std::string& checkpoint_topic, int qos,
+                         uint32_t checkpoint_interval = auth::kDefaultCheckpointInterval)
+        : mode_(mode), key_(std::move(key)), stream_(stream), sha256_(EVP_MD_fetch(nullptr, "SHA256", nullptr)),
+          sign_ctx_(nullptr), mac_(nullptr), mac_ctx_(nullptr), chain_(nullptr), closing_(nullptr), counter_(0),
+          checkpoint_first_(0), checkpoint_interval_(checkpoint_interval > 0 ? checkpoint_interval : 1),
+          checkpoint_topic_(checkpoint_topic), qos_(qos), ok_(false) {
+        if (!sha256_ || !key_ || !key_->get()) return;
+        sign_ctx_ = EVP_PKEY_CTX_new_from_pkey(nullptr, key_->get(), nullptr);
+        if (!sign_ctx_ || EVP_PKEY_sign_init(sign_ctx_) <= 0) {
+            auth::logOpenSslError("Could not set up signing");
+            return;
+        }
+        if (mode_ == Authentication::Hmac) {
+            mac_ = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+            mac_ctx_ = mac_ ? EVP_MAC_CTX_new(mac_) : nullptr;
+            chain_ = EVP_MD_CTX_new();
+            closing_ = EVP_MD_CTX_new();
+            char digest[] = "SHA256";
+            OSSL_PARAM params[] = {OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+                                   OSSL_PARAM_construct_end()};
+            if (!mac_ctx_ || !chain_ || !closing_ || hmac_key.empty() ||
+                !EVP_MAC_init(mac_ctx_, reinterpret_cast<const unsigned char*>(hmac_key.data()), hmac_key.size(),
+                              params) ||
+                !EVP_DigestInit_ex(chain_, sha256_, nullptr)) {
+                auth::logOpenSslError("Could not set up HMAC");
+                return;
+            }
+        }
+        ok_ = true;
+    }
+
+    ~MessageAuthenticator() {
+        EVP_MD_CTX_free(closing_);
+        EVP_MD_CTX_free(chain_);
+        EVP_MAC_CTX_free(mac_ctx_);
+        EVP_MAC_free(mac_);
+        EVP_PKEY_CTX_free(sign_ctx_);
+        EVP_MD_free(sha256_);
+    }
+
+    MessageAuthenticator(const MessageAuthenticator&) = delete;
+    MessageAuthenticator& operator=(const MessageAuthenticator&) = delete;
+
+    bool ok() const { return ok_; }
+    Authentication mode() const { return mode_; }
+
+    // Bytes authenticate() may append, for reserving buffer space up front
+    size_t trailerCapacity() const {
+        return (mode_ == Authentication::Hmac ? 4 + 8 + auth::kHmacTagSize : key_->maxSignatureSize()) + 2;
+    }
+
+    // Mark frame (a GV frame, header included) authenticated and append its
+    // trailer. On failure frame is left exactly as it was and no counter is
+    // used up; the caller drops it (counting it in auth_failures), since a
+    // consumer would read whatever ends the frame as a trailer.
+    bool authenticate(std::string& frame) {
+        uint64_t started = metrics::nowNanos();
+        size_t size = frame.size();
+        char flags = frame[3];
+        frame[3] = static_cast<char>(static_cast<uint8_t>(flags) | auth::kFlagAuthenticated);
+        metrics::Registry& m = metrics::registry();
+        bool done;
+        if (mode_ == Authentication::Hmac) {
+            done = appendHmac(frame);
+            if (done) m.macs.add();
+        } else {
+            done = appendSignature(frame);
+            if (done) m.signatures.add();
+        }
+        if (!done) {
+            frame.resize(size);
+            frame[3] = flags;
+        }
+        m.auth_time.record(metrics::nowNanos() - started);
+        return done;
+    }
+
+    // A checkpoint frame to publish after the message just authenticated, once
+    // one is due; otherwise null
+    mqtt::message_ptr takeCheckpoint() { return std::move(checkpoint_); }
+
+private:
+    bool appendSignature(std::string& frame) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_size = 0;
+        if (!EVP_Digest(frame.data(), frame.size(), digest, &digest_size, sha256_, nullptr)) return false;
+
+        size_t offset = frame.size();
+        size_t signature_size = key_->maxSignatureSize();
+        frame.resize(offset + signature_size);
+        if (EVP_PKEY_sign(sign_ctx_, reinterpret_cast<unsigned char*>(&frame[offset]), &signature_size, digest,
+                          digest_size) <= 0) {
+            frame.resize(offset);
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Error, "Could not sign a frame");
+            return false;
+        }
+        // DER signatures vary by a few bytes
+        frame.resize(offset + signature_size);
+        frame.push_back(static_cast<char>(signature_size));
+        frame.push_back(static_cast<char>(auth::kAuthEcdsa));
+        return true;
+    }
+
+    // The counter is only taken once the tag is made, so a failure leaves no gap
+    bool appendHmac(std::string& frame) {
+        auth::appendLittleEndian(frame, stream_, 4);
+        auth::appendLittleEndian(frame, counter_, 8);
+        unsigned char tag[EVP_MAX_MD_SIZE];
+        size_t tag_size = 0;
+        // A null key restarts from the already keyed state
+        if (!EVP_MAC_init(mac_ctx_, nullptr, 0, nullptr) ||
+            !EVP_MAC_update(mac_ctx_, reinterpret_cast<const unsigned char*>(frame.data()), frame.size()) ||
+            !EVP_MAC_final(mac_ctx_, tag, &tag_size, sizeof(tag))) {
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Error, "Could not MAC a frame");
+            return false;
+        }
+        counter_++;
+        frame.append(reinterpret_cast<const char*>(tag), auth::kHmacTagSize);
+        frame.push_back(static_cast<char>(4 + 8 + auth::kHmacTagSize));
+        frame.push_back(static_cast<char>(auth::kAuthHmac));
+
+        EVP_DigestUpdate(chain_, tag, auth::kHmacTagSize);
+        if (counter_ - checkpoint_first_ >= checkpoint_interval_) makeCheckpoint();
+        return true;
+    }
+
+    // The chain is only consumed once the checkpoint is signed. On failure it
+    // keeps accumulating and the next message retries, so a later checkpoint
+    // covers these messages too and a verifier never sees a gap.
+    void makeCheckpoint() {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_size = 0;
+        if (!EVP_MD_CTX_copy_ex(closing_, chain_) || !EVP_DigestFinal_ex(closing_, digest, &digest_size)) {
+            checkpointFailed();
+            return;
+        }
+        uint64_t count = counter_ - checkpoint_first_;
+
+        std::string frame;
+        frame.reserve(4 + 16 + digest_size + key_->maxSignatureSize() + 2);
+        frame.push_back('G');
+        frame.push_back('V');
+        frame.push_back(static_cast<char>(auth::kFrameFormatVersion));
+        frame.push_back(static_cast<char>(auth::kFlagCheckpoint));
+        auth::appendLittleEndian(frame, stream_, 4);
+        auth::appendLittleEndian(frame, checkpoint_first_, 8);
+        auth::appendLittleEndian(frame, count, 4);
+        frame.append(reinterpret_cast<const char*>(digest), digest_size);
+
+        frame[3] = static_cast<char>(auth::kFlagCheckpoint | auth::kFlagAuthenticated);
+        if (!appendSignature(frame)) {
+            checkpointFailed();
+            return;
+        }
+        EVP_DigestInit_ex(chain_, sha256_, nullptr);
+        checkpoint_first_ = counter_;
+        metrics::Registry& m = metrics::registry();
+        m.signatures.add();
+        m.checkpoints.add();
+        checkpoint_ = mqtt::make_message(checkpoint_topic_, std::move(frame), qos_, false);
+    }
+
+    void checkpointFailed() {
+        metrics::registry().auth_failures.add();
+        static LogRateLimit limit(5, std::chrono::seconds(1));
+        logger().limited(limit, LogLevel::Error, "Could not make a checkpoint after counter ", counter_ - 1,
+                         ", retrying with the next message");
+    }
+};
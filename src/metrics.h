@@ -0,0 +1,222 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <string>
+#include "histogram.h"
+
+// Process-wide counters and histograms for the hot paths, rendered in the
+// Prometheus text exposition format. Writers update one of kStripes cache-line
+// sized stripes chosen per thread, so tick workers and paho callback threads
+// recording at the same time don't bounce a shared line; a scrape sums them.
+namespace metrics {
+
+constexpr size_t kStripes = 16;
+
+inline size_t threadStripe() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t stripe = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return stripe;
+}
+
+inline uint64_t nowNanos() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Monotonic count
+class Counter {
+private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Stripe, kStripes> stripes_;
+
+public:
+    void add(uint64_t n = 1) { stripes_[threadStripe()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const Stripe& s : stripes_) total += s.value.load(std::memory_order_relaxed);
+        return total;
+    }
+};
+
+// Level that moves both ways; stripes hold deltas, so one may go negative
+class Gauge {
+private:
+    struct alignas(64) Stripe {
+        std::atomic<int64_t> value{0};
+    };
+    std::array<Stripe, kStripes> stripes_;
+
+public:
+    void add(int64_t n) { stripes_[threadStripe()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    int64_t value() const {
+        int64_t total = 0;
+        for (const Stripe& s : stripes_) total += s.value.load(std::memory_order_relaxed);
+        return total;
+    }
+};
+
+// Durations in nanoseconds, bucketed like LatencyHistogram (within 12.5%)
+class Histogram {
+private:
+    struct alignas(64) Stripe {
+        std::array<std::atomic<uint64_t>, LatencyHistogram::kBucketCount> buckets{};
+        std::atomic<uint64_t> sum{0};
+    };
+    std::unique_ptr<Stripe[]> stripes_;
+
+public:
+    Histogram() : stripes_(new Stripe[kStripes]) {}
+
+    void record(uint64_t nanos) {
+        Stripe& s = stripes_[threadStripe()];
+        s.buckets[LatencyHistogram::bucketIndex(nanos)].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(nanos, std::memory_order_relaxed);
+    }
+
+    template <class Rep, class Period>
+    void record(std::chrono::duration<Rep, Period> d) {
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+        record(static_cast<uint64_t>(nanos > 0 ? nanos : 0));
+    }
+
+    // Sum the stripes into per-bucket counts and a total
+    void snapshot(std::array<uint64_t, LatencyHistogram::kBucketCount>& buckets, uint64_t& sum) const {
+        buckets.fill(0);
+        sum = 0;
+        for (size_t k = 0; k < kStripes; k++) {
+            const Stripe& s = stripes_[k];
+            for (size_t i = 0; i < buckets.size(); i++) {
+                buckets[i] += s.buckets[i].load(std::memory_order_relaxed);
+            }
+            sum += s.sum.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// Everything the agent exports. Fields are fixed rather than registered by
+// name so recording is a plain member access with no lookup.
+class Registry {
+public:
+    Counter published;          // publishes acknowledged by the broker
+    Counter publish_errors;     // publishes rejected, failed or never handed to the client
+    Counter suppressed;         // positions not sent because the backend's dead reckoning covers them
+    Counter connects;           // successful connections, first ones included
+    Counter reconnects;         // connections made after a connection was lost
+    Counter connection_losses;
+    Counter queue_drops;        // messages dropped by a full outbound queue
+    Counter spool_stored;       // store-and-forward: kept while offline
+    Counter spool_spilled;      //   moved from memory to the spill file
+    Counter spool_forwarded;    //   published after reconnecting
+    Counter spool_dropped;      //   lost with memory and disk full
+    Counter compress_bytes_in;  // frame bytes before and after compression
+    Counter compress_bytes_out;
+    Counter datagrams_sent;     // UDP transport: handed to the kernel
+    Counter datagram_drops;     //   refused by the socket or over the size limit
+    Counter datagram_batches;   //   sendmmsg calls
+    Counter proximity_events;   // vehicles coming within the proximity range of each other
+    Counter geofence_events;    // geofence entries and exits
+    Counter signatures;         // ECDSA signatures made, checkpoints included
+    Counter macs;               // HMAC tags made
+    Counter checkpoints;        // signed HMAC checkpoints made
+    Counter auth_failures;      // payloads dropped and checkpoints deferred because signing or MACing failed
+    Gauge in_flight;            // publish tokens not yet completed
+    Histogram tick_lateness;
+    Histogram serialize_time;   // sampled, see PublishPath::publishAs
+    Histogram publish_ack;      // publish call until the broker's acknowledgement
+    Histogram compress_time;    // per compressed frame
+    Histogram datagram_send;    // UDP send call
+    Histogram spatial_update;   // rebuilding the fleet's spatial index and finding events
+    Histogram auth_time;        // signing or MACing one payload
+
+    std::string render() const {
+        std::ostringstream out;
+        counter(out, "geovan_published_total", "Publishes acknowledged by the broker", published);
+        counter(out, "geovan_publish_errors_total", "Publishes that failed or were rejected", publish_errors);
+        counter(out, "geovan_suppressed_total", "Positions withheld while dead reckoning predicted them", suppressed);
+        counter(out, "geovan_connects_total", "Successful MQTT connections", connects);
+        counter(out, "geovan_reconnects_total", "MQTT connections re-established after a loss", reconnects);
+        counter(out, "geovan_connection_losses_total", "MQTT connections lost", connection_losses);
+        counter(out, "geovan_queue_drops_total", "Messages dropped by a full outbound queue", queue_drops);
+        counter(out, "geovan_spool_stored_total", "Messages kept for later while offline", spool_stored);
+        counter(out, "geovan_spool_spilled_total", "Kept messages moved to the spill file", spool_spilled);
+        counter(out, "geovan_spool_forwarded_total", "Kept messages published after reconnecting", spool_forwarded);
+        counter(out, "geovan_spool_dropped_total", "Kept messages lost to a full buffer", spool_dropped);
+        counter(out, "geovan_compress_in_bytes_total", "Frame body bytes fed to compression", compress_bytes_in);
+        counter(out, "geovan_compress_out_bytes_total", "Compressed frame body bytes", compress_bytes_out);
+        counter(out, "geovan_datagrams_sent_total", "Positions sent as UDP datagrams", datagrams_sent);
+        counter(out, "geovan_datagram_drops_total", "UDP datagrams too large or refused", datagram_drops);
+        counter(out, "geovan_datagram_batches_total", "sendmmsg calls writing UDP datagrams", datagram_batches);
+        counter(out, "geovan_proximity_events_total", "Vehicle pairs coming within proximity range", proximity_events);
+        counter(out, "geovan_geofence_events_total", "Geofence entries and exits", geofence_events);
+        counter(out, "geovan_signatures_total", "Payloads and checkpoints signed with ECDSA", signatures);
+        counter(out, "geovan_macs_total", "Payloads authenticated with HMAC", macs);
+        counter(out, "geovan_checkpoints_total", "Signed checkpoints over HMAC tags", checkpoints);
+        counter(out, "geovan_auth_failures_total",
+                "Payloads dropped or checkpoints deferred because authenticating failed", auth_failures);
+        out << "# HELP geovan_in_flight Publish tokens awaiting acknowledgement\n"
+            << "# TYPE geovan_in_flight gauge\n"
+            << "geovan_in_flight " << in_flight.value() << "\n";
+        histogram(out, "geovan_tick_lateness_seconds", "Delay between a tick's deadline and its start",
+                  tick_lateness);
+        histogram(out, "geovan_serialize_seconds", "Time to serialize one position (sampled)", serialize_time);
+        histogram(out, "geovan_publish_ack_seconds", "Time from publish to broker acknowledgement",
+                  publish_ack);
+        histogram(out, "geovan_compress_seconds", "CPU time compressing one frame", compress_time);
+        histogram(out, "geovan_datagram_send_seconds", "Time in one sendmmsg call", datagram_send);
+        histogram(out, "geovan_spatial_update_seconds", "Time to index the fleet and find proximity and geofence events",
+                  spatial_update);
+        histogram(out, "geovan_auth_seconds", "Time to sign or MAC one payload", auth_time);
+        return out.str();
+    }
+
+private:
+    static void counter(std::ostringstream& out, const char* name, const char* help, const Counter& c) {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " counter\n"
+            << name << " " << c.value() << "\n";
+    }
+
+    // Cumulative buckets at powers of two from 1us to ~69s. LatencyHistogram
+    // buckets never straddle a power of two, so each bound is exact.
+    static void histogram(std::ostringstream& out, const char* name, const char* help, const Histogram& h) {
+        std::array<uint64_t, LatencyHistogram::kBucketCount> buckets;
+        uint64_t sum;
+        h.snapshot(buckets, sum);
+
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " histogram\n";
+        uint64_t cumulative = 0;
+        size_t i = 0;
+        char le[32];
+        for (unsigned exponent = 10; exponent <= 36; exponent++) {
+            uint64_t bound = uint64_t{1} << exponent;
+            while (i < buckets.size() && LatencyHistogram::bucketUpperBound(i) < bound) {
+                cumulative += buckets[i++];
+            }
+            std::snprintf(le, sizeof(le), "%.9g", static_cast<double>(bound) * 1e-9);
+            out << name << "_bucket{le=\"" << le << "\"} " << cumulative << "\n";
+        }
+        while (i < buckets.size()) cumulative += buckets[i++];
+        std::snprintf(le, sizeof(le), "%.9g", static_cast<double>(sum) * 1e-9);
+        out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+            << name << "_sum " << le << "\n"
+            << name << "_count " << cumulative << "\n";
+    }
+};
+
+inline Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+}  // namespace metrics
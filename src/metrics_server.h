@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "metrics.h"
+
+// Minimal HTTP/1.0 endpoint serving metrics::registry() at GET /metrics for a
+// Prometheus scraper. One background thread accepts and answers a request at a
+// time, closing each connection after the response; scrapes are rare enough
+// that nothing more is needed, and the publish path never waits on it.
+class MetricsServer {
+private:
+    int listen_fd_;
+    std::atomic<bool> stopping_;
+    std::thread thread_;
+
+public:
+    MetricsServer() : listen_fd_(-1), stopping_(false) {}
+
+    ~MetricsServer() { stop(); }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    // Listen on port (all interfaces) and start serving
+    bool start(uint16_t port) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            std::cerr << "Metrics endpoint: socket failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd_, 16) < 0) {
+            std::cerr << "Metrics endpoint: cannot listen on port " << port << ": "
+                      << std::strerror(errno) << std::endl;
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return false;
+        }
+        thread_ = std::thread([this] { run(); });
+        return true;
+    }
+
+    void stop() {
+        if (!thread_.joinable()) return;
+        stopping_ = true;
+        thread_.join();
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+
+private:
+    void run() {
+        while (!stopping_) {
+            // Wake up periodically to notice stop()
+            pollfd pfd{listen_fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 200) <= 0) continue;
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) continue;
+            serve(fd);
+            close(fd);
+        }
+    }
+
+    void serve(int fd) {
+        // Only the request line matters; give a slow client a second to send it
+        std::string request;
+        char buf[1024];
+        while (request.find("\r\n") == std::string::npos && request.size() < 8192) {
+            pollfd pfd{fd, POLLIN, 0};
+            if (poll(&pfd, 1, 1000) <= 0) return;
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) return;
+            request.append(buf, static_cast<size_t>(n));
+        }
+
+        std::string status = "200 OK";
+        std::string body;
+        if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics\r\n") == 0) {
+            body = metrics::registry().render();
+        } else {
+            status = "404 Not Found";
+            body = "not found\n";
+        }
+        std::string response = "HTTP/1.0 " + status + "\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        const char* data = response.data();
+        size_t left = response.size();
+        while (left > 0) {
+            ssize_t n = send(fd, data, left, MSG_NOSIGNAL);
+            if (n <= 0) return;
+            data += n;
+            left -= static_cast<size_t>(n);
+        }
+    }
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mqtt/async_client.h>
+#include "histogram.h"
+#include "logger.h"
+#include "publish_window.h"
+#include "store_forward.h"
+
+// What a producer does when the outbound queue is full
+enum class QueueFullPolicy {
+    Block,  // wait for the publisher thread to make room
+    Drop,   // discard the new message and count it
+};
+
+inline bool parseQueueFullPolicy(const std::string& name, QueueFullPolicy& policy) {
+    if (name == "block") {
+        policy = QueueFullPolicy::Block;
+    } else if (name == "drop") {
+        policy = QueueFullPolicy::Drop;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Bounded lock-free multi-producer single-consumer queue of serialized messages
+// waiting to be published. Each cell carries a sequence number (Vyukov's bounded
+// queue): producers claim a position with a CAS on head_ and publish the cell by
+// bumping its sequence, so a producer never waits on the consumer or on another
+// producer unless the queue is full. Capacity is rounded up to a power of two.
+class OutboundQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        mqtt::const_message_ptr message;
+        Clock::time_point enqueued;
+    };
+
+    std::vector<Cell> cells_;
+    const size_t mask_;
+    const QueueFullPolicy policy_;
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+    alignas(64) std::atomic<uint64_t> pushed_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> full_waits_;
+    std::atomic<size_t> max_depth_;
+    // Consumer idle wakeup
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::atomic<bool> consumer_waiting_;
+
+public:
+    OutboundQueue(size_t capacity, QueueFullPolicy policy)
+        : cells_(roundUpPow2(capacity)), mask_(cells_.size() - 1), policy_(policy),
+          head_(0), tail_(0), pushed_(0), dropped_(0), full_waits_(0), max_depth_(0),
+          consumer_waiting_(false) {
+        for (size_t i = 0; i < cells_.size(); i++) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    OutboundQueue(const OutboundQueue&) = delete;
+    OutboundQueue& operator=(const OutboundQueue&) = delete;
+
+    // Queue a message for the publisher. Returns false if it was dropped.
+    bool push(mqtt::const_message_ptr message) {
+        if (!tryPush(message)) {
+            if (policy_ == QueueFullPolicy::Drop) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                metrics::registry().queue_drops.add();
+                return false;
+            }
+            full_waits_.fetch_add(1, std::memory_order_relaxed);
+            do {
+                std::this_thread::yield();
+            } while (!tryPush(message));
+        }
+        pushed_.fetch_add(1, std::memory_order_relaxed);
+
+        if (consumer_waiting_.load()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            not_empty_.notify_one();
+        }
+        return true;
+    }
+
+    // Consumer side: take the oldest message, if any
+    bool pop(mqtt::const_message_ptr& message, Clock::time_point& enqueued) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos & mask_];
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1) return false;
+        message = std::move(cell.message);
+        enqueued = cell.enqueued;
+        cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+        tail_.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer side: sleep until a producer pushes or timeout passes. The
+    // timeout also bounds the delay if a wakeup races with the waiting flag.
+    void waitForItems(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        consumer_waiting_.store(true);
+        not_empty_.wait_for(lock, timeout, [this] { return depth() > 0; });
+        consumer_waiting_.store(false);
+    }
+
+    size_t capacity() const { return cells_.size(); }
+    QueueFullPolicy policy() const { return policy_; }
+    size_t depth() const {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        return head > tail ? head - tail : 0;
+    }
+    size_t maxDepth() const { return max_depth_.load(std::memory_order_relaxed); }
+    uint64_t pushed() const { return pushed_.load(std::memory_order_relaxed); }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+    // Pushes that found the queue full and had to wait (block policy)
+    uint64_t fullWaits() const { return full_waits_.load(std::memory_order_relaxed); }
+    void resetMaxDepth() { max_depth_.store(depth(), std::memory_order_relaxed); }
+
+private:
+    static size_t roundUpPow2(size_t n) {
+        size_t size = 2;
+        while (size < n) size <<= 1;
+        return size;
+    }
+
+    bool tryPush(const mqtt::const_message_ptr& message) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false;  // full: the consumer has not freed this cell yet
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->message = message;
+        cell->enqueued = Clock::now();
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        size_t depth = pos + 1 - tail_.load(std::memory_order_relaxed);
+        size_t seen = max_depth_.load(std::memory_order_relaxed);
+        while (depth > seen && !max_depth_.compare_exchange_weak(seen, depth, std::memory_order_relaxed)) {
+        }
+        return true;
+    }
+};
+
+// Dedicated thread that drains one OutboundQueue into one MQTT connection, so
+// tick workers only serialize and enqueue and a slow broker backs up the queue
+// instead of the simulation. Time spent queued (enqueue until handed to the
+// client, including any wait for the in-flight window) is recorded per message.
+// With a StoreForward buffer, messages are published through it and the
+// backlog is forwarded from this thread.
+class OutboundPublisher {
+private:
+    std::shared_ptr<OutboundQueue> queue_;
+    std::shared_ptr<mqtt::async_client> client_;
+    std::shared_ptr<PublishWindow> window_;
+    std::shared_ptr<StoreForward> spool_;
+    std::atomic<bool> stopping_;
+    std::atomic<uint64_t> published_;
+    // Merged from the thread's local histogram whenever the queue runs dry
+    std::mutex latency_mutex_;
+    LatencyHistogram latency_;
+    std::thread thread_;
+
+public:
+    OutboundPublisher(std::shared_ptr<OutboundQueue> queue, std::shared_ptr<mqtt::async_client> client,
+                      std::shared_ptr<PublishWindow> window, std::shared_ptr<StoreForward> spool = nullptr)
+        : queue_(std::move(queue)), client_(std::move(client)), window_(std::move(window)),
+          spool_(std::move(spool)), stopping_(false), published_(0) {
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~OutboundPublisher() { stop(); }
+
+    OutboundPublisher(const OutboundPublisher&) = delete;
+    OutboundPublisher& operator=(const OutboundPublisher&) = delete;
+
+    // Publish whatever is still queued, then end the thread
+    void stop() {
+        if (!thread_.joinable()) return;
+        stopping_ = true;
+        thread_.join();
+    }
+
+    const std::shared_ptr<OutboundQueue>& queue() const { return queue_; }
+    uint64_t published() const { return published_; }
+
+    // Add the queueing latency recorded since the last call to into, then reset it
+    void takeLatency(LatencyHistogram& into) {
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        into.merge(latency_);
+        latency_.reset();
+    }
+
+private:
+    void run() {
+        LatencyHistogram local;
+        mqtt::const_message_ptr message;
+        OutboundQueue::Clock::time_point enqueued;
+        while (true) {
+            if (queue_->pop(message, enqueued)) {
+                if (spool_) {
+                    spool_->send(*client_, *window_, message);
+                    published_++;
+                } else if (!client_->is_connected()) {
+                    window_->reject();
+                } else {
+                    window_->acquire();
+                    try {
+                        client_->publish(message, PublishWindow::startContext(), *window_);
+                        published_++;
+                    } catch (const mqtt::exception& exc) {
+                        window_->cancel();
+                        static LogRateLimit limit(5, std::chrono::seconds(1));
+                        logger().limited(limit, LogLevel::Error, "Error publishing message: ", exc.what());
+                    }
+                }
+                message.reset();
+                local.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                    OutboundQueue::Clock::now() - enqueued).count());
+                if (local.count() < 1024) continue;
+            }
+
+            if (local.count() > 0) {
+                std::lock_guard<std::mutex> lock(latency_mutex_);
+                latency_.merge(local);
+                local.reset();
+            }
+            if (queue_->depth() > 0) continue;
+            if (stopping_) return;
+            // Keep forwarding the backlog while no live messages arrive
+            if (spool_ && spool_->backlog() > 0 && client_->is_connected()) spool_->forward(*client_, *window_);
+            queue_->waitForItems(std::chrono::milliseconds(1));
+        }
+    }
+};
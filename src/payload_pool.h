@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mqtt/async_client.h>
+
+// Recycles MQTT messages and their payload buffers for one topic so that the
+// steady-state publish path does not allocate. Each slot owns a message bound
+// to a reusable buffer; a slot is free again once paho has dropped its last
+// reference to the message (delivery completed and the token was released).
+// Slots are handed out by value; holding a copy keeps the slot busy.
+class PayloadPool {
+public:
+    struct Slot {
+        std::shared_ptr<std::string> buffer;
+        mqtt::message_ptr message;
+    };
+
+private:
+    std::string topic_;
+    int qos_;
+    size_t buffer_capacity_;
+    std::vector<Slot> slots_;
+    size_t next_;
+    uint64_t allocations_;
+
+public:
+    PayloadPool(const std::string& topic, int qos, size_t buffer_capacity, size_t initial_slots = 2)
+        : topic_(topic), qos_(qos), buffer_capacity_(buffer_capacity), next_(0), allocations_(0) {
+        slots_.reserve(initial_slots);
+        for (size_t i = 0; i < initial_slots; i++) {
+            addSlot();
+        }
+        allocations_ = 0;
+    }
+
+    PayloadPool(const PayloadPool&) = delete;
+    PayloadPool& operator=(const PayloadPool&) = delete;
+
+    // A free slot with an empty buffer; allocates a new slot only if every
+    // existing one is still held by the MQTT client
+    Slot acquire() {
+        for (size_t n = 0; n < slots_.size(); n++) {
+            const Slot& slot = slots_[next_];
+            next_ = (next_ + 1) % slots_.size();
+            if (slot.message.use_count() == 1) {
+                slot.buffer->clear();
+                return slot;
+            }
+        }
+        return addSlot();
+    }
+
+    // Serialize a protobuf message straight into a free slot's buffer
+    template <class Message>
+    bool serialize(const Message& msg, Slot& slot) {
+        slot = acquire();
+        size_t size = msg.ByteSizeLong();
+        reserve(slot, size);
+        slot.buffer->resize(size);
+        if (!msg.SerializeToArray(&(*slot.buffer)[0], static_cast<int>(size))) {
+            return false;
+        }
+        seal(slot);
+        return true;
+    }
+
+    // Grow a slot's buffer ahead of writing into it, counting the allocation
+    void reserve(const Slot& slot, size_t size) {
+        if (size > slot.buffer->capacity()) {
+            allocations_++;
+            slot.buffer->reserve(size);
+        }
+    }
+
+    // Point the slot's message at the current buffer contents. paho caches the
+    // payload pointer and length, so this must follow every write to the buffer.
+    void seal(const Slot& slot) {
+        slot.message->set_payload(mqtt::binary_ref(mqtt::binary_ref::pointer_type(slot.buffer)));
+    }
+
+    // Grow to at least count slots up front; setup, so not counted as allocations
+    void reserveSlots(size_t count) {
+        uint64_t allocations = allocations_;
+        slots_.reserve(count);
+        while (slots_.size() < count) {
+            addSlot();
+        }
+        allocations_ = allocations;
+    }
+
+    size_t slotCount() const { return slots_.size(); }
+    int qos() const { return qos_; }
+    // Allocations made after construction (new slots and buffer growth)
+    uint64_t allocations() const { return allocations_; }
+
+private:
+    Slot addSlot() {
+        allocations_++;
+        Slot slot;
+        slot.buffer = std::make_shared<std::string>();
+        slot.buffer->reserve(buffer_capacity_);
+        slot.message = mqtt::make_message(topic_, mqtt::binary_ref(mqtt::binary_ref::pointer_type(slot.buffer)),
+                                          qos_, false);
+        slots_.push_back(std::move(slot));
+        return slots_.back();
+    }
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mqtt/async_client.h>
+#include "geovan.pb.h"
+#include "compression.h"
+#include "logger.h"
+#include "message_auth.h"
+#include "outbound_queue.h"
+#include "payload_pool.h"
+#include "publish_window.h"
+#include "store_forward.h"
+
+// Packs many VehiclePosition messages into a single MQTT payload.
+//
+// Frame layout:
+//   bytes 0-1  magic "GV"
+//   byte  2    frame format version (1)
+//   byte  3    flags: kFlagCompact = compact records (see compact_codec.h),
+//              kFlagLz4 / kFlagZstd = compressed body (see compression.h),
+//              kFlagAuthenticated = trailer after the body (see message_auth.h),
+//              kFlagCheckpoint = an HMAC checkpoint, not positions
+//   then, by default, a length-delimited protobuf stream: varint(size) +
+//   VehiclePosition, repeated until the end of the payload (or its trailer);
+//   with kFlagCompact, concatenated compact records. A compressed body
+//   decompresses to one of these. The trailer covers the frame as sent, so
+//   authentication comes after compression.
+//
+// A frame is published when it reaches max_count positions, would exceed
+// max_bytes, or has been open for longer than the flush window. Frames are
+// built in place in pooled buffers, so flushing does not allocate.
+class PositionBatcher {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t kHeaderSize = 4;
+    static constexpr uint8_t kFormatVersion = 1;
+    static constexpr uint8_t kFlagCompact = 0x01;
+    static constexpr uint8_t kFlagLz4 = 0x02;
+    static constexpr uint8_t kFlagZstd = 0x04;
+    static constexpr uint8_t kFlagAuthenticated = auth::kFlagAuthenticated;
+    static constexpr uint8_t kFlagCheckpoint = auth::kFlagCheckpoint;
+    static_assert(kFormatVersion == auth::kFrameFormatVersion, "message_auth.h builds checkpoint frames");
+
+private:
+    std::shared_ptr<mqtt::async_client> client_;
+    std::shared_ptr<PublishWindow> window_;
+    std::shared_ptr<OutboundQueue> outbound_;
+    std::shared_ptr<StoreForward> spool_;
+    size_t max_count_;
+    size_t max_bytes_;
+    std::chrono::milliseconds flush_window_;
+    PayloadPool pool_;
+    std::unique_ptr<FrameCompressor> compressor_;
+    std::shared_ptr<MessageAuthenticator> auth_;
+    PayloadPool::Slot frame_;
+    size_t count_;
+    uint8_t flags_;
+    Clock::time_point opened_;
+    uint64_t frames_published_;
+    uint64_t positions_published_;
+
+public:
+    PositionBatcher(std::shared_ptr<mqtt::async_client> client, std::shared_ptr<PublishWindow> window,
+                    const std::string& topic, int qos, size_t max_count, size_t max_bytes,
+                    std::chrono::milliseconds flush_window)
+        : client_(std::move(client)), window_(std::move(window)),
+          max_count_(max_count > 0 ? max_count : 1), max_bytes_(max_bytes),
+          flush_window_(flush_window), pool_(topic, qos, max_bytes), count_(0), flags_(0),
+          frames_published_(0), positions_published_(0) {
+        startFrame();
+    }
+
+    // Hand sealed frames to a publisher thread instead of publishing them inline
+    void setOutbound(std::shared_ptr<OutboundQueue> outbound) { outbound_ = std::move(outbound); }
+
+    // Carry compact records (addRecord) instead of protobufs. Applies from the next frame.
+    void setCompact(bool compact) {
+        flags_ = compact ? static_cast<uint8_t>(flags_ | kFlagCompact) : static_cast<uint8_t>(flags_ & ~kFlagCompact);
+        if (count_ == 0) (*frame_.buffer)[3] = static_cast<char>(flags_);
+    }
+
+    // Keep frames that cannot be published inline for later (see StoreForward)
+    void setStoreForward(std::shared_ptr<StoreForward> spool) { spool_ = std::move(spool); }
+
+    // Compress frame bodies of at least the compressor's threshold
+    void setCompressor(std::unique_ptr<FrameCompressor> compressor) { compressor_ = std::move(compressor); }
+
+    // Sign or MAC every frame; may be shared with the shard's agents, which use the same stream
+    void setAuthenticator(std::shared_ptr<MessageAuthenticator> auth) { auth_ = std::move(auth); }
+
+    // Codec named by a frame's flags
+    static Compression frameCompression(uint8_t flags) {
+        if (flags & kFlagLz4) return Compression::Lz4;
+        if (flags & kFlagZstd) return Compression::Zstd;
+        return Compression::None;
+    }
+
+    static void appendHeader(std::string& buffer, uint8_t flags) {
+        buffer.push_back('G');
+        buffer.push_back('V');
+        buffer.push_back(static_cast<char>(kFormatVersion));
+        buffer.push_back(static_cast<char>(flags));
+    }
+
+    static void appendVarint(std::string& buffer, uint64_t value) {
+        while (value >= 0x80) {
+            buffer.push_back(static_cast<char>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<char>(value));
+    }
+
+    static size_t varintSize(uint64_t value) {
+        size_t n = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            n++;
+        }
+        return n;
+    }
+
+    // Parse a frame header; data then points at the first record
+    static bool parseHeader(const uint8_t*& data, size_t& size, uint8_t& flags) {
+        if (size < kHeaderSize || data[0] != 'G' || data[1] != 'V' || data[2] != kFormatVersion) return false;
+        flags = data[3];
+        data += kHeaderSize;
+        size -= kHeaderSize;
+        return true;
+    }
+
+    void add(const geovan::VehiclePosition& pos) {
+        size_t size = pos.ByteSizeLong();
+        if (count_ > 0 && frame_.buffer->size() + varintSize(size) + size > max_bytes_) {
+            flush();
+        }
+        if (count_ == 0) {
+            opened_ = Clock::now();
+        }
+
+        std::string& buffer = *frame_.buffer;
+        pool_.reserve(frame_, buffer.size() + varintSize(size) + size);
+        appendVarint(buffer, size);
+        size_t offset = buffer.size();
+        buffer.resize(offset + size);
+        pos.SerializeToArray(&buffer[offset], static_cast<int>(size));
+        count_++;
+
+        if (count_ >= max_count_ || buffer.size() >= max_bytes_) {
+            flush();
+        }
+    }
+
+    // Append one self-delimiting compact record
+    void addRecord(const uint8_t* record, size_t size) {
+        if (count_ > 0 && frame_.buffer->size() + size > max_bytes_) {
+            flush();
+        }
+        if (count_ == 0) {
+            opened_ = Clock::now();
+        }
+
+        std::string& buffer = *frame_.buffer;
+        pool_.reserve(frame_, buffer.size() + size);
+        buffer.append(reinterpret_cast<const char*>(record), size);
+        count_++;
+
+        if (count_ >= max_count_ || buffer.size() >= max_bytes_) {
+            flush();
+        }
+    }
+
+    // Publish the open frame if its flush window has elapsed
+    void poll(Clock::time_point now = Clock::now()) {
+        if (count_ > 0 && now >= deadline()) {
+            flush();
+        }
+    }
+
+    // When the open frame must be flushed; time_point::max() if nothing is pending
+    Clock::time_point deadline() const {
+        return count_ > 0 ? opened_ + flush_window_ : Clock::time_point::max();
+    }
+
+    void flush() {
+        if (count_ == 0) return;
+
+        size_t positions = count_;
+        PayloadPool::Slot out = std::move(frame_);
+        if (compressor_) {
+            // Compress into a second pooled buffer; the uncompressed frame's
+            // slot is free again as soon as it is replaced
+            const std::string& frame = *out.buffer;
+            size_t body = frame.size() - kHeaderSize;
+            if (body >= compressor_->threshold()) {
+                PayloadPool::Slot packed = pool_.acquire();
+                pool_.reserve(packed, kHeaderSize + compressor_->bound(body) + (auth_ ? auth_->trailerCapacity() : 0));
+                std::string& buffer = *packed.buffer;
+                buffer.assign(frame, 0, kHeaderSize);
+                buffer[3] = static_cast<char>(flags_ | (compressor_->compression() == Compression::Lz4
+                                                         ? kFlagLz4 : kFlagZstd));
+                if (compressor_->compress(frame.data() + kHeaderSize, body, buffer)) {
+                    out = std::move(packed);
+                }
+            }
+        }
+        frame_ = PayloadPool::Slot();
+        startFrame();
+        if (auth_) {
+            pool_.reserve(out, out.buffer->size() + auth_->trailerCapacity());
+            // Never publish a frame flagged authenticated without its trailer
+            if (!auth_->authenticate(*out.buffer)) {
+                metrics::registry().auth_failures.add();
+                return;
+            }
+        }
+        pool_.seal(out);
+
+        if (publish(std::move(out.message), positions)) {
+            frames_published_++;
+            positions_published_ += positions;
+        }
+        if (auth_) {
+            if (mqtt::message_ptr checkpoint = auth_->takeCheckpoint()) publish(std::move(checkpoint), 0);
+        }
+    }
+
+    size_t pending() const { return count_; }
+    uint64_t framesPublished() const { return frames_published_; }
+    uint64_t positionsPublished() const { return positions_published_; }
+    uint64_t allocations() const { return pool_.allocations(); }
+
+private:
+    bool publish(mqtt::message_ptr msg, size_t positions) {
+        if (outbound_) {
+            return outbound_->push(std::move(msg));
+        }
+
+        if (spool_) {
+            spool_->send(*client_, *window_, msg);
+            return true;
+        }
+
+        if (!client_->is_connected()) {
+            window_->reject();
+            return false;
+        }
+        window_->acquire();
+        try {
+            client_->publish(msg, PublishWindow::startContext(), *window_);
+            return true;
+        } catch (const mqtt::exception& exc) {
+            window_->cancel();
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Error, "Error publishing batch of ", positions, " positions: ", exc.what());
+            return false;
+        }
+    }
+
+    void startFrame() {
+        frame_ = pool_.acquire();
+        appendHeader(*frame_.buffer, flags_);
+        count_ = 0;
+    }
+};
+
+// Sleep until the given time while flushing any batch whose deadline falls before it
+inline void sleepUntilServicingBatches(PositionBatcher::Clock::time_point until,
+                                       const std::vector<std::shared_ptr<PositionBatcher>>& batchers) {
+    while (true) {
+        auto wake = until;
+        for (auto& batcher : batchers) {
+            wake = std::min(wake, batcher->deadline());
+        }
+        std::this_thread::sleep_until(wake);
+        for (auto& batcher : batchers) {
+            batcher->poll();
+        }
+        if (wake >= until) break;
+    }
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <mqtt/async_client.h>
+#include "geovan.pb.h"
+#include "compact_codec.h"
+#include "datagram_sender.h"
+#include "dead_reckoning.h"
+#include "logger.h"
+#include "message_auth.h"
+#include "metrics.h"
+#include "outbound_queue.h"
+#include "payload_pool.h"
+#include "position_batcher.h"
+#include "publish_pipeline.h"
+#include "publish_window.h"
+#include "store_forward.h"
+#include "vehicle_state.h"
+
+// How positions get from a vehicle onto the wire: encoding, batching,
+// queueing, spooling or UDP, and authentication. One path serves every
+// vehicle sharing a connection, so the per-vehicle part is only the
+// VehicleState passed in with each position; a standalone VehicleAgent has a
+// path with one vehicle, a Fleet shard one for all of its vehicles.
+class PublishPath {
+private:
+    std::shared_ptr<mqtt::async_client> client_;
+    std::shared_ptr<PublishWindow> window_;
+    std::vector<std::shared_ptr<PayloadPool>> pools_;  // by VehicleState::topic
+    std::shared_ptr<PositionBatcher> batcher_;
+    std::shared_ptr<OutboundQueue> outbound_;
+    std::shared_ptr<StoreForward> spool_;
+    std::shared_ptr<DatagramSender> datagram_;    // UDP instead of MQTT when set
+    std::shared_ptr<MessageAuthenticator> auth_;  // signs or MACs unbatched payloads
+    VehicleIds ids_;
+    // Reused every position; only the changing fields are rewritten
+    geovan::VehiclePosition pos_;
+    bool compact_;
+    uint32_t first_index_;  // compact index of vehicle 0
+    uint32_t keyframe_interval_;
+    DeadReckoning reckoning_;
+    pipeline::Config pipeline_;
+
+public:
+    // Initial payload buffer size; a serialized VehiclePosition is well under this
+    static constexpr size_t kPayloadCapacity = 128;
+    // Serialize time is recorded for every this many positions per vehicle
+    static constexpr uint32_t kSerializeSampling = 16;
+
+    PublishPath(std::shared_ptr<mqtt::async_client> client, std::shared_ptr<PublishWindow> window,
+                std::vector<std::shared_ptr<PayloadPool>> pools, VehicleIds ids)
+        : client_(std::move(client)), window_(std::move(window)), pools_(std::move(pools)), ids_(std::move(ids)),
+          compact_(false), first_index_(0), keyframe_interval_(compact::kDefaultKeyframeInterval) {}
+
+    const std::shared_ptr<mqtt::async_client>& client() const { return client_; }
+    const std::shared_ptr<PublishWindow>& window() const { return window_; }
+    const std::shared_ptr<PositionBatcher>& batcher() const { return batcher_; }
+    const std::shared_ptr<OutboundQueue>& outbound() const { return outbound_; }
+    const std::shared_ptr<StoreForward>& spool() const { return spool_; }
+    const std::shared_ptr<DatagramSender>& datagram() const { return datagram_; }
+    PayloadPool& pool(size_t topic) { return *pools_[topic]; }
+    const VehicleIds& ids() const { return ids_; }
+
+    uint64_t payloadAllocations() const {
+        uint64_t total = 0;
+        for (auto& pool : pools_) total += pool->allocations();
+        return total;
+    }
+
+    // Route positions into batched frames instead of publishing them one by one
+    void setBatcher(std::shared_ptr<PositionBatcher> batcher) {
+        batcher_ = std::move(batcher);
+        if (batcher_ && compact_) batcher_->setCompact(true);
+        if (batcher_ && auth_) batcher_->setAuthenticator(auth_);
+        updatePipeline();
+    }
+
+    // Queue serialized positions for a publisher thread instead of publishing inline
+    void setOutbound(std::shared_ptr<OutboundQueue> outbound) {
+        outbound_ = std::move(outbound);
+        updatePipeline();
+    }
+
+    // Keep positions published inline while offline and forward them later
+    void setStoreForward(std::shared_ptr<StoreForward> spool) {
+        spool_ = std::move(spool);
+        updatePipeline();
+    }
+
+    // Send every position as a UDP datagram instead of publishing it over MQTT
+    void setDatagram(std::shared_ptr<DatagramSender> datagram) {
+        datagram_ = std::move(datagram);
+        updatePipeline();
+    }
+
+    // Authenticate every payload (see message_auth.h). The batcher, if any,
+    // takes the authenticator too; unbatched positions then go out as
+    // one-record frames.
+    void setAuthenticator(std::shared_ptr<MessageAuthenticator> auth) {
+        auth_ = std::move(auth);
+        if (batcher_) batcher_->setAuthenticator(auth_);
+    }
+
+    // Publish compact records (compact_codec.h) instead of VehiclePosition
+    // protobufs; vehicle i is numbered first_index + i
+    void setCompact(uint32_t first_index, uint32_t keyframe_interval) {
+        compact_ = true;
+        first_index_ = first_index;
+        keyframe_interval_ = std::clamp<uint32_t>(keyframe_interval, 1, VehicleState::kMaxKeyframeInterval);
+        if (batcher_) batcher_->setCompact(true);
+        updatePipeline();
+    }
+
+    // Adaptive reporting: publish only when the backend's dead-reckoned
+    // position or heading would be off by more than the policy allows, or on
+    // its heartbeat (see DeadReckoning)
+    void setDeadReckoning(const DeadReckoningPolicy& policy) { reckoning_.setPolicy(policy); }
+
+    // How positions are encoded and sent, following the set* calls
+    const pipeline::Config& pipelineConfig() const { return pipeline_; }
+
+    static int64_t wallClockMillis() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Publish one position of vehicle, whose publish state is v. The path for
+    // one configuration, resolved at compile time; it must match
+    // pipelineConfig() (see pipeline::dispatch). Fleet steps vehicles of one
+    // configuration in bulk and calls this in a loop. Returns whether the
+    // position was handed on; only then does it become v's basis, otherwise
+    // the next position goes out in full (VehicleState::basisLost).
+    template <class Encoding, class Transport>
+    bool publishAs(VehicleState& v, uint32_t vehicle, double lat, double lon, double speed, double heading,
+                   int64_t timestamp) {
+        constexpr bool batched = std::is_same_v<Transport, pipeline::BatchTransport>;
+        // Suppressed positions take no sequence number, so gaps still mean loss
+        if (reckoning_.enabled() && !reckoning_.shouldReport(v, lat, lon, heading, timestamp)) {
+            metrics::registry().suppressed.add();
+            return false;
+        }
+        try {
+            uint32_t seq = v.seq++;
+            // Encoding is timed for one position in kSerializeSampling
+            bool timed = (v.seq % kSerializeSampling) == 0;
+            uint64_t started = timed ? metrics::nowNanos() : 0;
+            int32_t lat_e7 = compact::toFixed(lat);
+            int32_t lon_e7 = compact::toFixed(lon);
+            bool sent = true;
+
+            if constexpr (std::is_same_v<Encoding, pipeline::CompactEncoding>) {
+                uint8_t record[compact::kMaxRecordSize];
+                bool keyframe = v.since_keyframe >= keyframe_interval_;
+                size_t size = compact::encodeRecord(first_index_ + vehicle, keyframe, lat_e7, lon_e7, v.lat_e7,
+                                                    v.lon_e7, timestamp, v.millisSincePublished(timestamp), seq,
+                                                    speed, heading, record);
+                if constexpr (batched) {
+                    batcher_->addRecord(record, size);
+                } else {
+                    // A one-record frame, so consumers parse batched and single payloads alike
+                    PayloadPool& pool = *pools_[v.topic];
+                    PayloadPool::Slot slot = pool.acquire();
+                    std::string& buffer = *slot.buffer;
+                    PositionBatcher::appendHeader(buffer, PositionBatcher::kFlagCompact);
+                    buffer.append(reinterpret_cast<const char*>(record), size);
+                    if (timed) metrics::registry().serialize_time.record(metrics::nowNanos() - started);
+                    sent = sendFrame<Transport>(pool, slot);
+                }
+                if (sent) v.since_keyframe = keyframe ? 1 : static_cast<uint16_t>(v.since_keyframe + 1);
+            } else {
+                // Update the reused position message
+                geovan::VehiclePosition& pos = pos_;
+                ids_.format(vehicle, *pos.mutable_id());
+                pos.mutable_pos()->set_lat(lat);
+                pos.mutable_pos()->set_lon(lon);
+                pos.set_speed(speed);
+                pos.set_heading(heading);
+                pos.set_timestamp(timestamp);
+                pos.set_seq(seq);
+
+                if constexpr (batched) {
+                    batcher_->add(pos);
+                } else if (auth_) {
+                    // A one-record frame, so the trailer has somewhere to go
+                    PayloadPool& pool = *pools_[v.topic];
+                    PayloadPool::Slot slot = pool.acquire();
+                    std::string& buffer = *slot.buffer;
+                    size_t size = pos.ByteSizeLong();
+                    pool.reserve(slot, PositionBatcher::kHeaderSize + PositionBatcher::varintSize(size) + size +
+                                           auth_->trailerCapacity());
+                    PositionBatcher::appendHeader(buffer, 0);
+                    PositionBatcher::appendVarint(buffer, size);
+                    size_t offset = buffer.size();
+                    buffer.resize(offset + size);
+                    pos.SerializeToArray(&buffer[offset], static_cast<int>(size));
+                    if (timed) metrics::registry().serialize_time.record(metrics::nowNanos() - started);
+                    sent = sendFrame<Transport>(pool, slot);
+                } else {
+                    // Serialize straight into a pooled buffer already bound to a message
+                    PayloadPool::Slot slot;
+                    if (pools_[v.topic]->serialize(pos, slot)) {
+                        if (timed) metrics::registry().serialize_time.record(metrics::nowNanos() - started);
+                        sent = send<Transport>(std::move(slot.message));
+                    } else {
+                        static LogRateLimit limit(5, std::chrono::seconds(1));
+                        logger().limited(limit, LogLevel::Error, "Failed to serialize protobuf message");
+                        sent = false;
+                    }
+                }
+            }
+            if (!sent) {
+                v.basisLost();
+                return false;
+            }
+            v.recordPublished(lat_e7, lon_e7, speed, heading, timestamp);
+            return true;
+        } catch (const mqtt::exception& exc) {
+            v.basisLost();
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Error, "Error publishing message: ", exc.what());
+            return false;
+        }
+    }
+
+private:
+    // UDP replaces MQTT altogether; otherwise the batcher first (it applies
+    // the queue and spool itself), then the queue, then the spool, else
+    // publish inline
+    void updatePipeline() {
+        pipeline_.encoding = compact_ ? pipeline::Encoding::Compact : pipeline::Encoding::Protobuf;
+        pipeline_.transport = datagram_ ? pipeline::Transport::Datagram
+                              : batcher_ ? pipeline::Transport::Batch
+                              : outbound_ ? pipeline::Transport::Queue
+                              : spool_ ? pipeline::Transport::Spool
+                              : pipeline::Transport::Direct;
+    }
+
+    // Seal a one-record frame and send it, authenticated when an
+    // authenticator is set, followed by any checkpoint that fell due. A frame
+    // that could not be authenticated is dropped. Returns whether the frame
+    // was accepted (see send).
+    template <class Transport>
+    bool sendFrame(PayloadPool& pool, PayloadPool::Slot& slot) {
+        if (auth_) {
+            pool.reserve(slot, slot.buffer->size() + auth_->trailerCapacity());
+            if (!auth_->authenticate(*slot.buffer)) {
+                metrics::registry().auth_failures.add();
+                return false;
+            }
+        }
+        pool.seal(slot);
+        bool sent = send<Transport>(std::move(slot.message));
+        if (auth_) {
+            if (mqtt::message_ptr checkpoint = auth_->takeCheckpoint()) send<Transport>(std::move(checkpoint));
+        }
+        return sent;
+    }
+
+    // Hand message on; false if it was dropped on the spot (e.g. too large for
+    // a datagram). Once accepted it may still be lost further on (a UDP drop,
+    // a spool full to the brim), like any message on the way to the backend.
+    // Publish errors throw.
+    template <class Transport>
+    bool send(mqtt::message_ptr message) {
+        if constexpr (std::is_same_v<Transport, pipeline::DatagramTransport>) {
+            return datagram_->send(std::move(message));
+        } else if constexpr (std::is_same_v<Transport, pipeline::QueueTransport>) {
+            // A full queue drops or blocks per its policy; drops are counted there
+            return outbound_->push(std::move(message));
+        } else if constexpr (std::is_same_v<Transport, pipeline::SpoolTransport>) {
+            spool_->send(*client_, *window_, message);
+            return true;
+        } else if (!client_->is_connected()) {
+            // Offline: drop rather than wait on a window that cannot drain
+            window_->reject();
+            return false;
+        } else {
+            // Publish to MQTT without waiting for the broker; the window bounds
+            // how many messages may be outstanding and blocks when it is full
+            window_->acquire();
+            try {
+                client_->publish(message, PublishWindow::startContext(), *window_);
+            } catch (const mqtt::exception&) {
+                window_->cancel();
+                throw;
+            }
+            return true;
+        }
+    }
+};
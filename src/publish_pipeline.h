@@ -0,0 +1,71 @@
+#pragma once
+
+#include <type_traits>
+
+// Compile-time configurations of the per-position publish path. A position is
+// encoded one way and handed to one transport; rather than testing the agent's
+// options on every message, the hot loop is instantiated per combination
+// (PublishPath::publishAs) and dispatch() picks the instantiation at run time,
+// once per call rather than once per position.
+namespace pipeline {
+
+enum class Encoding {
+    Protobuf,  // VehiclePosition messages
+    Compact,   // compact_codec.h records
+};
+
+enum class Transport {
+    Batch,     // append to a PositionBatcher, which publishes whole frames
+    Queue,     // push onto an OutboundQueue drained by a publisher thread
+    Spool,     // publish through StoreForward, kept while offline
+    Direct,    // publish inline under the PublishWindow
+    Datagram,  // send as a UDP datagram (DatagramSender), bypassing MQTT
+};
+
+struct Config {
+    Encoding encoding = Encoding::Protobuf;
+    Transport transport = Transport::Direct;
+};
+
+// Policy tags, one type per enumerator
+struct ProtobufEncoding { static constexpr Encoding value = Encoding::Protobuf; };
+struct CompactEncoding { static constexpr Encoding value = Encoding::Compact; };
+struct BatchTransport { static constexpr Transport value = Transport::Batch; };
+struct QueueTransport { static constexpr Transport value = Transport::Queue; };
+struct SpoolTransport { static constexpr Transport value = Transport::Spool; };
+struct DirectTransport { static constexpr Transport value = Transport::Direct; };
+struct DatagramTransport { static constexpr Transport value = Transport::Datagram; };
+
+template <class EncodingTag, class F>
+void dispatchTransport(Transport transport, F& f) {
+    switch (transport) {
+    case Transport::Batch:
+        f(EncodingTag{}, BatchTransport{});
+        break;
+    case Transport::Queue:
+        f(EncodingTag{}, QueueTransport{});
+        break;
+    case Transport::Spool:
+        f(EncodingTag{}, SpoolTransport{});
+        break;
+    case Transport::Direct:
+        f(EncodingTag{}, DirectTransport{});
+        break;
+    case Transport::Datagram:
+        f(EncodingTag{}, DatagramTransport{});
+        break;
+    }
+}
+
+// Call f(encoding tag, transport tag) with the tags matching config; f is
+// typically a generic lambda, instantiated for each combination
+template <class F>
+void dispatch(const Config& config, F&& f) {
+    if (config.encoding == Encoding::Compact) {
+        dispatchTransport<CompactEncoding>(config.transport, f);
+    } else {
+        dispatchTransport<ProtobufEncoding>(config.transport, f);
+    }
+}
+
+}  // namespace pipeline
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <mqtt/async_client.h>
+#include "metrics.h"
+
+// Bounds the number of outstanding publish tokens on one MQTT connection.
+// Publishers call acquire() before handing a message to the client and pass the
+// window as the delivery listener; paho releases the slot from its callback
+// thread when the broker acknowledges (or rejects) the message. Publishing with
+// startContext() as the token's user context also records ack latency.
+class PublishWindow : public mqtt::iaction_listener {
+private:
+    const size_t max_in_flight_;
+    std::mutex mutex_;
+    std::condition_variable slot_freed_;
+    std::atomic<size_t> in_flight_;
+    std::atomic<uint64_t> completed_;
+    std::atomic<uint64_t> failed_;
+    std::atomic<uint64_t> stalls_;
+
+public:
+    explicit PublishWindow(size_t max_in_flight)
+        : max_in_flight_(max_in_flight > 0 ? max_in_flight : 1),
+          in_flight_(0), completed_(0), failed_(0), stalls_(0) {}
+
+    PublishWindow(const PublishWindow&) = delete;
+    PublishWindow& operator=(const PublishWindow&) = delete;
+
+    // Reserve a slot, blocking while the window is full (backpressure)
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (in_flight_ >= max_in_flight_) {
+            stalls_++;
+            slot_freed_.wait(lock, [this] { return in_flight_ < max_in_flight_; });
+        }
+        in_flight_++;
+        metrics::registry().in_flight.add(1);
+    }
+
+    // Reserve a slot only if fewer than limit are in flight; never blocks
+    bool tryAcquire(size_t limit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (in_flight_ >= std::min(limit, max_in_flight_)) return false;
+        in_flight_++;
+        metrics::registry().in_flight.add(1);
+        return true;
+    }
+
+    // User context for a publish: when it was handed to the client, so the
+    // acknowledgement latency can be taken from the token alone
+    static void* startContext() {
+        return reinterpret_cast<void*>(static_cast<uintptr_t>(metrics::nowNanos()));
+    }
+
+    // Publish start carried by startContext(), 0 if the token has none
+    static uint64_t startedAt(const mqtt::token& tok) {
+        return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(tok.get_user_context()));
+    }
+
+    // Give back a slot whose publish never reached the client (e.g. it threw)
+    void cancel() {
+        failed_++;
+        metrics::registry().publish_errors.add();
+        release();
+    }
+
+    // Count a publish skipped because the connection is down; takes no slot
+    void reject() {
+        failed_++;
+        metrics::registry().publish_errors.add();
+    }
+
+    // Wait until every outstanding publish has completed, up to timeout
+    bool drain(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return slot_freed_.wait_for(lock, timeout, [this] { return in_flight_ == 0; });
+    }
+
+    size_t maxInFlight() const { return max_in_flight_; }
+    size_t inFlight() const { return in_flight_; }
+    uint64_t completed() const { return completed_; }
+    uint64_t failed() const { return failed_; }
+    uint64_t stalls() const { return stalls_; }
+
+    void on_success(const mqtt::token& tok) override {
+        completed_++;
+        metrics::Registry& m = metrics::registry();
+        m.published.add();
+        if (uint64_t started = startedAt(tok)) {
+            uint64_t now = metrics::nowNanos();
+            m.publish_ack.record(now > started ? now - started : 0);
+        }
+        release();
+    }
+
+    void on_failure(const mqtt::token&) override {
+        failed_++;
+        metrics::registry().publish_errors.add();
+        release();
+    }
+
+private:
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_flight_--;
+        }
+        metrics::registry().in_flight.add(-1);
+        slot_freed_.notify_all();
+    }
+};
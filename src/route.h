@@ -0,0 +1,440 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "geo.h"
+#include "mapped_file.h"
+
+// Compiled route file (host byte order, little endian on every supported target):
+//
+//   RouteFileHeader, then 8-byte aligned arrays at the offsets it names:
+//     lat, lon          point_count x float64 degrees, or int32 1e-7 degrees with kFixedPoint
+//     cumulative dist   point_count + 1 x float64 meters; entry i is the distance
+//                       from point 0 to point i, the last entry closes the loop
+//     bearing           point_count x float32 degrees, segment i towards i + 1 (wrapping)
+//
+// The file is mapped read-only and used in place, so every agent on a host
+// shares one page-cached copy.
+struct RouteFileHeader {
+    static constexpr char kMagic[8] = {'G', 'V', 'R', 'O', 'U', 'T', 'E', '\0'};
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kFixedPoint = 1u << 0;
+    static constexpr uint32_t kHasDistance = 1u << 1;
+    static constexpr uint32_t kHasBearing = 1u << 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t point_count;
+    uint64_t lat_offset;
+    uint64_t lon_offset;
+    uint64_t distance_offset;
+    uint64_t bearing_offset;
+    uint64_t reserved;
+};
+static_assert(sizeof(RouteFileHeader) == 64, "route file header layout");
+
+constexpr double kFixedPointScale = 1e7;
+
+// Split [0, count) into up to threads contiguous ranges of at least min_per_thread
+// items and run fn(begin, end) on each, the first on the calling thread.
+// For one-off preprocessing at startup, so it starts its own threads.
+template <class Fn>
+void forEachRange(size_t count, size_t threads, size_t min_per_thread, Fn&& fn) {
+    size_t ranges = std::max<size_t>(1, std::min(threads, count / std::max<size_t>(min_per_thread, 1)));
+    std::vector<std::thread> helpers;
+    helpers.reserve(ranges - 1);
+    for (size_t r = 1; r < ranges; r++) {
+        helpers.emplace_back([&fn, count, ranges, r] { fn(r * count / ranges, (r + 1) * count / ranges); });
+    }
+    fn(size_t{0}, count / ranges);
+    for (auto& helper : helpers) helper.join();
+}
+
+// Read-only route shared between the vehicles of a fleet. Coordinates are kept
+// structure-of-arrays, either owned or pointing into a mapped compiled file,
+// next to a segment table holding the great-circle length and initial bearing
+// of every segment i -> i + 1 (the last one closes the loop back to point 0).
+class Route {
+private:
+    std::vector<double> lat_storage_;
+    std::vector<double> lon_storage_;
+    std::vector<double> distance_storage_;
+    std::vector<float> bearing_storage_;
+    MappedFile mapping_;
+    const void* lat_;
+    const void* lon_;
+    const double* distance_;
+    const float* bearing_;
+    size_t size_;
+    bool fixed_point_;
+
+public:
+    Route() : lat_(nullptr), lon_(nullptr), distance_(nullptr), bearing_(nullptr),
+              size_(0), fixed_point_(false) {}
+
+    Route(std::vector<double> lat, std::vector<double> lon) : Route() {
+        assign(std::move(lat), std::move(lon));
+    }
+
+    // Segments are measured in parallel above this many points per thread
+    static constexpr size_t kSegmentsPerThread = 1 << 16;
+
+    Route(Route&& other) noexcept : Route() { *this = std::move(other); }
+
+    Route& operator=(Route&& other) noexcept {
+        if (this == &other) return *this;
+        // Moving the vectors and the mapping keeps their buffers in place, so
+        // the raw pointers carry over unchanged
+        lat_storage_ = std::move(other.lat_storage_);
+        lon_storage_ = std::move(other.lon_storage_);
+        distance_storage_ = std::move(other.distance_storage_);
+        bearing_storage_ = std::move(other.bearing_storage_);
+        mapping_ = std::move(other.mapping_);
+        lat_ = other.lat_;
+        lon_ = other.lon_;
+        distance_ = other.distance_;
+        bearing_ = other.bearing_;
+        size_ = other.size_;
+        fixed_point_ = other.fixed_point_;
+        other.clear();
+        return *this;
+    }
+
+    Route(const Route&) = delete;
+    Route& operator=(const Route&) = delete;
+
+    // Take ownership of the coordinates and build the segment table on up to threads threads
+    void assign(std::vector<double> lat, std::vector<double> lon, size_t threads = 1) {
+        clear();
+        size_ = std::min(lat.size(), lon.size());
+        lat_storage_ = std::move(lat);
+        lon_storage_ = std::move(lon);
+        lat_ = lat_storage_.data();
+        lon_ = lon_storage_.data();
+        buildSegments(threads);
+    }
+
+    void clear() {
+        lat_storage_.clear();
+        lon_storage_.clear();
+        distance_storage_.clear();
+        bearing_storage_.clear();
+        mapping_.close();
+        lat_ = lon_ = nullptr;
+        distance_ = nullptr;
+        bearing_ = nullptr;
+        size_ = 0;
+        fixed_point_ = false;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    bool isMapped() const { return mapping_.data() != nullptr; }
+
+    double lat(size_t i) const {
+        return fixed_point_ ? static_cast<const int32_t*>(lat_)[i] / kFixedPointScale
+                            : static_cast<const double*>(lat_)[i];
+    }
+
+    double lon(size_t i) const {
+        return fixed_point_ ? static_cast<const int32_t*>(lon_)[i] / kFixedPointScale
+                            : static_cast<const double*>(lon_)[i];
+    }
+
+    // Segment table lookups, valid for i < size()
+    double bearing(size_t i) const { return bearing_[i]; }
+    double segmentLength(size_t i) const { return distance_[i + 1] - distance_[i]; }
+    // Distance from point 0 to point i; entry size() is the full loop length
+    double distanceAt(size_t i) const { return distance_[i]; }
+    double loopLength() const { return size_ ? distance_[size_] : 0.0; }
+
+    // Raw arrays for batch kernels. Coordinates are int32 1e-7 degrees when
+    // isFixedPoint(), float64 degrees otherwise.
+    bool isFixedPoint() const { return fixed_point_; }
+    const void* latData() const { return lat_; }
+    const void* lonData() const { return lon_; }
+    const double* distanceData() const { return distance_; }
+    const float* bearingData() const { return bearing_; }
+
+    // Use a mapped compiled route file in place. Returns false if it is corrupt.
+    bool adoptMapping(MappedFile file) {
+        if (!isCompiledRoute(file.data(), file.size())) return false;
+
+        RouteFileHeader header;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (header.version != RouteFileHeader::kVersion) {
+            std::cerr << "Unsupported route file version " << header.version << std::endl;
+            return false;
+        }
+
+        uint64_t n = header.point_count;
+        size_t coord_size = (header.flags & RouteFileHeader::kFixedPoint) ? sizeof(int32_t) : sizeof(double);
+        bool has_distance = header.flags & RouteFileHeader::kHasDistance;
+        bool has_bearing = header.flags & RouteFileHeader::kHasBearing;
+        // Once the coordinates fit, n is bounded by the file size and n + 1 cannot wrap
+        if (!arrayFits(file, header.lat_offset, n, coord_size) ||
+            !arrayFits(file, header.lon_offset, n, coord_size) ||
+            (has_distance && !arrayFits(file, header.distance_offset, n + 1, sizeof(double))) ||
+            (has_bearing && !arrayFits(file, header.bearing_offset, n, sizeof(float)))) {
+            std::cerr << "Corrupt route file: array outside of file" << std::endl;
+            return false;
+        }
+
+        clear();
+        mapping_ = std::move(file);
+        const char* base = mapping_.data();
+        fixed_point_ = header.flags & RouteFileHeader::kFixedPoint;
+        lat_ = base + header.lat_offset;
+        lon_ = base + header.lon_offset;
+        distance_ = has_distance ? reinterpret_cast<const double*>(base + header.distance_offset) : nullptr;
+        bearing_ = has_bearing ? reinterpret_cast<const float*>(base + header.bearing_offset) : nullptr;
+        size_ = static_cast<size_t>(n);
+        if (!distance_ || !bearing_) {
+            buildSegments();
+        }
+        return true;
+    }
+
+    static bool isCompiledRoute(const char* data, size_t size) {
+        return size >= sizeof(RouteFileHeader) &&
+               std::memcmp(data, RouteFileHeader::kMagic, sizeof(RouteFileHeader::kMagic)) == 0;
+    }
+
+private:
+    // Fill whichever of the distance and bearing tables is missing. Segment
+    // lengths are independent, so threads measure ranges of them and one pass
+    // then sums them into the cumulative distances.
+    void buildSegments(size_t threads = 1) {
+        if (!distance_) {
+            distance_storage_.assign(size_ + 1, 0.0);
+        }
+        if (!bearing_) {
+            bearing_storage_.resize(size_);
+        }
+        bool distances = !distance_;
+        bool bearings = !bearing_;
+        forEachRange(size_, threads, kSegmentsPerThread, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                size_t next = (i + 1) % size_;
+                if (distances) {
+                    distance_storage_[i + 1] = geo::distanceMeters(lat(i), lon(i), lat(next), lon(next));
+                }
+                if (bearings) {
+                    bearing_storage_[i] = static_cast<float>(
+                        geo::initialBearing(lat(i), lon(i), lat(next), lon(next)));
+                }
+            }
+        });
+        if (distances) {
+            for (size_t i = 0; i < size_; i++) {
+                distance_storage_[i + 1] += distance_storage_[i];
+            }
+            distance_ = distance_storage_.data();
+        }
+        if (bearings) {
+            bearing_ = bearing_storage_.data();
+        }
+    }
+
+    // Whether count elements of elem_size bytes at offset lie within file;
+    // compared by division, so a forged count cannot overflow past the check
+    static bool arrayFits(const MappedFile& file, uint64_t offset, uint64_t count, size_t elem_size) {
+        return offset % 8 == 0 && offset >= sizeof(RouteFileHeader) &&
+               offset <= file.size() && count <= (file.size() - offset) / elem_size;
+    }
+};
+
+inline Route defaultRoute() {
+    // Simple built-in route used until one is loaded from CSV
+    return Route({28.7041, 28.6139, 28.7041},   // Delhi, Delhi, back to start
+                 {77.1025, 77.2090, 77.1025});
+}
+
+namespace route_csv {
+
+inline const char* skipBlanks(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+// Parse "lat,lon[,ignored...]" from [p, end). Locale independent.
+inline bool parseLatLon(const char* p, const char* end, double& lat, double& lon) {
+    p = skipBlanks(p, end);
+    auto r = std::from_chars(p, end, lat);
+    if (r.ec != std::errc()) return false;
+    p = skipBlanks(r.ptr, end);
+    if (p == end || *p != ',') return false;
+    p = skipBlanks(p + 1, end);
+    r = std::from_chars(p, end, lon);
+    if (r.ec != std::errc()) return false;
+    p = skipBlanks(r.ptr, end);
+    return p == end || *p == ',';
+}
+
+// Rows parsed from one piece of a CSV buffer
+struct Chunk {
+    std::vector<double> lats;
+    std::vector<double> lons;
+    size_t lines = 0;
+    size_t malformed = 0;
+    size_t first_malformed = 0;  // line number within the chunk
+};
+
+// Below this much text per thread, starting another thread costs more than it saves
+constexpr size_t kBytesPerThread = 256 << 10;
+
+inline void parseChunk(const char* p, const char* end, Chunk& chunk) {
+    // Recorded traces run about 20 bytes per "lat,lon" line
+    size_t estimate = static_cast<size_t>(end - p) / 20 + 1;
+    chunk.lats.reserve(estimate);
+    chunk.lons.reserve(estimate);
+
+    while (p < end) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        chunk.lines++;
+
+        double lat, lon;
+        if (parseLatLon(p, eol, lat, lon)) {
+            chunk.lats.push_back(lat);
+            chunk.lons.push_back(lon);
+        } else if (skipBlanks(p, eol) != eol) {
+            if (chunk.malformed++ == 0) chunk.first_malformed = chunk.lines;
+        }
+        p = eol + 1;
+    }
+}
+
+// Parse lat,lon rows from a CSV buffer. Blank lines are ignored; other
+// unparseable lines are counted and reported once. A large buffer is cut at
+// line boundaries into one chunk per thread, parsed in parallel and joined in
+// order; the segment table is built on the same threads.
+inline void parse(const char* p, const char* end, const std::string& filename, Route& route, size_t threads = 1) {
+    size_t size = static_cast<size_t>(end - p);
+    size_t pieces = std::max<size_t>(1, std::min(threads, size / kBytesPerThread));
+    std::vector<const char*> bounds(pieces + 1, end);
+    bounds[0] = p;
+    for (size_t k = 1; k < pieces; k++) {
+        const char* cut = std::max(bounds[k - 1], p + k * size / pieces);
+        const char* eol = static_cast<const char*>(std::memchr(cut, '\n', end - cut));
+        bounds[k] = eol ? eol + 1 : end;
+    }
+    std::vector<Chunk> chunks(pieces);
+    forEachRange(pieces, pieces, 1, [&](size_t begin, size_t stop) {
+        for (size_t k = begin; k < stop; k++) parseChunk(bounds[k], bounds[k + 1], chunks[k]);
+    });
+
+    size_t total = 0;
+    for (const Chunk& chunk : chunks) total += chunk.lats.size();
+    std::vector<double> lats = std::move(chunks[0].lats);
+    std::vector<double> lons = std::move(chunks[0].lons);
+    lats.reserve(total);
+    lons.reserve(total);
+    size_t line_number = chunks[0].lines;
+    size_t malformed = chunks[0].malformed;
+    size_t first_malformed = chunks[0].first_malformed;
+    for (size_t k = 1; k < pieces; k++) {
+        Chunk& chunk = chunks[k];
+        lats.insert(lats.end(), chunk.lats.begin(), chunk.lats.end());
+        lons.insert(lons.end(), chunk.lons.begin(), chunk.lons.end());
+        if (chunk.malformed > 0 && malformed == 0) first_malformed = line_number + chunk.first_malformed;
+        malformed += chunk.malformed;
+        line_number += chunk.lines;
+    }
+    route.assign(std::move(lats), std::move(lons), threads);
+
+    if (malformed > 0) {
+        std::cerr << "Skipped " << malformed << " malformed line(s) in " << filename
+                  << " (first at line " << first_malformed << ")" << std::endl;
+    }
+}
+
+}  // namespace route_csv
+
+// Load a route file: compiled routes are mapped in place, anything else is
+// parsed as lat,lon CSV from the same mapping on up to threads threads.
+inline bool loadRouteFile(const std::string& filename, Route& route, size_t threads = 1) {
+    MappedFile file;
+    if (!file.open(filename, MADV_SEQUENTIAL)) {
+        std::cerr << "Could not open route file: " << filename << std::endl;
+        return false;
+    }
+
+    if (Route::isCompiledRoute(file.data(), file.size())) {
+        if (!route.adoptMapping(std::move(file))) {
+            std::cerr << "Could not load compiled route file: " << filename << std::endl;
+            return false;
+        }
+        std::cout << "Mapped " << route.size() << " compiled route points" << std::endl;
+        return true;
+    }
+
+    route_csv::parse(file.begin(), file.end(), filename, route, threads);
+    std::cout << "Loaded " << route.size() << " route points" << std::endl;
+    return true;
+}
+
+// Write route as a compiled route file, including its segment table
+inline bool compileRoute(const Route& route, const std::string& filename, bool fixed_point) {
+    const uint64_t n = route.size();
+    if (n == 0) {
+        std::cerr << "Refusing to compile an empty route" << std::endl;
+        return false;
+    }
+
+    auto align8 = [](uint64_t offset) { return (offset + 7) & ~uint64_t{7}; };
+    const uint64_t coord_size = fixed_point ? sizeof(int32_t) : sizeof(double);
+
+    RouteFileHeader header = {};
+    std::memcpy(header.magic, RouteFileHeader::kMagic, sizeof(header.magic));
+    header.version = RouteFileHeader::kVersion;
+    header.flags = RouteFileHeader::kHasDistance | RouteFileHeader::kHasBearing |
+                   (fixed_point ? RouteFileHeader::kFixedPoint : 0);
+    header.point_count = n;
+    header.lat_offset = sizeof(RouteFileHeader);
+    header.lon_offset = align8(header.lat_offset + n * coord_size);
+    header.distance_offset = align8(header.lon_offset + n * coord_size);
+    header.bearing_offset = align8(header.distance_offset + (n + 1) * sizeof(double));
+    const uint64_t file_size = align8(header.bearing_offset + n * sizeof(float));
+
+    std::vector<char> out(file_size, 0);
+    std::memcpy(out.data(), &header, sizeof(header));
+
+    auto* dist = reinterpret_cast<double*>(out.data() + header.distance_offset);
+    auto* bearing = reinterpret_cast<float*>(out.data() + header.bearing_offset);
+    for (uint64_t i = 0; i < n; i++) {
+        double lat = route.lat(i);
+        double lon = route.lon(i);
+        if (fixed_point) {
+            reinterpret_cast<int32_t*>(out.data() + header.lat_offset)[i] =
+                static_cast<int32_t>(std::lround(lat * kFixedPointScale));
+            reinterpret_cast<int32_t*>(out.data() + header.lon_offset)[i] =
+                static_cast<int32_t>(std::lround(lon * kFixedPointScale));
+        } else {
+            reinterpret_cast<double*>(out.data() + header.lat_offset)[i] = lat;
+            reinterpret_cast<double*>(out.data() + header.lon_offset)[i] = lon;
+        }
+        dist[i] = route.distanceAt(i);
+        bearing[i] = static_cast<float>(route.bearing(i));
+    }
+    dist[n] = route.loopLength();
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file.write(out.data(), static_cast<std::streamsize>(out.size()))) {
+        std::cerr << "Could not write route file: " << filename << std::endl;
+        return false;
+    }
+    std::cout << "Compiled " << n << " route points (" << dist[n] / 1000.0 << " km loop) to "
+              << filename << std::endl;
+    return true;
+}
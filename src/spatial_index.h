@@ -0,0 +1,540 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "geo.h"
+#include "logger.h"
+#include "mapped_file.h"
+#include "route.h"
+
+namespace spatial {
+
+constexpr double kMetersPerDegree = geo::kEarthRadiusMeters * geo::kDegToRad;
+
+inline uint64_t cellKey(int32_t x, int32_t y) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+}
+
+// Spreads neighbouring cell keys over the bucket table
+inline uint64_t mixKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+// cos(x) for |x| <= pi/2 by its Taylor series to x^10, within 5e-7: a few
+// multiplies where std::cos costs tens of nanoseconds per candidate pair
+inline double cosLatitude(double x) {
+    double x2 = x * x;
+    return 1.0 + x2 * (-1.0 / 2 + x2 * (1.0 / 24 + x2 * (-1.0 / 720 + x2 * (1.0 / 40320 + x2 * (-1.0 / 3628800)))));
+}
+
+// Local flat-earth distance squared in m^2; within a fraction of a percent of
+// the great-circle distance at proximity ranges
+inline double distanceSquared(double lat1, double lon1, double lat2, double lon2) {
+    double dy = (lat2 - lat1) * kMetersPerDegree;
+    double dx = (lon2 - lon1) * kMetersPerDegree * cosLatitude((lat1 + lat2) * 0.5 * geo::kDegToRad);
+    return dx * dx + dy * dy;
+}
+
+// Escape s for a JSON string literal (event payloads carry geofence names)
+inline std::string jsonEscape(const std::string& s) {
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+}  // namespace spatial
+
+// Uniform grid over moving points, rebuilt from scratch every update with a
+// counting sort by cell: a few linear passes and no allocation once the arrays
+// have grown. Cells are at least cell_meters on a side everywhere in the point
+// set (longitude cells are sized at its highest latitude), so two points within
+// cell_meters of each other are in the same or adjacent cells.
+//
+// Cells normally form a dense row-major array over the points' bounding box,
+// coarsened so there are at most kCellsPerPoint per point; a point's forward
+// neighbours are then the next cell and a contiguous run of three in the next
+// row, read in order as the points are visited cell by cell. A point set too
+// spread out for that (say clusters in far-apart cities) is bucketed by hashed
+// cell instead, at the cost of a lookup per neighbouring cell.
+class SpatialGrid {
+public:
+    static constexpr size_t kCellsPerPoint = 4;
+    // Coarsest dense cell, in multiples of cell_meters, before hashing instead
+    static constexpr double kMaxCoarsening = 8.0;
+
+private:
+    double cell_meters_;
+    bool dense_;
+    double lat_scale_;  // cells per degree
+    double lon_scale_;
+    double min_lat_, min_lon_;
+    size_t row_width_;  // dense: cells per row, including a padding column either side
+    size_t mask_;       // hashed: buckets - 1
+    std::vector<uint64_t> cells_;    // cell (dense index or hashed key) of each point
+    std::vector<uint32_t> start_;    // cell or bucket c holds sorted entries [start_[c], start_[c + 1])
+    // Points grouped by cell or bucket, each group in point order
+    std::vector<uint64_t> sorted_cells_;
+    std::vector<uint32_t> sorted_points_;
+    std::vector<double> sorted_lat_, sorted_lon_;
+
+public:
+    explicit SpatialGrid(double cell_meters)
+        : cell_meters_(cell_meters > 0 ? cell_meters : 1.0), dense_(true), lat_scale_(0), lon_scale_(0),
+          min_lat_(0), min_lon_(0), row_width_(0), mask_(0) {}
+
+    size_t size() const { return cells_.size(); }
+    bool dense() const { return dense_; }
+
+    void rebuild(const double* lat, const double* lon, size_t n) {
+        double max_lat = -90.0, max_lon = -180.0;
+        min_lat_ = 90.0;
+        min_lon_ = 180.0;
+        for (size_t i = 0; i < n; i++) {
+            min_lat_ = std::min(min_lat_, lat[i]);
+            max_lat = std::max(max_lat, lat[i]);
+            min_lon_ = std::min(min_lon_, lon[i]);
+            max_lon = std::max(max_lon, lon[i]);
+        }
+        double max_abs_lat = std::min(std::max(std::fabs(min_lat_), std::fabs(max_lat)), 85.0);
+        lat_scale_ = spatial::kMetersPerDegree / cell_meters_;
+        lon_scale_ = lat_scale_ * std::cos(max_abs_lat * geo::kDegToRad);
+
+        double rows = n > 0 ? (max_lat - min_lat_) * lat_scale_ + 1.0 : 1.0;
+        double columns = n > 0 ? (max_lon - min_lon_) * lon_scale_ + 1.0 : 1.0;
+        double budget = static_cast<double>(std::max<size_t>(n, 16) * kCellsPerPoint);
+        double coarsening = std::max(1.0, std::sqrt(rows * columns / budget));
+        dense_ = coarsening <= kMaxCoarsening;
+
+        cells_.resize(n);
+        sorted_cells_.resize(n);
+        sorted_points_.resize(n);
+        sorted_lat_.resize(n);
+        sorted_lon_.resize(n);
+        size_t groups;
+        if (dense_) {
+            lat_scale_ /= coarsening;
+            lon_scale_ /= coarsening;
+            row_width_ = static_cast<size_t>(columns / coarsening) + 3;
+            // One padding row below, so every point's next row exists
+            groups = row_width_ * (static_cast<size_t>(rows / coarsening) + 2);
+            for (size_t i = 0; i < n; i++) {
+                cells_[i] = static_cast<size_t>((lat[i] - min_lat_) * lat_scale_) * row_width_ +
+                            static_cast<size_t>((lon[i] - min_lon_) * lon_scale_) + 1;
+            }
+        } else {
+            // About one point per bucket
+            groups = 1;
+            while (groups < n) groups <<= 1;
+            mask_ = groups - 1;
+            for (size_t i = 0; i < n; i++) cells_[i] = hashedCell(lat[i], lon[i]);
+        }
+
+        start_.assign(groups + 1, 0);
+        for (size_t i = 0; i < n; i++) start_[groupOf(cells_[i]) + 1]++;
+        for (size_t c = 0; c < groups; c++) start_[c + 1] += start_[c];
+        // Each start advances to the next group's as its points are placed...
+        for (size_t i = 0; i < n; i++) sorted_points_[start_[groupOf(cells_[i])]++] = static_cast<uint32_t>(i);
+        // ...so shift them back one group
+        for (size_t c = groups; c > 0; c--) start_[c] = start_[c - 1];
+        start_[0] = 0;
+        // Gathering reads overlap where scattered writes would stall
+        for (size_t e = 0; e < n; e++) {
+            uint32_t i = sorted_points_[e];
+            sorted_cells_[e] = cells_[i];
+            sorted_lat_[e] = lat[i];
+            sorted_lon_[e] = lon[i];
+        }
+    }
+
+    // Call f(i, j, distance squared in m^2) once for every pair of points at
+    // most meters apart, meters <= cell_meters. Each point meets its own cell's
+    // later points and every point of four forward neighbours, which with the
+    // other cells' forward neighbours cover all eight.
+    template <class F>
+    void forEachPairWithin(double meters, F&& f) const {
+        const double range_sq = meters * meters;
+        const size_t n = sorted_cells_.size();
+        auto scan = [&](size_t e, size_t from, size_t to, uint64_t cell, bool match) {
+            for (size_t k = from; k < to; k++) {
+                // Hashed buckets are shared; skip points of other cells
+                if (match && sorted_cells_[k] != cell) continue;
+                double d = spatial::distanceSquared(sorted_lat_[e], sorted_lon_[e], sorted_lat_[k], sorted_lon_[k]);
+                if (d <= range_sq) f(sorted_points_[e], sorted_points_[k], d);
+            }
+        };
+        if (dense_) {
+            for (size_t e = 0; e < n; e++) {
+                size_t c = sorted_cells_[e];
+                scan(e, e + 1, start_[c + 1], 0, false);
+                scan(e, start_[c + 1], start_[c + 2], 0, false);
+                scan(e, start_[c + row_width_ - 1], start_[c + row_width_ + 2], 0, false);
+            }
+            return;
+        }
+        static constexpr int32_t kAhead[4][2] = {{1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+        for (size_t e = 0; e < n; e++) {
+            uint64_t own = sorted_cells_[e];
+            // Later points of the same cell follow in the same bucket
+            scan(e, e + 1, start_[groupOf(own) + 1], own, true);
+            int32_t cx = static_cast<int32_t>(own >> 32);
+            int32_t cy = static_cast<int32_t>(static_cast<uint32_t>(own));
+            for (auto& step : kAhead) {
+                uint64_t key = spatial::cellKey(cx + step[0], cy + step[1]);
+                size_t b = groupOf(key);
+                scan(e, start_[b], start_[b + 1], key, true);
+            }
+        }
+    }
+
+private:
+    // Offsetting to positive coordinates lets truncation stand in for floor()
+    uint64_t hashedCell(double lat, double lon) const {
+        return spatial::cellKey(static_cast<int32_t>((lon + 180.0) * lon_scale_),
+                                static_cast<int32_t>((lat + 90.0) * lat_scale_));
+    }
+
+    size_t groupOf(uint64_t cell) const {
+        return dense_ ? static_cast<size_t>(cell) : static_cast<size_t>(spatial::mixKey(cell)) & mask_;
+    }
+};
+
+// A static zone: a circle when radius_m > 0, else the polygon through
+// vertices (lats[k], lons[k]), treated as planar in degrees
+struct Geofence {
+    std::string name;
+    double lat = 0, lon = 0, radius_m = 0;
+    std::vector<double> lats, lons;
+    double min_lat = 0, max_lat = 0, min_lon = 0, max_lon = 0;
+
+    bool contains(double p_lat, double p_lon) const {
+        if (p_lat < min_lat || p_lat > max_lat || p_lon < min_lon || p_lon > max_lon) return false;
+        if (radius_m > 0) return spatial::distanceSquared(lat, lon, p_lat, p_lon) <= radius_m * radius_m;
+        // Even-odd ray cast towards +lon
+        bool inside = false;
+        for (size_t k = 0, prev = lats.size() - 1; k < lats.size(); prev = k++) {
+            if ((lats[k] > p_lat) != (lats[prev] > p_lat) &&
+                p_lon < lons[k] + (p_lat - lats[k]) * (lons[prev] - lons[k]) / (lats[prev] - lats[k])) {
+                inside = !inside;
+            }
+        }
+        return inside;
+    }
+
+    void computeBounds() {
+        if (radius_m > 0) {
+            double dlat = radius_m / spatial::kMetersPerDegree;
+            double dlon = dlat / std::max(std::cos(std::min(std::fabs(lat) + dlat, 89.0) * geo::kDegToRad), 1e-6);
+            min_lat = lat - dlat;
+            max_lat = lat + dlat;
+            min_lon = lon - dlon;
+            max_lon = lon + dlon;
+            return;
+        }
+        min_lat = *std::min_element(lats.begin(), lats.end());
+        max_lat = *std::max_element(lats.begin(), lats.end());
+        min_lon = *std::min_element(lons.begin(), lons.end());
+        max_lon = *std::max_element(lons.begin(), lons.end());
+    }
+};
+
+namespace geofence_csv {
+
+// Parse "name,lat,lon,radius_m" (a circle) or "name,lat1,lon1,lat2,lon2,
+// lat3,lon3[,...]" (a polygon of three or more vertices) from [p, end).
+// Locale independent.
+inline bool parseFence(const char* p, const char* end, Geofence& fence) {
+    using route_csv::skipBlanks;
+    p = skipBlanks(p, end);
+    const char* comma = static_cast<const char*>(std::memchr(p, ',', static_cast<size_t>(end - p)));
+    if (!comma) return false;
+    const char* name_end = comma;
+    while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+    if (name_end == p) return false;
+    fence.name.assign(p, name_end);
+
+    std::vector<double> values;
+    p = comma;
+    while (p != end) {
+        if (*p != ',') return false;
+        p = skipBlanks(p + 1, end);
+        double value;
+        auto r = std::from_chars(p, end, value);
+        if (r.ec != std::errc()) return false;
+        values.push_back(value);
+        p = skipBlanks(r.ptr, end);
+    }
+
+    fence.lats.clear();
+    fence.lons.clear();
+    if (values.size() == 3) {
+        fence.lat = values[0];
+        fence.lon = values[1];
+        fence.radius_m = values[2];
+        if (!(fence.radius_m > 0)) return false;
+    } else if (values.size() >= 6 && values.size() % 2 == 0) {
+        fence.radius_m = 0;
+        for (size_t k = 0; k < values.size(); k += 2) {
+            fence.lats.push_back(values[k]);
+            fence.lons.push_back(values[k + 1]);
+        }
+    } else {
+        return false;
+    }
+    fence.computeBounds();
+    return true;
+}
+
+}  // namespace geofence_csv
+
+// Geofences loaded once at startup, indexed by a fixed grid of 1/400 degree
+// (about 250 m) cells: each cell lists the fences whose bounds overlap it, so
+// a point is tested only against fences near it. Fences too large to list
+// cell by cell are tested against every point, after a bounds check.
+class GeofenceSet {
+public:
+    static constexpr double kCellsPerDegree = 400.0;
+    static constexpr size_t kMaxCellsPerFence = 16384;
+
+private:
+    std::vector<Geofence> fences_;
+    std::vector<uint32_t> wide_;
+    // Cell index, grouped by hashed cell as in SpatialGrid
+    std::vector<uint64_t> entry_keys_;
+    std::vector<uint32_t> entry_fences_;
+    std::vector<uint32_t> bucket_start_;
+    size_t mask_ = 0;
+    // Bounds of all the fences
+    double min_lat_ = 0, max_lat_ = -1, min_lon_ = 0, max_lon_ = -1;
+
+public:
+    size_t size() const { return fences_.size(); }
+    bool empty() const { return fences_.empty(); }
+    const Geofence& operator[](size_t k) const { return fences_[k]; }
+
+    // One fence per line (see geofence_csv::parseFence). Blank lines and '#'
+    // comments are skipped; other unparseable lines are reported once.
+    bool load(const std::string& filename) {
+        MappedFile file;
+        if (!file.open(filename, MADV_SEQUENTIAL)) {
+            logger().error("Could not open geofence file: ", filename);
+            return false;
+        }
+        fences_.clear();
+        size_t line = 0, malformed = 0, first_malformed = 0;
+        for (const char* p = file.begin(); p < file.end();) {
+            const char* eol = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(file.end() - p)));
+            if (!eol) eol = file.end();
+            line++;
+            const char* first = route_csv::skipBlanks(p, eol);
+            Geofence fence;
+            if (first != eol && *first != '#') {
+                if (geofence_csv::parseFence(p, eol, fence)) {
+                    fences_.push_back(std::move(fence));
+                } else if (malformed++ == 0) {
+                    first_malformed = line;
+                }
+            }
+            p = eol + 1;
+        }
+        if (malformed > 0) {
+            logger().warn("Skipped ", malformed, " malformed line(s) in ", filename, " (first at line ",
+                          first_malformed, ")");
+        }
+        buildIndex();
+        logger().info("Loaded ", fences_.size(), " geofence(s) from ", filename);
+        return true;
+    }
+
+    // Call f(k) for every fence k containing the point, in increasing k
+    template <class F>
+    void forEachContaining(double lat, double lon, F&& f) const {
+        if (lat < min_lat_ || lat > max_lat_ || lon < min_lon_ || lon > max_lon_) return;
+        uint64_t key = cellOf(lat, lon);
+        size_t b = static_cast<size_t>(spatial::mixKey(key)) & mask_;
+        size_t w = 0;
+        for (uint32_t e = bucket_start_[b]; e < bucket_start_[b + 1]; e++) {
+            if (entry_keys_[e] != key) continue;
+            uint32_t k = entry_fences_[e];
+            for (; w < wide_.size() && wide_[w] < k; w++) {
+                if (fences_[wide_[w]].contains(lat, lon)) f(wide_[w]);
+            }
+            if (fences_[k].contains(lat, lon)) f(k);
+        }
+        for (; w < wide_.size(); w++) {
+            if (fences_[wide_[w]].contains(lat, lon)) f(wide_[w]);
+        }
+    }
+
+private:
+    static int32_t cellIndex(double degrees) { return static_cast<int32_t>(degrees * kCellsPerDegree); }
+
+    // Offsetting to positive coordinates lets truncation stand in for floor()
+    static uint64_t cellOf(double lat, double lon) {
+        return spatial::cellKey(cellIndex(lon + 180.0), cellIndex(lat + 90.0));
+    }
+
+    void buildIndex() {
+        std::vector<std::pair<uint64_t, uint32_t>> entries;
+        wide_.clear();
+        min_lat_ = min_lon_ = std::numeric_limits<double>::infinity();
+        max_lat_ = max_lon_ = -std::numeric_limits<double>::infinity();
+        for (uint32_t k = 0; k < fences_.size(); k++) {
+            const Geofence& fence = fences_[k];
+            min_lat_ = std::min(min_lat_, fence.min_lat);
+            max_lat_ = std::max(max_lat_, fence.max_lat);
+            min_lon_ = std::min(min_lon_, fence.min_lon);
+            max_lon_ = std::max(max_lon_, fence.max_lon);
+            int32_t x0 = cellIndex(fence.min_lon + 180.0), x1 = cellIndex(fence.max_lon + 180.0);
+            int32_t y0 = cellIndex(fence.min_lat + 90.0), y1 = cellIndex(fence.max_lat + 90.0);
+            if (static_cast<uint64_t>(x1 - x0 + 1) * static_cast<uint64_t>(y1 - y0 + 1) > kMaxCellsPerFence) {
+                wide_.push_back(k);
+                continue;
+            }
+            for (int32_t x = x0; x <= x1; x++) {
+                for (int32_t y = y0; y <= y1; y++) entries.emplace_back(spatial::cellKey(x, y), k);
+            }
+        }
+
+        // A few buckets per entry keeps most lookups to an empty bucket or one cell
+        size_t buckets = 1;
+        while (buckets < entries.size() * 4) buckets <<= 1;
+        mask_ = buckets - 1;
+        bucket_start_.assign(buckets + 1, 0);
+        for (auto& entry : entries) bucket_start_[(spatial::mixKey(entry.first) & mask_) + 1]++;
+        for (size_t b = 0; b < buckets; b++) bucket_start_[b + 1] += bucket_start_[b];
+        // Entries are in fence order, so each cell lists its fences in increasing k
+        entry_keys_.resize(entries.size());
+        entry_fences_.resize(entries.size());
+        for (auto& entry : entries) {
+            uint32_t e = bucket_start_[spatial::mixKey(entry.first) & mask_]++;
+            entry_keys_[e] = entry.first;
+            entry_fences_[e] = entry.second;
+        }
+        for (size_t b = buckets; b > 0; b--) bucket_start_[b] = bucket_start_[b - 1];
+        bucket_start_[0] = 0;
+    }
+};
+
+// Per-update proximity and geofence events over a set of moving points (the
+// fleet's vehicles by index). Each update rebuilds the grid, collects the
+// pairs within range and the (point, fence) memberships as sorted keys, and
+// reports the differences from the previous update, so the cost is linear in
+// the points plus the pairs found and never a scan of all pairs. The first
+// update only records the starting state.
+class SpatialEvents {
+private:
+    double proximity_m_;
+    std::shared_ptr<const GeofenceSet> geofences_;
+    SpatialGrid grid_;
+    std::vector<uint64_t> pairs_, previous_pairs_;          // i << 32 | j, i < j
+    std::vector<uint64_t> inside_, previous_inside_;        // point << 32 | fence
+    std::vector<uint32_t> points_;                          // index of each active point, when masked
+    std::vector<double> active_lat_, active_lon_;
+    bool primed_;
+
+public:
+    // proximity_m <= 0 disables proximity events; geofences may be null
+    SpatialEvents(double proximity_m, std::shared_ptr<const GeofenceSet> geofences)
+        : proximity_m_(proximity_m), geofences_(std::move(geofences)), grid_(proximity_m), primed_(false) {}
+
+    double proximityMeters() const { return proximity_m_; }
+    const GeofenceSet* geofences() const { return geofences_.get(); }
+
+    // on_proximity(i, j, meters) for each pair newly within range;
+    // on_geofence(i, fence, entered) for each point entering or leaving a fence.
+    // Points whose active entry is 0 (e.g. vehicles not yet placed) are left
+    // out, as if absent; a null active includes every point.
+    template <class OnProximity, class OnGeofence>
+    void update(const double* lat, const double* lon, size_t n, const uint8_t* active, OnProximity&& on_proximity,
+                OnGeofence&& on_geofence) {
+        previous_pairs_.swap(pairs_);
+        pairs_.clear();
+        if (proximity_m_ > 0) {
+            if (active) {
+                // Index only the active points, mapping them back for the pair keys
+                points_.clear();
+                active_lat_.clear();
+                active_lon_.clear();
+                for (size_t i = 0; i < n; i++) {
+                    if (!active[i]) continue;
+                    points_.push_back(static_cast<uint32_t>(i));
+                    active_lat_.push_back(lat[i]);
+                    active_lon_.push_back(lon[i]);
+                }
+                grid_.rebuild(active_lat_.data(), active_lon_.data(), points_.size());
+            } else {
+                grid_.rebuild(lat, lon, n);
+            }
+            grid_.forEachPairWithin(proximity_m_, [&](uint64_t i, uint64_t j, double) {
+                if (active) {
+                    i = points_[i];
+                    j = points_[j];
+                }
+                pairs_.push_back(i < j ? i << 32 | j : j << 32 | i);
+            });
+            std::sort(pairs_.begin(), pairs_.end());
+        }
+
+        previous_inside_.swap(inside_);
+        inside_.clear();
+        if (geofences_ && !geofences_->empty()) {
+            for (size_t i = 0; i < n; i++) {
+                if (active && !active[i]) continue;
+                geofences_->forEachContaining(lat[i], lon[i], [&](uint32_t k) { inside_.push_back(i << 32 | k); });
+            }
+        }
+
+        if (!primed_) {
+            primed_ = true;
+            return;
+        }
+        diff(previous_pairs_, pairs_, [&](uint64_t pair) {
+            size_t i = pair >> 32, j = pair & 0xffffffffu;
+            on_proximity(i, j, std::sqrt(spatial::distanceSquared(lat[i], lon[i], lat[j], lon[j])));
+        }, [](uint64_t) {});
+        diff(previous_inside_, inside_, [&](uint64_t key) { on_geofence(key >> 32, key & 0xffffffffu, true); },
+             [&](uint64_t key) { on_geofence(key >> 32, key & 0xffffffffu, false); });
+    }
+
+private:
+    // Walk two sorted key lists, reporting keys only in after (added) and only in before (removed)
+    template <class Added, class Removed>
+    static void diff(const std::vector<uint64_t>& before, const std::vector<uint64_t>& after, Added&& added,
+                     Removed&& removed) {
+        size_t a = 0, b = 0;
+        while (a < before.size() || b < after.size()) {
+            if (b == after.size() || (a < before.size() && before[a] < after[b])) {
+                removed(before[a++]);
+            } else if (a == before.size() || after[b] < before[a]) {
+                added(after[b++]);
+            } else {
+                a++;
+                b++;
+            }
+        }
+    }
+};
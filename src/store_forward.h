@@ -0,0 +1,399 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <mqtt/async_client.h>
+#include "logger.h"
+#include "metrics.h"
+#include "publish_window.h"
+
+namespace spill {
+
+// CRC-32 (IEEE, as in zlib), table driven; records are small and the table
+// is built once
+inline uint32_t crc32(const char* data, size_t size, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+}  // namespace spill
+
+struct StoreForwardOptions {
+    size_t memory_messages = 10000;          // in-memory ring before spilling to disk
+    std::string spill_file;                  // empty = memory only
+    uint64_t disk_budget = 256ull << 20;     // spill file size
+    double catch_up_rate = 1000.0;           // backlog messages per second once reconnected
+    std::chrono::milliseconds sync_interval{1000};  // at most one spill fsync per interval
+};
+
+// Append-only spill of unsent messages in a file mapped read-write, with the
+// disk budget allocated up front so appends never extend it, nor fault on a
+// full disk by writing into a page the file system has no block for. The read and write
+// offsets live in the file header, so a backlog left by a crash or restart is
+// resumed. When the reader catches up with the writer both rewind to the
+// start; a full file refuses appends until then.
+//
+// Layout: 64-byte header (magic "GVSPILL2", u64 read offset, u64 write offset),
+// then records { u32 payload size, u16 topic size, u8 qos, u8 0, u32 crc,
+// topic, payload }, the CRC-32 covering the record's first 8 bytes, topic and
+// payload so a record torn anywhere by a crash is caught on resume.
+class SpillFile {
+private:
+    static constexpr size_t kHeaderSize = 64;
+    static constexpr size_t kRecordHeader = 12;
+    static constexpr size_t kCrcOffset = 8;
+    static constexpr char kMagic[8] = {'G', 'V', 'S', 'P', 'I', 'L', 'L', '2'};
+
+    char* data_;
+    size_t size_;
+    uint64_t read_;
+    uint64_t write_;
+    uint64_t synced_;  // everything before this offset has been synced
+    size_t records_;
+
+public:
+    SpillFile() : data_(nullptr), size_(0), read_(kHeaderSize), write_(kHeaderSize), synced_(kHeaderSize),
+                  records_(0) {}
+
+    ~SpillFile() {
+        if (data_) {
+            sync();
+            munmap(data_, size_);
+        }
+    }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    bool open(const std::string& filename, uint64_t budget) {
+        int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size_ = std::max<size_t>(static_cast<size_t>(st.st_size), std::max<uint64_t>(budget, kHeaderSize + 4096));
+        // Allocates blocks, where ftruncate would only leave a sparse file
+        int err = posix_fallocate(fd, 0, static_cast<off_t>(size_));
+        if (err != 0) {
+            logger().error("Could not allocate ", size_, " bytes for ", filename, ": ", std::strerror(err));
+            ::close(fd);
+            return false;
+        }
+        void* addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) return false;
+        data_ = static_cast<char*>(addr);
+
+        // Resume a valid backlog, otherwise start empty
+        uint64_t offsets[2];
+        std::memcpy(offsets, data_ + 8, sizeof(offsets));
+        if (std::memcmp(data_, kMagic, 8) == 0 && offsets[0] >= kHeaderSize && offsets[0] <= offsets[1] &&
+            offsets[1] <= size_) {
+            read_ = offsets[0];
+            write_ = offsets[1];
+            // A crash can leave a torn record; the backlog ends before it
+            for (uint64_t pos = read_; pos < write_; pos += recordSize(pos)) {
+                if (pos + kRecordHeader > write_ || pos + recordSize(pos) > write_ || !checksumMatches(pos)) {
+                    logger().warn("Dropping ", write_ - pos, " bytes of corrupt records at the end of ", filename);
+                    write_ = pos;
+                    storeOffsets();
+                    break;
+                }
+                records_++;
+            }
+        } else {
+            std::memcpy(data_, kMagic, 8);
+            storeOffsets();
+        }
+        synced_ = write_;
+        return true;
+    }
+
+    bool empty() const { return records_ == 0; }
+    size_t records() const { return records_; }
+
+    bool append(const std::string& topic, const std::string& payload, int qos) {
+        uint64_t size = kRecordHeader + topic.size() + payload.size();
+        if (write_ + size > size_ || topic.size() > UINT16_MAX || payload.size() > UINT32_MAX) return false;
+        char* p = data_ + write_;
+        uint32_t payload_size = static_cast<uint32_t>(payload.size());
+        uint16_t topic_size = static_cast<uint16_t>(topic.size());
+        std::memcpy(p, &payload_size, 4);
+        std::memcpy(p + 4, &topic_size, 2);
+        p[6] = static_cast<char>(qos);
+        p[7] = 0;
+        std::memcpy(p + kRecordHeader, topic.data(), topic.size());
+        std::memcpy(p + kRecordHeader + topic.size(), payload.data(), payload.size());
+        uint32_t crc = checksum(write_);
+        std::memcpy(p + kCrcOffset, &crc, 4);
+        write_ += size;
+        records_++;
+        storeOffsets();
+        return true;
+    }
+
+    // Oldest record, without removing it
+    void front(std::string& topic, std::string& payload, int& qos) const {
+        const char* p = data_ + read_;
+        uint32_t payload_size;
+        uint16_t topic_size;
+        std::memcpy(&payload_size, p, 4);
+        std::memcpy(&topic_size, p + 4, 2);
+        qos = p[6];
+        topic.assign(p + kRecordHeader, topic_size);
+        payload.assign(p + kRecordHeader + topic_size, payload_size);
+    }
+
+    void pop() {
+        read_ += recordSize(read_);
+        records_--;
+        if (read_ == write_) {
+            read_ = write_ = synced_ = kHeaderSize;
+            // Only gives back the resident memory: on a shared file mapping dirty
+            // pages stay in the page cache and are still written back. Punching
+            // them out would skip that, but would also give up the blocks the
+            // budget reserved, and an append into a hole on a full disk faults.
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            madvise(data_ + page, size_ - page, MADV_DONTNEED);
+        }
+        storeOffsets();
+    }
+
+    // Flush appended records and the header to disk
+    void sync() {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        if (write_ > synced_) {
+            uint64_t from = synced_ / page * page;
+            msync(data_ + from, write_ - from, MS_SYNC);
+        }
+        msync(data_, page, MS_SYNC);
+        synced_ = write_;
+    }
+
+private:
+    uint64_t recordSize(uint64_t pos) const {
+        uint32_t payload_size;
+        uint16_t topic_size;
+        std::memcpy(&payload_size, data_ + pos, 4);
+        std::memcpy(&topic_size, data_ + pos + 4, 2);
+        return kRecordHeader + topic_size + payload_size;
+    }
+
+    // CRC of the record at pos, everything but the CRC field itself
+    uint32_t checksum(uint64_t pos) const {
+        uint32_t crc = spill::crc32(data_ + pos, kCrcOffset);
+        return spill::crc32(data_ + pos + kRecordHeader, recordSize(pos) - kRecordHeader, crc);
+    }
+
+    bool checksumMatches(uint64_t pos) const {
+        uint32_t stored;
+        std::memcpy(&stored, data_ + pos + kCrcOffset, 4);
+        return stored == checksum(pos);
+    }
+
+    void storeOffsets() {
+        uint64_t offsets[2] = {read_, write_};
+        std::memcpy(data_ + 8, offsets, sizeof(offsets));
+    }
+};
+
+// Keeps messages that could not be published while a connection was down and
+// forwards them after it comes back. New messages fill a bounded in-memory
+// ring; when it is full the oldest move to the spill file, so the file always
+// holds older messages than the ring and forwarding stays in order. Once
+// connected, the backlog is forwarded oldest first at catch_up_rate, and only
+// while the in-flight window is under half full, leaving room for live traffic.
+// One instance per connection.
+class StoreForward {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Entry {
+        std::string topic;
+        std::string payload;
+        int qos;
+    };
+
+    StoreForwardOptions options_;
+    std::mutex mutex_;
+    std::vector<Entry> ring_;  // strings keep their capacity, so refills do not allocate
+    size_t ring_head_;
+    size_t ring_count_;
+    std::unique_ptr<SpillFile> spill_;
+    std::atomic<size_t> backlog_;
+    double tokens_;
+    Clock::time_point refilled_;
+    Clock::time_point synced_;
+    bool dirty_;
+    std::atomic<uint64_t> stored_;
+    std::atomic<uint64_t> forwarded_;
+    std::atomic<uint64_t> dropped_;
+    // Scratch for records read back from the spill file
+    Entry spilled_;
+
+public:
+    explicit StoreForward(StoreForwardOptions options)
+        : options_(std::move(options)), ring_(std::max<size_t>(options_.memory_messages, 1)),
+          ring_head_(0), ring_count_(0), backlog_(0), tokens_(0.0), refilled_(Clock::now()),
+          synced_(Clock::now()), dirty_(false), stored_(0), forwarded_(0), dropped_(0) {}
+
+    StoreForward(const StoreForward&) = delete;
+    StoreForward& operator=(const StoreForward&) = delete;
+
+    ~StoreForward() {
+        // Whatever is still in memory goes to disk so a restart can resume it
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (spill_ && ring_count_ > 0) spillOldest();
+    }
+
+    // Open (or resume) the spill file, if one is configured
+    bool open() {
+        if (options_.spill_file.empty()) return true;
+        spill_ = std::make_unique<SpillFile>();
+        if (!spill_->open(options_.spill_file, options_.disk_budget)) {
+            logger().error("Could not open spill file: ", options_.spill_file);
+            spill_.reset();
+            return false;
+        }
+        if (!spill_->empty()) {
+            logger().info("Resuming ", spill_->records(), " unsent message(s) from ", options_.spill_file);
+        }
+        backlog_ = spill_->records();
+        return true;
+    }
+
+    size_t backlog() const { return backlog_; }
+    uint64_t stored() const { return stored_; }
+    uint64_t forwarded() const { return forwarded_; }
+    // Messages lost because both the ring and the spill file were full
+    uint64_t dropped() const { return dropped_; }
+
+    // Publish message, or keep it if the client is offline or rejects it.
+    // Forwards some backlog afterwards when connected.
+    void send(mqtt::async_client& client, PublishWindow& window, const mqtt::const_message_ptr& message) {
+        if (!client.is_connected()) {
+            store(*message);
+            return;
+        }
+        window.acquire();
+        try {
+            client.publish(message, PublishWindow::startContext(), window);
+        } catch (const mqtt::exception&) {
+            window.cancel();
+            store(*message);
+            return;
+        }
+        if (backlog_.load(std::memory_order_relaxed) > 0) forward(client, window);
+    }
+
+    void store(const mqtt::message& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ring_count_ == ring_.size()) {
+            if (spill_) {
+                spillOldest();
+            } else {
+                // Memory only: the oldest message gives way
+                ring_head_ = (ring_head_ + 1) % ring_.size();
+                ring_count_--;
+                backlog_--;
+                lost();
+            }
+        }
+        Entry& entry = ring_[(ring_head_ + ring_count_) % ring_.size()];
+        entry.topic = message.get_topic();
+        entry.payload = message.get_payload();
+        entry.qos = message.get_qos();
+        ring_count_++;
+        backlog_++;
+        stored_++;
+        metrics::registry().spool_stored.add();
+        maybeSync(Clock::now());
+    }
+
+    // Publish backlog within the catch-up rate while the window has headroom
+    void forward(mqtt::async_client& client, PublishWindow& window) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = Clock::now();
+        tokens_ = std::min(options_.catch_up_rate,
+                           tokens_ + options_.catch_up_rate * std::chrono::duration<double>(now - refilled_).count());
+        refilled_ = now;
+
+        while (tokens_ >= 1.0 && backlog_ > 0 && window.tryAcquire(window.maxInFlight() / 2)) {
+            bool from_spill = spill_ && !spill_->empty();
+            if (from_spill) spill_->front(spilled_.topic, spilled_.payload, spilled_.qos);
+            const Entry& entry = from_spill ? spilled_ : ring_[ring_head_];
+            try {
+                client.publish(mqtt::make_message(entry.topic, entry.payload, entry.qos, false),
+                               PublishWindow::startContext(), window);
+            } catch (const mqtt::exception&) {
+                window.cancel();
+                break;
+            }
+            if (from_spill) {
+                spill_->pop();
+                dirty_ = true;
+            } else {
+                ring_head_ = (ring_head_ + 1) % ring_.size();
+                ring_count_--;
+            }
+            backlog_--;
+            forwarded_++;
+            metrics::registry().spool_forwarded.add();
+            tokens_ -= 1.0;
+        }
+        maybeSync(now);
+    }
+
+private:
+    void spillOldest() {
+        Entry& oldest = ring_[ring_head_];
+        if (spill_->append(oldest.topic, oldest.payload, oldest.qos)) {
+            dirty_ = true;
+            metrics::registry().spool_spilled.add();
+        } else {
+            backlog_--;
+            lost();
+        }
+        ring_head_ = (ring_head_ + 1) % ring_.size();
+        ring_count_--;
+    }
+
+    void lost() {
+        dropped_++;
+        metrics::registry().spool_dropped.add();
+        static LogRateLimit limit(1, std::chrono::seconds(5));
+        logger().limited(limit, LogLevel::Warn, "Store-and-forward buffer full, dropping oldest unsent messages");
+    }
+
+    void maybeSync(Clock::time_point now) {
+        if (!dirty_ || now - synced_ < options_.sync_interval) return;
+        spill_->sync();
+        synced_ = now;
+        dirty_ = false;
+    }
+};
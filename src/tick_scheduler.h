@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include "histogram.h"
+
+// What to do with ticks whose deadline passed while the previous tick was still running
+enum class CatchUpPolicy {
+    Skip,   // drop the missed ticks and realign to the next future deadline
+    Burst,  // run the missed ticks back to back until caught up
+};
+
+inline bool parseCatchUpPolicy(const std::string& name, CatchUpPolicy& policy) {
+    if (name == "skip") {
+        policy = CatchUpPolicy::Skip;
+    } else if (name == "burst") {
+        policy = CatchUpPolicy::Burst;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Fixed-rate scheduler driven by absolute steady_clock deadlines, so the time
+// spent inside a tick does not push back the ones after it.
+class TickScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Tick {
+        uint64_t index;                 // sequence number of this tick since start
+        Clock::time_point deadline;     // when this tick was due
+        Clock::duration lateness;       // how long after the deadline it started
+        uint64_t skipped;               // ticks dropped before this one (Skip policy)
+    };
+
+private:
+    Clock::duration period_;
+    CatchUpPolicy policy_;
+    Clock::time_point deadline_;
+    uint64_t index_;
+    uint64_t overruns_;
+    uint64_t skipped_;
+    LatencyHistogram lateness_;
+
+public:
+    TickScheduler(Clock::duration period, CatchUpPolicy policy, Clock::time_point start = Clock::now())
+        : period_(period > Clock::duration::zero() ? period : Clock::duration(1)),
+          policy_(policy), deadline_(start), index_(0), overruns_(0), skipped_(0) {}
+
+    // Deadline of the next tick
+    Clock::time_point deadline() const { return deadline_; }
+
+    void wait() const { std::this_thread::sleep_until(deadline_); }
+
+    // Start the due tick and advance to the next deadline. Call once awake.
+    Tick begin(Clock::time_point now = Clock::now()) {
+        Tick tick{index_, deadline_, Clock::duration::zero(), 0};
+        if (now > deadline_) {
+            tick.lateness = now - deadline_;
+        }
+        lateness_.record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(tick.lateness).count()));
+
+        uint64_t behind = static_cast<uint64_t>(tick.lateness / period_);
+        if (behind > 0) {
+            overruns_++;
+        }
+        if (policy_ == CatchUpPolicy::Skip && behind > 0) {
+            tick.skipped = behind;
+            skipped_ += behind;
+            index_ += behind;
+            deadline_ += period_ * static_cast<Clock::rep>(behind);
+            tick.index = index_;
+        }
+
+        index_++;
+        deadline_ += period_;
+        return tick;
+    }
+
+    Clock::duration period() const { return period_; }
+    uint64_t overruns() const { return overruns_; }
+    uint64_t skipped() const { return skipped_; }
+    const LatencyHistogram& lateness() const { return lateness_; }
+    void resetLateness() { lateness_.reset(); }
+};
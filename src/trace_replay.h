@@ -0,0 +1,400 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <mqtt/async_client.h>
+#include "geovan.pb.h"
+#include "compression.h"
+#include "connection_manager.h"
+#include "geo.h"
+#include "hash_ring.h"
+#include "logger.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "payload_pool.h"
+#include "position_batcher.h"
+#include "publish_path.h"
+#include "publish_window.h"
+#include "route.h"
+
+// One row of a recorded trace. vehicle points into the reader's mapping and is
+// valid until the next call to TraceReader::next().
+struct TraceRecord {
+    int64_t timestamp;  // Unix time in ms
+    std::string_view vehicle;
+    double lat;
+    double lon;
+    double speed;       // m/s, NaN if the row has none
+    double heading;     // degrees, NaN if the row has none
+};
+
+namespace trace_csv {
+
+// Parse "timestamp_ms,vehicle_id,lat,lon[,speed[,heading]][,ignored...]" from
+// [p, end). Locale independent.
+inline bool parseRecord(const char* p, const char* end, TraceRecord& record) {
+    using route_csv::skipBlanks;
+    p = skipBlanks(p, end);
+    auto r = std::from_chars(p, end, record.timestamp);
+    if (r.ec != std::errc()) return false;
+    p = skipBlanks(r.ptr, end);
+    if (p == end || *p != ',') return false;
+
+    p = skipBlanks(p + 1, end);
+    const char* comma = static_cast<const char*>(std::memchr(p, ',', static_cast<size_t>(end - p)));
+    if (!comma) return false;
+    const char* id_end = comma;
+    while (id_end > p && (id_end[-1] == ' ' || id_end[-1] == '\t')) id_end--;
+    if (id_end == p) return false;
+    record.vehicle = std::string_view(p, static_cast<size_t>(id_end - p));
+
+    // lat and lon are required; an empty or non-numeric speed or heading
+    // leaves it (and anything after it) unset
+    record.speed = record.heading = std::numeric_limits<double>::quiet_NaN();
+    double* fields[] = {&record.lat, &record.lon, &record.speed, &record.heading};
+    p = comma;
+    for (size_t i = 0; i < 4; i++) {
+        bool required = i < 2;
+        if (p == end || *p != ',') return !required;
+        p = skipBlanks(p + 1, end);
+        r = std::from_chars(p, end, *fields[i]);
+        if (r.ec != std::errc()) return !required;
+        p = skipBlanks(r.ptr, end);
+    }
+    return p == end || *p == ',';
+}
+
+}  // namespace trace_csv
+
+// Streams a timestamped trace CSV (many vehicles interleaved, sorted by time)
+// one record at a time from a sequential mapping. Parsed pages are released
+// as it goes, so a trace much larger than memory can be replayed. A header
+// line, blank lines and '#' comments are skipped; other unparseable lines are
+// counted and reported once. A record older than the one before it ends the
+// stream with unsorted() set, since replaying it would distort the timing.
+class TraceReader {
+private:
+    // Parsed bytes kept resident before they are released
+    static constexpr size_t kReleaseChunk = 64u << 20;
+
+    MappedFile file_;
+    std::string filename_;
+    const char* pos_;
+    const char* released_;
+    size_t line_;
+    size_t records_;
+    size_t malformed_;
+    size_t first_malformed_;
+    int64_t last_timestamp_;
+    bool unsorted_;
+    bool reported_;
+
+public:
+    TraceReader() : pos_(nullptr), released_(nullptr), line_(0), records_(0), malformed_(0),
+                    first_malformed_(0), last_timestamp_(std::numeric_limits<int64_t>::min()),
+                    unsorted_(false), reported_(false) {}
+
+    bool open(const std::string& filename) {
+        filename_ = filename;
+        if (!file_.open(filename, MADV_SEQUENTIAL)) {
+            logger().error("Could not open trace file: ", filename);
+            return false;
+        }
+        pos_ = released_ = file_.begin();
+        return true;
+    }
+
+    // The next record in the file; false at the end or at the first record out of time order
+    bool next(TraceRecord& record) {
+        const char* end = file_.end();
+        while (pos_ && pos_ < end) {
+            const char* line = pos_;
+            const char* eol = static_cast<const char*>(std::memchr(line, '\n', static_cast<size_t>(end - line)));
+            if (!eol) eol = end;
+            pos_ = eol < end ? eol + 1 : end;
+            line_++;
+            if (static_cast<size_t>(line - released_) >= kReleaseChunk) {
+                file_.release(line);
+                released_ = line;
+            }
+
+            const char* first = route_csv::skipBlanks(line, eol);
+            if (first == eol || *first == '#') continue;
+            if (!trace_csv::parseRecord(line, eol, record)) {
+                // Tolerate a column header
+                if (line_ == 1) continue;
+                if (malformed_++ == 0) first_malformed_ = line_;
+                continue;
+            }
+            if (record.timestamp < last_timestamp_) {
+                logger().error("Trace ", filename_, " is not sorted by time: line ", line_, " (", record.timestamp,
+                               ") is older than the record before it (", last_timestamp_, ")");
+                unsorted_ = true;
+                pos_ = end;
+                return false;
+            }
+            last_timestamp_ = record.timestamp;
+            records_++;
+            return true;
+        }
+        reportMalformed();
+        return false;
+    }
+
+    bool unsorted() const { return unsorted_; }
+    size_t records() const { return records_; }
+    size_t malformed() const { return malformed_; }
+
+private:
+    void reportMalformed() {
+        if (malformed_ == 0 || reported_) return;
+        reported_ = true;
+        logger().warn("Skipped ", malformed_, " malformed line(s) in ", filename_,
+                      " (first at line ", first_malformed_, ")");
+    }
+};
+
+// Publishes a recorded trace as VehiclePosition messages, keeping the
+// recording's inter-arrival times scaled by a speedup factor, or as fast as
+// the connections allow. Vehicles are placed on connections by consistent
+// hashing of their ID, like Fleet, and each keeps its own sequence number;
+// speed and heading missing from the trace are derived from the vehicle's
+// previous record. Messages carry the recorded timestamps.
+class TraceReplay {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Shard {
+        std::shared_ptr<mqtt::async_client> client;
+        std::shared_ptr<PublishWindow> window;
+        std::vector<std::shared_ptr<PayloadPool>> pools;  // one per topic shard
+        std::shared_ptr<PositionBatcher> batcher;
+    };
+
+    struct Vehicle {
+        uint32_t shard;
+        uint32_t topic;
+        uint32_t seq;
+        bool seen;
+        double lat;
+        double lon;
+        int64_t timestamp;
+    };
+
+    std::vector<Shard> shards_;
+    std::vector<std::shared_ptr<PositionBatcher>> batchers_;
+    std::vector<std::string> connection_ids_;
+    HashRing ring_;
+    uint32_t topic_shards_;
+    int qos_;
+    std::unordered_map<std::string, Vehicle> vehicles_;
+    std::string key_;  // reused lookup key
+    geovan::VehiclePosition pos_;
+    std::unique_ptr<ConnectionManager> connections_;
+    uint64_t replayed_;
+
+    static std::vector<std::string> connectionIds(const std::string& base_id, size_t count) {
+        std::vector<std::string> ids;
+        for (size_t c = 0; c < std::max<size_t>(count, 1); c++) {
+            ids.push_back(base_id + "-conn-" + std::to_string(c));
+        }
+        return ids;
+    }
+
+public:
+    TraceReplay(const std::string& base_id, const std::vector<std::string>& broker_urls, const std::string& topic,
+                size_t connection_count, int qos, size_t max_in_flight, uint32_t topic_shards = 1)
+        : connection_ids_(connectionIds(base_id, std::max(connection_count, broker_urls.size()))),
+          ring_(connection_ids_), topic_shards_(std::max<uint32_t>(topic_shards, 1)), qos_(qos), replayed_(0) {
+        shards_.resize(connection_ids_.size());
+        for (size_t c = 0; c < shards_.size(); c++) {
+            Shard& shard = shards_[c];
+            shard.client = std::make_shared<mqtt::async_client>(broker_urls[c % broker_urls.size()],
+                                                                connection_ids_[c]);
+            shard.window = std::make_shared<PublishWindow>(max_in_flight);
+            for (uint32_t k = 0; k < topic_shards_; k++) {
+                shard.pools.push_back(std::make_shared<PayloadPool>(
+                    topic_shards_ > 1 ? topic + "/" + std::to_string(k) : topic, qos,
+                    PublishPath::kPayloadCapacity, max_in_flight + 1));
+            }
+        }
+    }
+
+    size_t connectionCount() const { return shards_.size(); }
+    size_t vehicleCount() const { return vehicles_.size(); }
+    uint64_t replayed() const { return replayed_; }
+    const std::vector<std::shared_ptr<PositionBatcher>>& batchers() const { return batchers_; }
+
+    uint64_t publishFailures() const {
+        uint64_t total = 0;
+        for (auto& shard : shards_) total += shard.window->failed();
+        return total;
+    }
+
+    // Batch positions into one frame stream per connection
+    void enableBatching(const std::string& batch_topic, size_t max_count, size_t max_bytes,
+                        std::chrono::milliseconds flush_window) {
+        batchers_.clear();
+        for (auto& shard : shards_) {
+            shard.batcher = std::make_shared<PositionBatcher>(
+                shard.client, shard.window, batch_topic, qos_, max_count, max_bytes, flush_window);
+            batchers_.push_back(shard.batcher);
+        }
+    }
+
+    // Compress batched frames; call after enableBatching
+    bool enableCompression(Compression compression, int level, size_t threshold, const std::string& dictionary) {
+        for (auto& shard : shards_) {
+            if (!shard.batcher) return false;
+            auto compressor = std::make_unique<FrameCompressor>(compression, level, threshold);
+            if (!dictionary.empty() && !compressor->loadDictionary(dictionary)) return false;
+            shard.batcher->setCompressor(std::move(compressor));
+        }
+        return true;
+    }
+
+    // As Fleet::connect: false only if no connection came up within timeout
+    bool connect(BackoffPolicy backoff, std::chrono::milliseconds timeout) {
+        logger().info("Opening ", shards_.size(), " MQTT connection(s)");
+        connections_ = std::make_unique<ConnectionManager>(qos_, shards_.front().window->maxInFlight(), backoff);
+        for (auto& shard : shards_) {
+            connections_->add(shard.client);
+        }
+        connections_->start();
+        size_t connected = connections_->waitConnected(timeout);
+        if (connected < shards_.size()) {
+            logger().warn(connected, " of ", shards_.size(), " connection(s) up, retrying the rest in the background");
+        }
+        return connected > 0;
+    }
+
+    void disconnect() {
+        for (auto& batcher : batchers_) {
+            batcher->flush();
+        }
+        if (connections_) connections_->stop();
+        for (auto& shard : shards_) {
+            if (!shard.client->is_connected()) continue;
+            try {
+                if (!shard.window->drain(std::chrono::seconds(5))) {
+                    logger().warn("Timed out waiting for ", shard.window->inFlight(), " in-flight messages");
+                }
+                shard.client->disconnect()->wait();
+            }
+            catch (const mqtt::exception& exc) {
+                logger().error("Error disconnecting: ", exc.what());
+            }
+        }
+    }
+
+    // Publish every record of reader. A record is due (t - t0) / speedup
+    // after the start, t0 being the first record's timestamp; speedup <= 0
+    // publishes as fast as possible. Lateness against the due time is recorded
+    // once per distinct timestamp. Returns false if the trace was not sorted.
+    bool run(TraceReader& reader, double speedup) {
+        TraceRecord record;
+        const auto start = Clock::now();
+        bool started = false;
+        int64_t first = 0;
+        int64_t paced = 0;
+        uint64_t count = 0;
+        while (reader.next(record)) {
+            if (!started) {
+                first = paced = record.timestamp;
+                started = true;
+            }
+            if (speedup > 0 && record.timestamp != paced) {
+                paced = record.timestamp;
+                auto due = start + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double, std::milli>(static_cast<double>(record.timestamp - first) / speedup));
+                if (due > Clock::now()) sleepUntilServicingBatches(due, batchers_);
+                metrics::registry().tick_lateness.record(Clock::now() - due);
+            } else if ((++count & 1023) == 0) {
+                // Flat out there is no idle time to flush expired frames in
+                auto now = PositionBatcher::Clock::now();
+                for (auto& batcher : batchers_) batcher->poll(now);
+            }
+            publish(record);
+        }
+        for (auto& batcher : batchers_) {
+            batcher->flush();
+        }
+        return !reader.unsorted();
+    }
+
+private:
+    Vehicle& vehicle(std::string_view id) {
+        key_.assign(id.data(), id.size());
+        auto it = vehicles_.find(key_);
+        if (it != vehicles_.end()) return it->second;
+        Vehicle v{};
+        v.shard = static_cast<uint32_t>(ring_.nodeFor(key_));
+        v.topic = topic_shards_ > 1 ? sharding::jumpHash(sharding::hashKey(key_), topic_shards_) : 0;
+        return vehicles_.emplace(key_, v).first->second;
+    }
+
+    void publish(const TraceRecord& record) {
+        Vehicle& v = vehicle(record.vehicle);
+        double speed = record.speed;
+        double heading = record.heading;
+        if (std::isnan(speed) || std::isnan(heading)) {
+            double derived_speed = 0.0;
+            double derived_heading = 0.0;
+            if (v.seen && record.timestamp > v.timestamp) {
+                derived_speed = geo::distanceMeters(v.lat, v.lon, record.lat, record.lon) /
+                                (static_cast<double>(record.timestamp - v.timestamp) / 1000.0);
+                derived_heading = geo::initialBearing(v.lat, v.lon, record.lat, record.lon);
+            }
+            if (std::isnan(speed)) speed = derived_speed;
+            if (std::isnan(heading)) heading = derived_heading;
+        }
+        v.seen = true;
+        v.lat = record.lat;
+        v.lon = record.lon;
+        v.timestamp = record.timestamp;
+
+        pos_.set_id(key_);
+        pos_.mutable_pos()->set_lat(record.lat);
+        pos_.mutable_pos()->set_lon(record.lon);
+        pos_.set_speed(speed);
+        pos_.set_heading(heading);
+        pos_.set_timestamp(record.timestamp);
+        pos_.set_seq(v.seq++);
+        replayed_++;
+
+        Shard& shard = shards_[v.shard];
+        if (shard.batcher) {
+            shard.batcher->add(pos_);
+            return;
+        }
+        PayloadPool::Slot slot;
+        if (!shard.pools[v.topic]->serialize(pos_, slot)) {
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Error, "Failed to serialize protobuf message");
+            return;
+        }
+        if (!shard.client->is_connected()) {
+            shard.window->reject();
+            return;
+        }
+        shard.window->acquire();
+        try {
+            shard.client->publish(std::move(slot.message), PublishWindow::startContext(), *shard.window);
+        } catch (const mqtt::exception& exc) {
+            shard.window->cancel();
+            static LogRateLimit limit(5, std::chrono::seconds(1));
+            logger().limited(limit, LogLevel::Error, "Error publishing message: ", exc.what());
+        }
+    }
+};
@@ -1,186 +1,129 @@
 #include <iostream>
+#include <algorithm>
 #include <chrono>
+#include <functional>
+#include <future>
 #include <thread>
-#include <fstream>
-#include <sstream>
 #include <vector>
 #include <string>
-#include <random>
-#include <mqtt/async_client.h>
-#include "geovan.pb.h"
-
-class VehicleAgent {
-private:
-    std::string client_id_;
-    std::string broker_url_;
-    std::string topic_;
-    mqtt::async_client* client_;
-    std::vector<std::pair<double, double>> route_;
-    size_t current_route_index_;
-    uint32_t sequence_;
-    std::random_device rd_;
-    std::mt19937 gen_;
-    std::uniform_real_distribution<> speed_dist_;
-    std::uniform_real_distribution<> heading_noise_;
-
-public:
-    VehicleAgent(const std::string& client_id, const std::string& broker_url, const std::string& topic)
-        : client_id_(client_id), broker_url_(broker_url), topic_(topic), 
-          current_route_index_(0), sequence_(0), gen_(rd_()),
-          speed_dist_(8.0, 15.0), heading_noise_(-5.0, 5.0) {
-        
-        // Initialize with a simple route (you can load from CSV later)
-        route_ = {
-            {28.7041, 77.1025},  // Delhi
-            {28.6139, 77.2090},  // Delhi
-            {28.7041, 77.1025},  // Back to start
-        };
-        
-        client_ = new mqtt::async_client(broker_url_, client_id_);
-    }
-
-    ~VehicleAgent() {
-        if (client_) {
-            delete client_;
-        }
-    }
-
-    bool connect() {
-        try {
-            mqtt::connect_options conn_opts;
-            conn_opts.set_keep_alive_interval(20);
-            conn_opts.set_clean_session(true);
-
-            std::cout << "Connecting to MQTT broker at " << broker_url_ << std::endl;
-            mqtt::token_ptr conntok = client_->connect(conn_opts);
-            conntok->wait();
-            std::cout << "Connected to MQTT broker" << std::endl;
-            return true;
-        }
-        catch (const mqtt::exception& exc) {
-            std::cerr << "Error connecting to MQTT broker: " << exc.what() << std::endl;
-            return false;
-        }
-    }
-
-    void disconnect() {
-        try {
-            client_->disconnect()->wait();
-            std::cout << "Disconnected from MQTT broker" << std::endl;
-        }
-        catch (const mqtt::exception& exc) {
-            std::cerr << "Error disconnecting: " << exc.what() << std::endl;
-        }
-    }
+#include <memory>
+#include "compact_codec.h"
+#include "compression.h"
+#include "connection_manager.h"
+#include "datagram_sender.h"
+#include "fleet.h"
+#include "hash_ring.h"
+#include "histogram.h"
+#include "kinematics.h"
+#include "logger.h"
+#include "message_auth.h"
+#include "metrics.h"
+#include "metrics_server.h"
+#include "outbound_queue.h"
+#include "position_batcher.h"
+#include "route.h"
+#include "spatial_index.h"
+#include "store_forward.h"
+#include "tick_scheduler.h"
+#include "trace_replay.h"
+#include "vehicle_agent.h"
 
-    void loadRouteFromCSV(const std::string& filename) {
-        std::ifstream file(filename);
-        if (!file.is_open()) {
-            std::cerr << "Could not open route file: " << filename << std::endl;
-            return;
-        }
+// Periodic log line with the messages delivered and failed since the last one
+static std::function<std::string()> deliverySummary(int period_s) {
+    return [period_s, delivered = uint64_t{0}, failed = uint64_t{0}]() mutable {
+        const metrics::Registry& m = metrics::registry();
+        // UDP sends have no acknowledgement; handing one to the kernel counts as delivered
+        uint64_t d = m.published.value() + m.datagrams_sent.value() - delivered;
+        uint64_t f = m.publish_errors.value() + m.datagram_drops.value() - failed;
+        delivered += d;
+        failed += f;
+        return "Delivered " + std::to_string(d) + " message(s) in the last " + std::to_string(period_s) +
+               "s (" + std::to_string(f) + " failed, " + std::to_string(m.in_flight.value()) + " in flight)";
+    };
+}
 
-        route_.clear();
-        std::string line;
-        while (std::getline(file, line)) {
-            std::stringstream ss(line);
-            std::string lat_str, lon_str;
-            if (std::getline(ss, lat_str, ',') && std::getline(ss, lon_str, ',')) {
-                try {
-                    double lat = std::stod(lat_str);
-                    double lon = std::stod(lon_str);
-                    route_.push_back({lat, lon});
-                } catch (const std::exception& e) {
-                    std::cerr << "Error parsing line: " << line << std::endl;
-                }
-            }
-        }
-        std::cout << "Loaded " << route_.size() << " route points" << std::endl;
-    }
+struct LoadedRoute {
+    std::shared_ptr<const Route> route;
+    std::chrono::steady_clock::duration took;
+};
 
-    void publishPosition() {
-        if (route_.empty()) {
-            std::cerr << "No route loaded" << std::endl;
-            return;
+// Load the route file (the built-in route without one) on its own thread,
+// parsing on every core, so it overlaps setting up the vehicles and
+// connecting them
+static std::future<LoadedRoute> loadRouteInBackground(const std::string& filename) {
+    return std::async(std::launch::async, [filename] {
+        auto started = std::chrono::steady_clock::now();
+        auto route = std::make_shared<Route>(defaultRoute());
+        if (!filename.empty()) {
+            loadRouteFile(filename, *route, std::max(1u, std::thread::hardware_concurrency()));
         }
+        return LoadedRoute{std::move(route), std::chrono::steady_clock::now() - started};
+    });
+}
 
-        try {
-            // Create position message
-            geovan::VehiclePosition pos;
-            pos.set_id(client_id_);
-            
-            // Get current position from route
-            auto& current_pos = route_[current_route_index_];
-            pos.mutable_pos()->set_lat(current_pos.first);
-            pos.mutable_pos()->set_lon(current_pos.second);
-            
-            // Add some realistic movement
-            double speed = speed_dist_(gen_);
-            pos.set_speed(speed);
-            
-            // Calculate heading to next point
-            double heading = calculateHeadingToNextPoint();
-            heading += heading_noise_(gen_);  // Add some noise
-            if (heading < 0) heading += 360.0;
-            if (heading >= 360) heading -= 360.0;
-            pos.set_heading(heading);
-            
-            // Set timestamp
-            auto now = std::chrono::system_clock::now();
-            auto timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
-                now.time_since_epoch()).count();
-            pos.set_timestamp(timestamp);
-            
-            // Set sequence number
-            pos.set_seq(sequence_++);
-
-            // Serialize to string
-            std::string payload;
-            if (!pos.SerializeToString(&payload)) {
-                std::cerr << "Failed to serialize protobuf message" << std::endl;
-                return;
-            }
-
-            // Publish to MQTT
-            mqtt::message_ptr pubmsg = mqtt::make_message(topic_, payload);
-            client_->publish(pubmsg)->wait();
-            
-            std::cout << "Published position: " << current_pos.first << ", " << current_pos.second 
-                      << " (speed: " << speed << " m/s, heading: " << heading << "°)" << std::endl;
-
-            // Move to next route point
-            current_route_index_ = (current_route_index_ + 1) % route_.size();
-
-        } catch (const mqtt::exception& exc) {
-            std::cerr << "Error publishing message: " << exc.what() << std::endl;
-        }
-    }
-
-private:
-    double calculateHeadingToNextPoint() {
-        if (route_.size() < 2) return 0.0;
-        
-        size_t next_index = (current_route_index_ + 1) % route_.size();
-        auto& current = route_[current_route_index_];
-        auto& next = route_[next_index];
-        
-        // Simple bearing calculation
-        double dlat = next.first - current.first;
-        double dlon = next.second - current.second;
-        
-        double bearing = atan2(dlon, dlat) * 180.0 / M_PI;
-        if (bearing < 0) bearing += 360.0;
-        
-        return bearing;
-    }
-};
+static long long millisSince(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+}
 
 int main(int argc, char* argv[]) {
+    auto started = std::chrono::steady_clock::now();
     std::string client_id = "vehicle-001";
     std::string broker_url = "tcp://localhost:1883";
     std::string topic = "geovan/positions";
     std::string route_file = "";
+    std::string udp_destination = "";  // empty = MQTT
+    size_t udp_batch = DatagramSender::kDefaultBatch;
+    double proximity_m = 0;          // 0 = no proximity events
+    std::string geofence_file = "";
+    std::string event_topic = "";
+    std::string replay_file = "";
+    double speedup = 1.0;            // 0 = as fast as possible
     int publish_interval_ms = 2000;  // 2 seconds
+    size_t fleet_size = 0;           // 0 = single vehicle
+    size_t connection_count = 1;
+    size_t thread_count = 1;
+    uint32_t topic_shards = 1;
+    int qos = 0;
+    size_t max_in_flight = 100;
+    bool batch = false;
+    std::string batch_topic = "";
+    size_t batch_count = 100;
+    size_t batch_bytes = 16384;
+    int batch_window_ms = 100;
+    CatchUpPolicy catch_up = CatchUpPolicy::Skip;
+    bool phase_jitter = false;
+    size_t outbound_queue = 0;       // 0 = publish inline
+    QueueFullPolicy queue_full = QueueFullPolicy::Block;
+    std::string compile_route_out = "";
+    bool fixed_point_route = false;
+    MotionModel motion = MotionModel::Interpolate;
+    double max_accel = VehicleAgent::kDefaultMaxAccel;
+    DeadReckoningPolicy reckoning;
+    bool seeded = false;
+    uint64_t seed = 0;
+    std::string snapshot_file = "";  // empty = no snapshots
+    int snapshot_every_s = 60;
+    std::string restore_file = "";
+    Authentication auth_mode = Authentication::None;
+    std::string auth_key_file = "";   // empty = ephemeral key
+    std::string hmac_key_hex = "";    // empty = random key
+    uint32_t checkpoint_every = auth::kDefaultCheckpointInterval;
+    std::string checkpoint_topic = "";
+    int metrics_port = 0;            // 0 = no metrics endpoint
+    bool store_forward = false;
+    StoreForwardOptions spool_options;
+    std::string spool_dir = "";
+    BackoffPolicy backoff;
+    int connect_timeout_s = 10;
+    Compression compression = Compression::None;
+    int compress_level = 1;
+    size_t compress_min = 512;
+    std::string compress_dict = "";
+    bool compact = false;
+    uint32_t vehicle_index = 0;
+    uint32_t keyframe_interval = compact::kDefaultKeyframeInterval;
+    LogLevel log_level = LogLevel::Info;
+    int log_summary_s = 5;           // 0 = no periodic summary
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -193,48 +136,680 @@ int main(int argc, char* argv[]) {
             topic = argv[++i];
         } else if (arg == "--route" && i + 1 < argc) {
             route_file = argv[++i];
+        } else if (arg == "--udp" && i + 1 < argc) {
+            udp_destination = argv[++i];
+        } else if (arg == "--udp-batch" && i + 1 < argc) {
+            udp_batch = std::stoul(argv[++i]);
+        } else if (arg == "--proximity" && i + 1 < argc) {
+            proximity_m = std::stod(argv[++i]);
+        } else if (arg == "--geofences" && i + 1 < argc) {
+            geofence_file = argv[++i];
+        } else if (arg == "--event-topic" && i + 1 < argc) {
+            event_topic = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (arg == "--speedup" && i + 1 < argc) {
+            std::string value = argv[++i];
+            speedup = value == "max" ? 0.0 : std::stod(value);
         } else if (arg == "--interval" && i + 1 < argc) {
             publish_interval_ms = std::stoi(argv[++i]);
+        } else if (arg == "--fleet" && i + 1 < argc) {
+            fleet_size = std::stoul(argv[++i]);
+        } else if (arg == "--connections" && i + 1 < argc) {
+            connection_count = std::stoul(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            thread_count = std::stoul(argv[++i]);
+        } else if (arg == "--topic-shards" && i + 1 < argc) {
+            topic_shards = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--qos" && i + 1 < argc) {
+            qos = std::stoi(argv[++i]);
+        } else if (arg == "--max-inflight" && i + 1 < argc) {
+            max_in_flight = std::stoul(argv[++i]);
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--batch-topic" && i + 1 < argc) {
+            batch_topic = argv[++i];
+        } else if (arg == "--batch-count" && i + 1 < argc) {
+            batch_count = std::stoul(argv[++i]);
+        } else if (arg == "--batch-bytes" && i + 1 < argc) {
+            batch_bytes = std::stoul(argv[++i]);
+        } else if (arg == "--batch-window" && i + 1 < argc) {
+            batch_window_ms = std::stoi(argv[++i]);
+        } else if (arg == "--catch-up" && i + 1 < argc) {
+            if (!parseCatchUpPolicy(argv[++i], catch_up)) {
+                std::cerr << "Unknown catch-up policy: " << argv[i] << " (expected skip or burst)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--phase-jitter") {
+            phase_jitter = true;
+        } else if (arg == "--outbound-queue" && i + 1 < argc) {
+            outbound_queue = std::stoul(argv[++i]);
+        } else if (arg == "--queue-full" && i + 1 < argc) {
+            if (!parseQueueFullPolicy(argv[++i], queue_full)) {
+                std::cerr << "Unknown queue-full policy: " << argv[i] << " (expected block or drop)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--compile-route" && i + 1 < argc) {
+            compile_route_out = argv[++i];
+        } else if (arg == "--fixed-point") {
+            fixed_point_route = true;
+        } else if (arg == "--motion" && i + 1 < argc) {
+            if (!parseMotionModel(argv[++i], motion)) {
+                std::cerr << "Unknown motion model: " << argv[i] << " (expected interpolate or points)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--max-accel" && i + 1 < argc) {
+            max_accel = std::stod(argv[++i]);
+        } else if (arg == "--dead-reckoning" && i + 1 < argc) {
+            reckoning.distance_m = std::stod(argv[++i]);
+        } else if (arg == "--dr-heading" && i + 1 < argc) {
+            reckoning.heading_deg = std::stod(argv[++i]);
+        } else if (arg == "--dr-heartbeat" && i + 1 < argc) {
+            reckoning.heartbeat = std::chrono::milliseconds(static_cast<int64_t>(std::stod(argv[++i]) * 1000));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+            seeded = true;
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_file = argv[++i];
+        } else if (arg == "--snapshot-every" && i + 1 < argc) {
+            snapshot_every_s = std::stoi(argv[++i]);
+        } else if (arg == "--restore" && i + 1 < argc) {
+            restore_file = argv[++i];
+        } else if (arg == "--auth" && i + 1 < argc) {
+            if (!parseAuthentication(argv[++i], auth_mode)) {
+                std::cerr << "Unknown authentication: " << argv[i] << " (expected none, ecdsa or hmac)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--auth-key" && i + 1 < argc) {
+            auth_key_file = argv[++i];
+        } else if (arg == "--hmac-key" && i + 1 < argc) {
+            hmac_key_hex = argv[++i];
+        } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+            checkpoint_every = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--checkpoint-topic" && i + 1 < argc) {
+            checkpoint_topic = argv[++i];
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            metrics_port = std::stoi(argv[++i]);
+        } else if (arg == "--store-forward") {
+            store_forward = true;
+        } else if (arg == "--spool-memory" && i + 1 < argc) {
+            spool_options.memory_messages = std::stoul(argv[++i]);
+        } else if (arg == "--spool-dir" && i + 1 < argc) {
+            spool_dir = argv[++i];
+        } else if (arg == "--spool-disk-mb" && i + 1 < argc) {
+            spool_options.disk_budget = std::stoull(argv[++i]) << 20;
+        } else if (arg == "--spool-rate" && i + 1 < argc) {
+            spool_options.catch_up_rate = std::stod(argv[++i]);
+        } else if (arg == "--spool-sync-ms" && i + 1 < argc) {
+            spool_options.sync_interval = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (arg == "--reconnect-min" && i + 1 < argc) {
+            backoff.initial = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (arg == "--reconnect-max" && i + 1 < argc) {
+            backoff.max = std::chrono::milliseconds(std::stoi(argv[++i]));
+        } else if (arg == "--connect-timeout" && i + 1 < argc) {
+            connect_timeout_s = std::stoi(argv[++i]);
+        } else if (arg == "--compress" && i + 1 < argc) {
+            if (!parseCompression(argv[++i], compression)) {
+                std::cerr << "Unknown compression: " << argv[i] << " (expected none, lz4 or zstd)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--compress-level" && i + 1 < argc) {
+            compress_level = std::stoi(argv[++i]);
+        } else if (arg == "--compress-min" && i + 1 < argc) {
+            compress_min = std::stoul(argv[++i]);
+        } else if (arg == "--zstd-dict" && i + 1 < argc) {
+            compress_dict = argv[++i];
+        } else if (arg == "--compact") {
+            compact = true;
+        } else if (arg == "--vehicle-index" && i + 1 < argc) {
+            vehicle_index = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--keyframe-interval" && i + 1 < argc) {
+            keyframe_interval = static_cast<uint32_t>(std::stoul(argv[++i]));
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            if (!parseLogLevel(argv[++i], log_level)) {
+                std::cerr << "Unknown log level: " << argv[i] << " (expected error, warn, info or debug)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--log-summary" && i + 1 < argc) {
+            log_summary_s = std::stoi(argv[++i]);
         } else if (arg == "--help") {
             std::cout << "Usage: " << argv[0] << " [options]\n"
                       << "Options:\n"
                       << "  --id <vehicle_id>        Vehicle identifier (default: vehicle-001)\n"
-                      << "  --broker <url>           MQTT broker URL (default: tcp://localhost:1883)\n"
+                      << "  --broker <url[,url...]>  MQTT broker URL, or a comma-separated broker cluster\n"
+                      << "                           (default: tcp://localhost:1883)\n"
                       << "  --topic <topic>          MQTT topic (default: geovan/positions)\n"
-                      << "  --route <file>           CSV file with lat,lon route points\n"
+                      << "  --route <file>           Route file: lat,lon CSV or compiled (--compile-route)\n"
+                      << "  --udp <host:port>        Send each position as a UDP datagram instead of publishing\n"
+                      << "                           over MQTT (no acks or retries; excludes --batch, --store-forward\n"
+                      << "                           and --outbound-queue)\n"
+                      << "  --udp-batch <n>          Datagrams written per sendmmsg call by a fleet shard (default: 64)\n"
+                      << "  --proximity <m>          Fleet: publish an event when two vehicles come within m meters\n"
+                      << "  --geofences <file>       Fleet: publish an event when a vehicle enters or leaves a zone;\n"
+                      << "                           one per line, name,lat,lon,radius_m or name,lat,lon,lat,lon,...\n"
+                      << "  --event-topic <topic>    Topic for proximity and geofence events (default: <topic>/events)\n"
+                      << "  --replay <file>          Publish a recorded trace instead of simulating: CSV rows of\n"
+                      << "                           timestamp_ms,vehicle_id,lat,lon[,speed,heading], sorted by time\n"
+                      << "  --speedup <x|max>        Replay at x times the recorded pace, or max for as fast as\n"
+                      << "                           possible (default: 1)\n"
                       << "  --interval <ms>          Publish interval in milliseconds (default: 2000)\n"
+                      << "  --fleet <n>              Simulate n vehicles (IDs <vehicle_id>-0..n-1) in one process\n"
+                      << "  --connections <n>        MQTT connections (fleet shards), at least --threads (default: 1)\n"
+                      << "  --threads <n>            Worker threads stepping fleet shards, one per core (default: 1)\n"
+                      << "  --topic-shards <n>       Publish on <topic>/<k>, k hashed from each vehicle ID (default: 1)\n"
+                      << "  --qos <0|1|2>            MQTT publish QoS (default: 0)\n"
+                      << "  --max-inflight <n>       Max unacknowledged publishes per connection (default: 100)\n"
+                      << "  --batch                  Publish positions in batched frames\n"
+                      << "  --batch-topic <topic>    Topic for batched frames (default: <topic>/batch)\n"
+                      << "  --batch-count <n>        Flush a frame after n positions (default: 100)\n"
+                      << "  --batch-bytes <n>        Flush a frame before it exceeds n bytes (default: 16384)\n"
+                      << "  --batch-window <ms>      Flush a frame at most ms after its first position (default: 100)\n"
+                      << "  --store-forward          Keep messages while the broker is unreachable and forward\n"
+                      << "                           them after reconnecting\n"
+                      << "  --spool-memory <n>       Messages kept in memory per connection (default: 10000)\n"
+                      << "  --spool-dir <dir>        Spill older kept messages to <dir>/<connection>.spill, resumed\n"
+                      << "                           on restart (default: memory only)\n"
+                      << "  --spool-disk-mb <mb>     Spill file size per connection (default: 256)\n"
+                      << "  --spool-rate <n/s>       Forward the backlog at up to n messages/s (default: 1000)\n"
+                      << "  --spool-sync-ms <ms>     Sync a spill file at most once per interval (default: 1000)\n"
+                      << "  --reconnect-min <ms>     Backoff ceiling for the first reconnect attempt (default: 500)\n"
+                      << "  --reconnect-max <ms>     Largest reconnect backoff, doubling up to it (default: 30000)\n"
+                      << "  --connect-timeout <s>    Wait up to this long for connections at startup, then carry\n"
+                      << "                           on while they retry in the background (default: 10)\n"
+                      << "  --compress <codec>       Compress batched frames: none, lz4 or zstd (default: none)\n"
+                      << "  --compress-level <n>     zstd level, or lz4 acceleration (default: 1)\n"
+                      << "  --compress-min <bytes>   Only compress frames with at least this much body (default: 512)\n"
+                      << "  --zstd-dict <file>       Trained zstd dictionary (zstd --train) for --compress zstd\n"
+                      << "  --catch-up <policy>      After an overrun: skip missed ticks or burst them (default: skip)\n"
+                      << "  --phase-jitter           Spread fleet publishes across the interval in 1ms slots\n"
+                      << "  --outbound-queue <n>     Queue up to n serialized messages per connection for a\n"
+                      << "                           dedicated publisher thread (default: 0, publish inline)\n"
+                      << "  --queue-full <policy>    When the outbound queue is full: block or drop (default: block)\n"
+                      << "  --motion <model>         interpolate along segments at the reported speed,\n"
+                      << "                           or step one route point per tick (points) (default: interpolate)\n"
+                      << "  --max-accel <m/s^2>      Acceleration limit for interpolated motion (default: 1.5)\n"
+                      << "  --dead-reckoning <m>     Publish only when the backend's prediction (last report's speed\n"
+                      << "                           and heading) is off by more than m meters (default: 0, always)\n"
+                      << "  --dr-heading <deg>       With --dead-reckoning, also publish on a heading change over deg\n"
+                      << "                           (default: 15)\n"
+                      << "  --dr-heartbeat <s>       With --dead-reckoning, publish at least every s seconds (default: 30)\n"
+                      << "  --seed <n>               Derive every vehicle's randomness from n and advance motion by\n"
+                      << "                           exactly one interval per tick, so runs repeat\n"
+                      << "  --snapshot <file>        Fleet: periodically save the fleet's state (positions, speeds,\n"
+                      << "                           random draws, sequence numbers) to file\n"
+                      << "  --snapshot-every <s>     Seconds between snapshots (default: 60)\n"
+                      << "  --restore <file>         Fleet: resume from a snapshot of a fleet with the same --fleet,\n"
+                      << "                           --connections and --route\n"
+                      << "  --auth <mode>            Authenticate payloads: none, ecdsa (sign each payload; a batch\n"
+                      << "                           is signed once) or hmac (MAC each payload, sign checkpoints)\n"
+                      << "                           (default: none)\n"
+                      << "  --auth-key <pem>         EC private key to sign with (default: a new P-256 key, printed)\n"
+                      << "  --hmac-key <hex>         HMAC key for --auth hmac (default: random)\n"
+                      << "  --checkpoint-every <n>   With --auth hmac, sign a checkpoint every n payloads per\n"
+                      << "                           connection (default: 1000)\n"
+                      << "  --checkpoint-topic <t>   Topic for checkpoints (default: <topic>/checkpoints)\n"
+                      << "  --compile-route <out>    Compile --route into a binary route file and exit\n"
+                      << "  --fixed-point            Store compiled coordinates as int32 1e-7 degrees\n"
+                      << "  --metrics-port <port>    Serve Prometheus metrics at http://<host>:<port>/metrics\n"
+                      << "  --compact                Publish compact delta-encoded records instead of protobufs\n"
+                      << "  --vehicle-index <n>      Numeric vehicle ID in compact records; a fleet numbers\n"
+                      << "                           its vehicles from n (default: 0)\n"
+                      << "  --keyframe-interval <n>  Compact records per vehicle between absolute keyframes (default: 30)\n"
+                      << "  --log-level <level>      error, warn, info or debug (each publish) (default: info)\n"
+                      << "  --log-summary <s>        Log publish totals every s seconds, 0 to disable (default: 5)\n"
                       << "  --help                   Show this help message\n";
             return 0;
         }
     }
 
+    if (!compile_route_out.empty()) {
+        if (route_file.empty()) {
+            std::cerr << "--compile-route needs an input --route file" << std::endl;
+            return 1;
+        }
+        Route route;
+        if (!loadRouteFile(route_file, route) || !compileRoute(route, compile_route_out, fixed_point_route)) {
+            return 1;
+        }
+        return 0;
+    }
+
+    // Vehicles are spread over the cluster by consistent hashing of their IDs
+    std::vector<std::string> broker_urls;
+    for (size_t begin = 0; begin <= broker_url.size();) {
+        size_t end = std::min(broker_url.find(',', begin), broker_url.size());
+        if (end > begin) broker_urls.push_back(broker_url.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    if (broker_urls.empty()) {
+        std::cerr << "--broker needs at least one URL" << std::endl;
+        return 1;
+    }
+
     std::cout << "GeoVAN Vehicle Agent\n"
               << "Client ID: " << client_id << "\n"
               << "Broker: " << broker_url << "\n"
-              << "Topic: " << topic << "\n"
+              << "Topic: " << topic << (topic_shards > 1 ? "/<0.." + std::to_string(topic_shards - 1) + ">" : "")
+              << "\n"
               << "Interval: " << publish_interval_ms << "ms\n";
 
-    VehicleAgent agent(client_id, broker_url, topic);
-    
-    if (!agent.connect()) {
-        std::cerr << "Failed to connect to MQTT broker. Exiting." << std::endl;
-        return 1;
+    logger().setLevel(log_level);
+
+    MetricsServer metrics_server;
+    if (metrics_port > 0) {
+        if (metrics_port > 65535 || !metrics_server.start(static_cast<uint16_t>(metrics_port))) {
+            std::cerr << "Failed to start metrics endpoint on port " << metrics_port << std::endl;
+            return 1;
+        }
+        std::cout << "Metrics: http://0.0.0.0:" << metrics_port << "/metrics\n";
     }
 
-    // Load route if specified
-    if (!route_file.empty()) {
-        agent.loadRouteFromCSV(route_file);
+    if (batch_topic.empty()) {
+        batch_topic = topic + "/batch";
+    }
+    if (batch) {
+        std::cout << "Batching: " << batch_topic << " (" << batch_count << " positions / "
+                  << batch_bytes << " bytes / " << batch_window_ms << "ms)\n";
+    }
+    if (reckoning.enabled()) {
+        if (!replay_file.empty()) {
+            std::cerr << "--dead-reckoning applies to simulated vehicles, not --replay" << std::endl;
+            return 1;
+        }
+        std::cout << "Dead reckoning: report when " << reckoning.distance_m << "m or " << reckoning.heading_deg
+                  << " degrees off, at least every " << reckoning.heartbeat.count() / 1000.0 << "s\n";
+    }
+    if (seeded || !snapshot_file.empty() || !restore_file.empty()) {
+        if (!replay_file.empty()) {
+            std::cerr << "--seed, --snapshot and --restore apply to simulated vehicles, not --replay" << std::endl;
+            return 1;
+        }
+        if (fleet_size == 0 && (!snapshot_file.empty() || !restore_file.empty())) {
+            std::cerr << "--snapshot and --restore need --fleet" << std::endl;
+            return 1;
+        }
+        if (seeded) {
+            std::cout << "Seed: " << seed << "\n";
+        }
+        if (!snapshot_file.empty()) {
+            snapshot_every_s = std::max(1, snapshot_every_s);
+            std::cout << "Snapshots: " << snapshot_file << " every " << snapshot_every_s << "s\n";
+        }
+    }
+    std::shared_ptr<SigningKey> signing_key;
+    std::string hmac_key;
+    if (auth_mode != Authentication::None) {
+        if (!replay_file.empty()) {
+            std::cerr << "--auth applies to simulated vehicles, not --replay" << std::endl;
+            return 1;
+        }
+        signing_key = std::make_shared<SigningKey>();
+        if (auth_key_file.empty()) {
+            if (!signing_key->generate()) return 1;
+            std::cout << "Signing with a new key; its public key:\n" << signing_key->publicKeyPem();
+        } else if (!signing_key->load(auth_key_file)) {
+            return 1;
+        }
+        if (checkpoint_topic.empty()) {
+            checkpoint_topic = topic + "/checkpoints";
+        }
+        if (auth_mode == Authentication::Hmac) {
+            if (hmac_key_hex.empty()) {
+                hmac_key = auth::randomKey(32);
+                logger().warn("No --hmac-key given; MACing with a random key no consumer knows");
+            } else if (!auth::parseHex(hmac_key_hex, hmac_key)) {
+                std::cerr << "--hmac-key expects an even number of hex digits" << std::endl;
+                return 1;
+            }
+            std::cout << "Authentication: HMAC-SHA256 per payload, signed checkpoint every " << checkpoint_every
+                      << " on " << checkpoint_topic << "\n";
+        } else {
+            std::cout << "Authentication: ECDSA per " << (batch ? "frame" : "payload") << "\n";
+        }
+    }
+    if (compression != Compression::None) {
+        if (!batch) {
+            std::cerr << "--compress applies to batched frames and needs --batch" << std::endl;
+            return 1;
+        }
+        if (!compressionAvailable(compression)) {
+            std::cerr << "This build has no " << (compression == Compression::Lz4 ? "LZ4" : "zstd")
+                      << " support" << std::endl;
+            return 1;
+        }
     }
 
-    std::cout << "Starting position publishing loop. Press Ctrl+C to stop." << std::endl;
+    if (!udp_destination.empty()) {
+        if (batch || store_forward || outbound_queue > 0 || !replay_file.empty()) {
+            std::cerr << "--udp sends every position on its own and excludes --batch, --store-forward, "
+                      << "--outbound-queue and --replay" << std::endl;
+            return 1;
+        }
+        std::cout << "Transport: UDP to " << udp_destination << " (" << udp_batch << " datagrams per write)\n";
+    }
+
+    bool spatial_events = proximity_m > 0 || !geofence_file.empty();
+    if (spatial_events) {
+        if (fleet_size == 0 || !replay_file.empty()) {
+            std::cerr << "--proximity and --geofences need --fleet" << std::endl;
+            return 1;
+        }
+        if (event_topic.empty()) {
+            event_topic = topic + "/events";
+        }
+    }
+
+    if (!replay_file.empty()) {
+        TraceReader reader;
+        if (!reader.open(replay_file)) {
+            return 1;
+        }
+        TraceReplay replay(client_id, broker_urls, topic, connection_count, qos, max_in_flight, topic_shards);
+        if (batch) {
+            replay.enableBatching(batch_topic, batch_count, batch_bytes, std::chrono::milliseconds(batch_window_ms));
+            if (compression != Compression::None &&
+                !replay.enableCompression(compression, compress_level, compress_min, compress_dict)) {
+                return 1;
+            }
+        }
+        if (!replay.connect(backoff, std::chrono::seconds(connect_timeout_s))) {
+            logger().warn("No MQTT connection yet, starting anyway and retrying in the background");
+        }
+
+        if (speedup > 0) {
+            logger().info("Replaying ", replay_file, " over ", replay.connectionCount(), " connection(s) at ",
+                          speedup, "x the recorded pace");
+        } else {
+            logger().info("Replaying ", replay_file, " over ", replay.connectionCount(),
+                          " connection(s) as fast as possible");
+        }
+        logger().summarize(std::chrono::seconds(log_summary_s), deliverySummary(log_summary_s));
+
+        auto start = TraceReplay::Clock::now();
+        bool sorted = replay.run(reader, speedup);
+        double seconds = std::chrono::duration<double>(TraceReplay::Clock::now() - start).count();
+        replay.disconnect();
+        logger().info("Replayed ", replay.replayed(), " position(s) of ", replay.vehicleCount(), " vehicle(s) in ",
+                      seconds, "s (", seconds > 0 ? static_cast<uint64_t>(replay.replayed() / seconds) : 0,
+                      "/s, failed: ", replay.publishFailures(), ")");
+        return sorted ? 0 : 1;
+    }
+
+    if (fleet_size > 0) {
+        std::future<LoadedRoute> loading = loadRouteInBackground(route_file);
+        auto setup_started = std::chrono::steady_clock::now();
+
+        // Vehicles are spread along the route once it has loaded
+        Fleet fleet(client_id, broker_urls, topic, std::make_shared<const Route>(), fleet_size, connection_count,
+                    qos, max_in_flight, thread_count, topic_shards);
+        fleet.setMotion(motion, max_accel);
+        fleet.setDeadReckoning(reckoning);
+        if (seeded) {
+            fleet.setSeed(seed);
+            fleet.setFixedStep(publish_interval_ms / 1000.0);
+        }
+        if (batch) {
+            fleet.enableBatching(batch_topic, qos, batch_count, batch_bytes,
+                                 std::chrono::milliseconds(batch_window_ms));
+        }
+        if (compression != Compression::None &&
+            !fleet.enableCompression(compression, compress_level, compress_min, compress_dict)) {
+            return 1;
+        }
+        if (compact) {
+            fleet.enableCompact(vehicle_index, keyframe_interval);
+        }
+        if (signing_key && !fleet.enableAuthentication(auth_mode, signing_key, hmac_key, checkpoint_topic,
+                                                       checkpoint_every)) {
+            return 1;
+        }
+        if (store_forward && !fleet.enableStoreForward(spool_options, spool_dir)) {
+            return 1;
+        }
+        if (outbound_queue > 0) {
+            fleet.enableOutboundQueue(outbound_queue, queue_full);
+        }
+        if (!udp_destination.empty()) {
+            if (!fleet.enableDatagram(udp_destination, udp_batch)) {
+                return 1;
+            }
+        } else {
+            // Each shard starts ticking once its own connection is up
+            fleet.startConnecting(backoff, std::chrono::seconds(connect_timeout_s));
+        }
+        auto setup_time = std::chrono::steady_clock::now() - setup_started;
+
+        LoadedRoute loaded = loading.get();
+        fleet.setRoute(loaded.route);
+        logger().info("Startup: route ", std::chrono::duration_cast<std::chrono::milliseconds>(loaded.took).count(),
+                      "ms (", loaded.route->size(), " points) alongside fleet setup ",
+                      std::chrono::duration_cast<std::chrono::milliseconds>(setup_time).count(), "ms");
+
+        if (spatial_events) {
+            auto geofences = std::make_shared<GeofenceSet>();
+            if (!geofence_file.empty() && !geofences->load(geofence_file)) {
+                return 1;
+            }
+            fleet.enableSpatialEvents(proximity_m, std::move(geofences), event_topic);
+            if (proximity_m > 0) {
+                logger().info("Publishing proximity (", proximity_m, "m) and geofence events on ", event_topic);
+            } else {
+                logger().info("Publishing geofence events on ", event_topic);
+            }
+        }
+
+        if (phase_jitter) {
+            fleet.assignPhases(static_cast<size_t>(std::max(1, publish_interval_ms)));
+        }
+        if (!restore_file.empty()) {
+            if (!fleet.loadSnapshot(restore_file)) {
+                return 1;
+            }
+            logger().info("Restored fleet state from ", restore_file);
+        }
+
+        logger().info("Starting fleet of ", fleet.size(), " vehicles over ",
+                      fleet.connectionCount(), " connection(s) on ",
+                      fleet.threadCount(), " thread(s), ",
+                      fleet.vectorized() ? "AVX2" : "scalar", " kinematics. Press Ctrl+C to stop.");
+        logger().info("Vehicle state: ", fleet.stateBytes() / (1024 * 1024), " MB (",
+                      fleet.stateBytes() / std::max<size_t>(fleet.size(), 1), " bytes per vehicle)");
+
+        // One scheduler tick per phase slot; a full cycle of slots is one publish interval
+        const size_t slots = fleet.phaseSlots();
+        TickScheduler scheduler(std::chrono::microseconds(publish_interval_ms * 1000LL) / slots, catch_up);
+        uint64_t cycle = 0;
+        size_t published = 0;
+        auto busy = TickScheduler::Clock::duration::zero();
+        auto first_message = std::chrono::steady_clock::time_point{};
+        bool startup_reported = false;
+        auto next_snapshot = std::chrono::steady_clock::now() + std::chrono::seconds(snapshot_every_s);
+
+        try {
+            while (true) {
+                sleepUntilServicingBatches(scheduler.deadline(), fleet.batchers());
+                TickScheduler::Tick tick = scheduler.begin();
+                metrics::registry().tick_lateness.record(tick.lateness);
+
+                if (tick.index / slots != cycle) {
+                    // Positions of the whole interval are in; look for events between intervals
+                    size_t events = fleet.updateSpatialEvents();
+                    logger().info("Published ", published, " positions in ",
+                                  std::chrono::duration_cast<std::chrono::milliseconds>(busy).count(), "ms",
+                                  " (in flight: ", fleet.inFlight(), ", failed: ", fleet.publishFailures(),
+                                  ", window stalls: ", fleet.publishStalls(),
+                                  ", steals: ", fleet.steals(),
+                                  ", payload allocs: ", fleet.payloadAllocations(),
+                                  ", kinematics: ",
+                                  std::chrono::duration_cast<std::chrono::microseconds>(fleet.kinematicsTime()).count(),
+                                  "us)");
+                    logger().info("  tick lateness: ", scheduler.lateness().summary(),
+                                  " overruns=", scheduler.overruns(), " skipped=", scheduler.skipped());
+                    if (fleet.hasOutboundQueue()) {
+                        LatencyHistogram queued;
+                        fleet.takeQueueLatency(queued);
+                        logger().info("  outbound queue: depth=", fleet.queueDepth(),
+                                      " max=", fleet.takeQueueMaxDepth(),
+                                      " dropped=", fleet.queueDrops(), " full-waits=", fleet.queueFullWaits(),
+                                      " queued ", queued.summary());
+                    }
+                    if (fleet.hasDatagram()) {
+                        logger().info("  udp: sent=", metrics::registry().datagrams_sent.value(),
+                                      " dropped=", fleet.datagramDrops());
+                    }
+                    if (reckoning.enabled()) {
+                        logger().info("  dead reckoning: suppressed=", metrics::registry().suppressed.value());
+                    }
+                    if (signing_key) {
+                        const metrics::Registry& m = metrics::registry();
+                        logger().info("  auth: signatures=", m.signatures.value(), " macs=", m.macs.value(),
+                                      " checkpoints=", m.checkpoints.value(), " failed=", m.auth_failures.value());
+                    }
+                    if (fleet.hasSpatialEvents()) {
+                        const metrics::Registry& m = metrics::registry();
+                        logger().info("  events: ", events, " (proximity=", m.proximity_events.value(),
+                                      " geofence=", m.geofence_events.value(), " total)");
+                    }
+                    if (fleet.hasStoreForward()) {
+                        logger().info("  store-and-forward: backlog=", fleet.backlog(),
+                                      " dropped=", fleet.backlogDrops());
+                    }
+                    if (!snapshot_file.empty() && std::chrono::steady_clock::now() >= next_snapshot) {
+                        auto saving = std::chrono::steady_clock::now();
+                        if (fleet.saveSnapshot(snapshot_file)) {
+                            logger().info("  snapshot: ", snapshot_file, " in ",
+                                          millisSince(saving, std::chrono::steady_clock::now()), "ms");
+                        }
+                        next_snapshot = saving + std::chrono::seconds(snapshot_every_s);
+                    }
+                    scheduler.resetLateness();
+                    fleet.resetKinematicsTime();
+                    cycle = tick.index / slots;
+                    published = 0;
+                    busy = TickScheduler::Clock::duration::zero();
+                }
+
+                // Slots skipped within the current interval are only late, not dropped;
+                // the skip policy drops whole intervals, which a seeded fleet still
+                // steps through so its motion does not depend on overruns
+                uint64_t first_slot = tick.index - std::min<uint64_t>(tick.skipped, slots - 1);
+                auto start = TickScheduler::Clock::now();
+                uint64_t first_skipped = tick.index - tick.skipped;
+                fleet.skipTicks(first_skipped, first_slot - first_skipped);
+                for (uint64_t slot = first_slot; slot <= tick.index; slot++) {
+                    published += fleet.publishSlot(slot % slots);
+                }
+                busy += TickScheduler::Clock::now() - start;
+
+                if (!startup_reported) {
+                    auto now = std::chrono::steady_clock::now();
+                    if (published > 0 && first_message == std::chrono::steady_clock::time_point{}) {
+                        first_message = now;
+                    }
+                    if (fleet.readyShards() == fleet.connectionCount()) {
+                        std::chrono::steady_clock::time_point first_up, last_up;
+                        size_t up = fleet.firstConnects(first_up, last_up);
+                        std::string connections = up == 0 ? std::string()
+                            : ", " + std::to_string(up) + " connection(s) up at " +
+                              std::to_string(millisSince(started, first_up)) + "-" +
+                              std::to_string(millisSince(started, last_up)) + "ms";
+                        logger().info("Startup: first message at ", millisSince(started, first_message),
+                                      "ms, every vehicle ticking at ", millisSince(started, now), "ms", connections);
+                        startup_reported = true;
+                    }
+                }
+            }
+        } catch (const std::exception& e) {
+            logger().error("Error in main loop: ", e.what());
+        }
+
+        fleet.disconnect();
+        return 0;
+    }
+
+    VehicleAgent agent(client_id, broker_urls[HashRing(broker_urls).nodeFor(client_id)],
+                       sharding::shardedTopic(topic, client_id, topic_shards), qos, max_in_flight);
+    agent.setMotion(motion, max_accel);
+    if (seeded) {
+        agent.setSeed(static_cast<uint32_t>(seed ^ (seed >> 32)));
+        agent.setFixedStep(publish_interval_ms / 1000.0);
+    }
+    agent.setDeadReckoning(reckoning);
+    std::vector<std::shared_ptr<PositionBatcher>> batchers;
+    if (batch) {
+        batchers.push_back(std::make_shared<PositionBatcher>(
+            agent.client(), agent.window(), batch_topic, qos, batch_count, batch_bytes,
+            std::chrono::milliseconds(batch_window_ms)));
+        agent.setBatcher(batchers.front());
+        if (compression != Compression::None) {
+            auto compressor = std::make_unique<FrameCompressor>(compression, compress_level, compress_min);
+            if (!compress_dict.empty() && !compressor->loadDictionary(compress_dict)) {
+                return 1;
+            }
+            batchers.front()->setCompressor(std::move(compressor));
+        }
+    }
+    if (compact) {
+        agent.setCompact(vehicle_index, keyframe_interval);
+    }
+    if (signing_key) {
+        auto authenticator = std::make_shared<MessageAuthenticator>(
+            auth_mode, signing_key, hmac_key, static_cast<uint32_t>(sharding::hashKey(client_id)), checkpoint_topic,
+            qos, checkpoint_every);
+        if (!authenticator->ok()) {
+            return 1;
+        }
+        agent.setAuthenticator(std::move(authenticator));
+    }
+    if (store_forward) {
+        if (!spool_dir.empty()) spool_options.spill_file = spool_dir + "/" + client_id + ".spill";
+        if (!agent.enableStoreForward(spool_options)) {
+            return 1;
+        }
+    }
+    if (outbound_queue > 0) {
+        agent.enableOutboundQueue(outbound_queue, queue_full);
+    }
+    
+    // Parse the route while the handshake is in flight
+    std::future<LoadedRoute> loading = loadRouteInBackground(route_file);
+    if (!udp_destination.empty()) {
+        auto datagram = std::make_shared<DatagramSender>();
+        if (!datagram->open(udp_destination)) {
+            return 1;
+        }
+        agent.setDatagram(std::move(datagram));
+    } else if (!agent.connect(backoff, std::chrono::seconds(connect_timeout_s))) {
+        logger().warn("No MQTT connection yet, starting anyway and retrying in the background");
+    }
+    LoadedRoute loaded = loading.get();
+    agent.setRoute(loaded.route);
+    logger().info("Startup: route ", std::chrono::duration_cast<std::chrono::milliseconds>(loaded.took).count(),
+                  "ms (", loaded.route->size(), " points) alongside connecting, ready at ",
+                  millisSince(started, std::chrono::steady_clock::now()), "ms");
+
+    logger().info("Starting position publishing loop. Press Ctrl+C to stop.");
+    // Each publish is logged at debug; the summary stands in for it at info
+    logger().summarize(std::chrono::seconds(log_summary_s), deliverySummary(log_summary_s));
+
+    TickScheduler scheduler(std::chrono::milliseconds(publish_interval_ms), catch_up);
 
     try {
         while (true) {
+            sleepUntilServicingBatches(scheduler.deadline(), batchers);
+            TickScheduler::Tick tick = scheduler.begin();
+            metrics::registry().tick_lateness.record(tick.lateness);
+            if (tick.skipped > 0) {
+                static LogRateLimit limit(5, std::chrono::seconds(1));
+                logger().limited(limit, LogLevel::Warn, "Tick overran by ",
+                                 std::chrono::duration_cast<std::chrono::milliseconds>(tick.lateness).count(),
+                                 "ms, skipped ", tick.skipped, " tick(s)");
+                agent.skipTicks(tick.skipped);
+            }
             agent.publishPosition();
-            std::this_thread::sleep_for(std::chrono::milliseconds(publish_interval_ms));
         }
     } catch (const std::exception& e) {
-        std::cerr << "Error in main loop: " << e.what() << std::endl;
+        logger().error("Error in main loop: ", e.what());
     }
 
     agent.disconnect();
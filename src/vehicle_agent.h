@@ -0,0 +1,271 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <mqtt/async_client.h>
+#include "connection_manager.h"
+#include "kinematics.h"
+#include "logger.h"
+#include "publish_path.h"
+#include "route.h"
+#include "vehicle_state.h"
+
+// One simulated vehicle publishing VehiclePosition messages, with its own MQTT
+// client, route and motion. Fleet drives many vehicles through the same
+// PublishPath without an agent each.
+class VehicleAgent {
+private:
+    std::string client_id_;
+    std::string broker_url_;
+    PublishPath path_;
+    VehicleState state_;
+    std::unique_ptr<OutboundPublisher> publisher_;  // only when the agent owns its queue
+    std::unique_ptr<ConnectionManager> connection_;
+    std::shared_ptr<const Route> route_;
+    RouteCursor cursor_;
+    std::mt19937 gen_;
+    std::uniform_real_distribution<> speed_dist_;
+    std::uniform_real_distribution<> heading_noise_;
+    bool log_each_publish_;
+    MotionModel motion_;
+    double max_accel_;
+    double speed_;
+    double target_speed_;
+    std::chrono::steady_clock::time_point last_step_;
+    bool moving_;
+    double fixed_step_;  // seconds motion advances per tick; 0 follows the clock
+
+public:
+    // Comfortable acceleration/braking limit for a road vehicle, m/s^2
+    static constexpr double kDefaultMaxAccel = 1.5;
+
+    VehicleAgent(const std::string& client_id, const std::string& broker_url, const std::string& topic,
+                 int qos = 0, size_t max_in_flight = 100)
+        : client_id_(client_id), broker_url_(broker_url),
+          path_(std::make_shared<mqtt::async_client>(broker_url, client_id),
+                std::make_shared<PublishWindow>(max_in_flight),
+                {std::make_shared<PayloadPool>(topic, qos, PublishPath::kPayloadCapacity, max_in_flight + 1)},
+                VehicleIds::single(client_id)),
+          route_(std::make_shared<const Route>(defaultRoute())),
+          cursor_{0, 0.0}, gen_(std::random_device{}()),
+          speed_dist_(8.0, 15.0), heading_noise_(-5.0, 5.0), log_each_publish_(true), fixed_step_(0) {
+        setMotion(MotionModel::Interpolate, kDefaultMaxAccel);
+    }
+
+    const std::string& clientId() const { return client_id_; }
+    std::shared_ptr<mqtt::async_client> client() const { return path_.client(); }
+    std::shared_ptr<PublishWindow> window() const { return path_.window(); }
+    uint64_t payloadAllocations() const { return path_.payloadAllocations(); }
+
+    // Route positions into batched frames instead of publishing them one by one
+    void setBatcher(std::shared_ptr<PositionBatcher> batcher) { path_.setBatcher(std::move(batcher)); }
+
+    // Queue serialized positions for a publisher thread instead of publishing inline
+    void setOutbound(std::shared_ptr<OutboundQueue> outbound) { path_.setOutbound(std::move(outbound)); }
+
+    // Keep positions published inline while offline and forward them later
+    void setStoreForward(std::shared_ptr<StoreForward> spool) { path_.setStoreForward(std::move(spool)); }
+
+    // Send every position as a UDP datagram instead of publishing it over MQTT
+    void setDatagram(std::shared_ptr<DatagramSender> datagram) { path_.setDatagram(std::move(datagram)); }
+
+    // Authenticate every payload (see PublishPath::setAuthenticator)
+    void setAuthenticator(std::shared_ptr<MessageAuthenticator> auth) { path_.setAuthenticator(std::move(auth)); }
+
+    // Own a store-and-forward buffer. Call before enableOutboundQueue.
+    bool enableStoreForward(const StoreForwardOptions& options) {
+        auto spool = std::make_shared<StoreForward>(options);
+        if (!spool->open()) return false;
+        if (path_.batcher()) path_.batcher()->setStoreForward(spool);
+        path_.setStoreForward(std::move(spool));
+        return true;
+    }
+
+    // Own a queue and a publisher thread draining it into the client
+    void enableOutboundQueue(size_t capacity, QueueFullPolicy policy) {
+        auto outbound = std::make_shared<OutboundQueue>(capacity, policy);
+        // Queued messages hold their pool slots until published
+        path_.pool(0).reserveSlots(path_.window()->maxInFlight() + outbound->capacity() + 1);
+        publisher_ = std::make_unique<OutboundPublisher>(outbound, path_.client(), path_.window(), path_.spool());
+        if (path_.batcher()) path_.batcher()->setOutbound(outbound);
+        path_.setOutbound(std::move(outbound));
+    }
+
+    // Publish compact records (compact_codec.h) identified by vehicle_index
+    // instead of VehiclePosition protobufs
+    void setCompact(uint32_t vehicle_index, uint32_t keyframe_interval) {
+        path_.setCompact(vehicle_index, keyframe_interval);
+    }
+
+    // Adaptive reporting (see PublishPath::setDeadReckoning)
+    void setDeadReckoning(const DeadReckoningPolicy& policy) { path_.setDeadReckoning(policy); }
+
+    // Draw speeds and heading noise from seed instead of a random device
+    void setSeed(uint32_t seed) {
+        gen_.seed(seed);
+        setMotion(motion_, max_accel_);
+    }
+
+    // Advance motion by step seconds per tick instead of the time since the
+    // previous tick, so with a seed it depends on the tick count alone
+    void setFixedStep(double step) { fixed_step_ = step; }
+
+    void setMotion(MotionModel model, double max_accel) {
+        motion_ = model;
+        max_accel_ = max_accel;
+        speed_ = speed_dist_(gen_);
+        target_speed_ = speed_;
+        moving_ = false;
+    }
+
+    // Connect in the background and wait up to timeout for the first
+    // connection. A lost or failed connection is retried with backoff; false
+    // means it is not up yet, but retries continue.
+    bool connect(BackoffPolicy backoff, std::chrono::milliseconds timeout) {
+        logger().info("Connecting to MQTT broker at ", broker_url_);
+        connection_ = std::make_unique<ConnectionManager>(path_.pool(0).qos(), path_.window()->maxInFlight(),
+                                                          backoff);
+        connection_->add(path_.client());
+        connection_->start();
+        return connection_->waitConnected(timeout) > 0;
+    }
+
+    void disconnect() {
+        mqtt::async_client& client = *path_.client();
+        PublishWindow& window = *path_.window();
+        try {
+            if (path_.batcher()) {
+                path_.batcher()->flush();
+            }
+            if (publisher_) {
+                publisher_->stop();
+            }
+            if (connection_) {
+                connection_->stop();
+            }
+            if (!client.is_connected()) {
+                logger().info("Not connected to MQTT broker (delivered: ", window.completed(),
+                              ", failed: ", window.failed(), ")");
+                return;
+            }
+            if (!window.drain(std::chrono::seconds(5))) {
+                logger().warn("Timed out waiting for ", window.inFlight(), " in-flight messages");
+            }
+            client.disconnect()->wait();
+            logger().info("Disconnected from MQTT broker (delivered: ", window.completed(),
+                          ", failed: ", window.failed(),
+                          path_.outbound() ? ", queue drops: " + std::to_string(path_.outbound()->dropped()) : "",
+                          ", payload allocs: ", payloadAllocations(), ")");
+        }
+        catch (const mqtt::exception& exc) {
+            logger().error("Error disconnecting: ", exc.what());
+        }
+    }
+
+    void loadRoute(const std::string& filename, size_t threads = 1) {
+        auto route = std::make_shared<Route>();
+        if (loadRouteFile(filename, *route, threads)) {
+            setRoute(std::move(route));
+        }
+    }
+
+    // Follow route from start_index, e.g. once it has been loaded in the background
+    void setRoute(std::shared_ptr<const Route> route, size_t start_index = 0) {
+        route_ = std::move(route);
+        cursor_ = {route_->empty() ? 0 : start_index % route_->size(), 0.0};
+        moving_ = false;
+    }
+
+    void publishPosition() {
+        const Route& route = *route_;
+        if (route.empty()) {
+            static LogRateLimit limit(1, std::chrono::seconds(10));
+            logger().limited(limit, LogLevel::Error, "No route loaded");
+            return;
+        }
+
+        double lat, lon, speed, heading;
+        nextState(route, lat, lon, speed, heading);
+        publishState(lat, lon, speed, heading);
+    }
+
+    // Move on through ticks the scheduler skipped without publishing them,
+    // drawing what publishPosition would, so a fixed-step agent's motion does
+    // not depend on overruns. A no-op when following the clock, where the next
+    // tick's step covers the skipped time.
+    void skipTicks(uint64_t ticks) {
+        if (fixed_step_ <= 0 || route_->empty()) return;
+        double lat, lon, speed, heading;
+        for (uint64_t i = 0; i < ticks; i++) nextState(*route_, lat, lon, speed, heading);
+    }
+
+    // Publish an already computed state, stamped now
+    void publishState(double lat, double lon, double speed, double heading) {
+        int64_t timestamp = PublishPath::wallClockMillis();
+        bool sent = false;
+        pipeline::dispatch(path_.pipelineConfig(), [&](auto encoding, auto transport) {
+            sent = path_.template publishAs<decltype(encoding), decltype(transport)>(state_, 0, lat, lon, speed,
+                                                                                    heading, timestamp);
+        });
+        if (path_.datagram()) path_.datagram()->flush();
+        if (sent && log_each_publish_) {
+            logger().debug("Published position: ", lat, ", ", lon,
+                           " (speed: ", speed, " m/s, heading: ", heading, "°)");
+        }
+    }
+
+private:
+    // State for one tick: motion along the route, then the heading to the next
+    // point with some noise added
+    void nextState(const Route& route, double& lat, double& lon, double& speed, double& heading) {
+        step(route, lat, lon, speed);
+
+        heading = calculateHeadingToNextPoint();
+        heading += heading_noise_(gen_);
+        if (heading < 0) heading += 360.0;
+        if (heading >= 360) heading -= 360.0;
+
+        if (motion_ == MotionModel::Points) {
+            // Move to next route point
+            cursor_.segment = (cursor_.segment + 1) % route.size();
+        }
+    }
+
+    // Motion for one tick. Interpolate drives the cursor forward by the distance
+    // covered since the previous tick, with speed easing towards a sampled target
+    // under the acceleration limit; Points reports the current route point.
+    void step(const Route& route, double& lat, double& lon, double& speed) {
+        if (motion_ == MotionModel::Points) {
+            lat = route.lat(cursor_.segment);
+            lon = route.lon(cursor_.segment);
+            speed = speed_dist_(gen_);
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        double dt = fixed_step_ > 0 ? fixed_step_
+                    : moving_ ? std::chrono::duration<double>(now - last_step_).count() : 0.0;
+        last_step_ = now;
+        moving_ = true;
+
+        if (std::fabs(target_speed_ - speed_) < 0.1) {
+            target_speed_ = speed_dist_(gen_);
+        }
+        double previous = speed_;
+        speed_ = kinematics::approachSpeed(speed_, target_speed_, max_accel_, dt);
+        kinematics::advance(route, cursor_, 0.5 * (previous + speed_) * dt);
+        kinematics::interpolate(route, cursor_, lat, lon);
+        speed = speed_;
+    }
+
+    // True initial bearing of the current segment, from the route's segment table
+    double calculateHeadingToNextPoint() {
+        const Route& route = *route_;
+        if (route.size() < 2) return 0.0;
+        return route.bearing(cursor_.segment);
+    }
+};
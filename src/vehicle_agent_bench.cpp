@@ -0,0 +1,959 @@
+// Load-test harness for the agent's hot paths. Each benchmark runs one path in
+// isolation (serialization, route stepping) or against a live broker (publish,
+// end-to-end fleet ticks) and the results are written to stdout as one JSON
+// document; progress and agent logging go to stderr. With --verify it instead
+// checks that the fast paths agree with their reference versions and exits
+// nonzero on any mismatch.
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <mqtt/async_client.h>
+#include "geovan.pb.h"
+#include "compact_codec.h"
+#include "datagram_sender.h"
+#include "fleet.h"
+#include "fleet_kinematics.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "payload_pool.h"
+#include "publish_path.h"
+#include "publish_window.h"
+#include "route.h"
+#include "spatial_index.h"
+#include "store_forward.h"
+
+// Every heap allocation in the process goes through here so benchmarks can
+// report allocations per message. paho's C core uses malloc and is not counted.
+// Kept out of line: once inlined, GCC pairs the malloc with the sized delete's
+// free and reports a false -Wmismatched-new-delete.
+static std::atomic<uint64_t> g_allocations{0};
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double cpuSeconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+struct Result {
+    std::string name;
+    uint64_t messages = 0;
+    double seconds = 0.0;
+    double cpu_seconds = 0.0;
+    uint64_t allocations = 0;
+    // What latency measures for this benchmark ("" if not recorded)
+    std::string latency_kind;
+    LatencyHistogram latency;
+    std::string skipped;
+};
+
+// Wall time, CPU time and allocations between construction and finish()
+class Measurement {
+private:
+    Clock::time_point start_;
+    double cpu_start_;
+    uint64_t allocations_start_;
+
+public:
+    Measurement()
+        : start_(Clock::now()), cpu_start_(cpuSeconds()),
+          allocations_start_(g_allocations.load(std::memory_order_relaxed)) {}
+
+    void finish(Result& result, uint64_t messages) const {
+        result.messages = messages;
+        result.seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+        result.cpu_seconds = cpuSeconds() - cpu_start_;
+        result.allocations = g_allocations.load(std::memory_order_relaxed) - allocations_start_;
+    }
+};
+
+// Delivery listener that records publish-to-completion latency, then hands the
+// completion to the in-flight window. The user context is PublishWindow::startContext().
+class LatencyListener : public mqtt::iaction_listener {
+private:
+    PublishWindow& window_;
+    std::mutex mutex_;
+    LatencyHistogram latency_;
+
+public:
+    explicit LatencyListener(PublishWindow& window) : window_(window) {}
+
+    LatencyHistogram latency() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return latency_;
+    }
+
+    void on_success(const mqtt::token& tok) override {
+        record(tok);
+        window_.on_success(tok);
+    }
+
+    void on_failure(const mqtt::token& tok) override {
+        window_.on_failure(tok);
+    }
+
+private:
+    void record(const mqtt::token& tok) {
+        uint64_t elapsed_ns = metrics::nowNanos() - PublishWindow::startedAt(tok);
+        std::lock_guard<std::mutex> lock(mutex_);
+        latency_.record(elapsed_ns / 1000);
+    }
+};
+
+struct Options {
+    std::string broker_url = "tcp://localhost:1883";
+    std::string topic = "geovan/bench";
+    std::string route_file;
+    uint64_t messages = 200000;
+    size_t vehicles = 100000;
+    size_t ticks = 20;
+    size_t connections = 1;
+    size_t threads = 1;
+    int qos = 0;
+    size_t max_in_flight = 1000;
+    bool broker = true;
+    bool verify = false;
+};
+
+void fillPosition(geovan::VehiclePosition& pos, uint64_t i) {
+    pos.mutable_pos()->set_lat(28.6139 + (i % 1000) * 1e-5);
+    pos.mutable_pos()->set_lon(77.2090 + (i % 1000) * 1e-5);
+    pos.set_speed(8.0 + (i % 7));
+    pos.set_heading(static_cast<double>(i % 360));
+    pos.set_timestamp(1700000000000 + i);
+    pos.set_seq(static_cast<uint32_t>(i));
+}
+
+// Protobuf encode into pooled payload buffers, the per-message cost of publishing
+Result benchSerialize(const Options& opts) {
+    Result result;
+    result.name = "serialize";
+    PayloadPool pool(opts.topic, opts.qos, PublishPath::kPayloadCapacity);
+    geovan::VehiclePosition pos;
+    pos.set_id("bench-vehicle-000001");
+    PayloadPool::Slot slot;
+
+    Measurement measurement;
+    for (uint64_t i = 0; i < opts.messages; i++) {
+        fillPosition(pos, i);
+        pool.serialize(pos, slot);
+    }
+    measurement.finish(result, opts.messages);
+    return result;
+}
+
+// One FleetKinematics step of the whole fleet per tick; latency is per tick
+Result benchRouteStep(const Options& opts, const Route& route) {
+    Result result;
+    result.name = "route_step";
+    result.latency_kind = "tick";
+    FleetKinematics kin(opts.vehicles, 42);
+    for (size_t i = 0; i < opts.vehicles; i++) {
+        kin.place(i, route.empty() ? 0 : i * route.size() / opts.vehicles);
+    }
+
+    Measurement measurement;
+    for (size_t t = 0; t < opts.ticks; t++) {
+        auto start = Clock::now();
+        kin.step(route, 0, opts.vehicles, 1.0);
+        result.latency.record(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+    }
+    measurement.finish(result, static_cast<uint64_t>(opts.vehicles) * opts.ticks);
+    return result;
+}
+
+// Serialize and publish on one connection; latency runs from the publish call
+// to its completion (handed to the socket at QoS 0, broker ack at QoS 1 and 2)
+Result benchPublish(const Options& opts) {
+    Result result;
+    result.name = "publish";
+    result.latency_kind = "publish";
+
+    mqtt::async_client client(opts.broker_url, "geovan-bench-publish");
+    mqtt::connect_options conn_opts;
+    conn_opts.set_clean_session(true);
+    conn_opts.set_max_inflight(static_cast<int>(opts.max_in_flight));
+    try {
+        if (!client.connect(conn_opts)->wait_for(std::chrono::seconds(5))) {
+            result.skipped = "timed out connecting to " + opts.broker_url;
+            return result;
+        }
+    } catch (const mqtt::exception& exc) {
+        result.skipped = std::string("cannot connect to ") + opts.broker_url + ": " + exc.what();
+        return result;
+    }
+
+    PublishWindow window(opts.max_in_flight);
+    PayloadPool pool(opts.topic, opts.qos, PublishPath::kPayloadCapacity, opts.max_in_flight + 1);
+    LatencyListener listener(window);
+    geovan::VehiclePosition pos;
+    pos.set_id("bench-vehicle-000001");
+    PayloadPool::Slot slot;
+
+    Measurement measurement;
+    for (uint64_t i = 0; i < opts.messages; i++) {
+        fillPosition(pos, i);
+        pool.serialize(pos, slot);
+        window.acquire();
+        try {
+            client.publish(slot.message, PublishWindow::startContext(), listener);
+        } catch (const mqtt::exception&) {
+            window.cancel();
+        }
+    }
+    window.drain(std::chrono::seconds(30));
+    measurement.finish(result, opts.messages);
+    result.latency = listener.latency();
+
+    try {
+        client.disconnect()->wait();
+    } catch (const mqtt::exception&) {
+    }
+    return result;
+}
+
+// Whole fleet ticks (step, serialize, publish every vehicle) back to back
+Result benchEndToEnd(const Options& opts, std::shared_ptr<const Route> route) {
+    Result result;
+    result.name = "end_to_end";
+    result.latency_kind = "tick";
+
+    Fleet fleet("geovan-bench", {opts.broker_url}, opts.topic, route, opts.vehicles, opts.connections,
+                opts.qos, opts.max_in_flight, opts.threads);
+    // The same workload on every run, one second of motion per tick like route_step
+    fleet.setSeed(42);
+    fleet.setFixedStep(1.0);
+    if (!fleet.connect(BackoffPolicy(), std::chrono::seconds(5)) || fleet.connected() < fleet.connectionCount()) {
+        fleet.disconnect();
+        result.skipped = "cannot connect to " + opts.broker_url;
+        return result;
+    }
+
+    Measurement measurement;
+    for (size_t t = 0; t < opts.ticks; t++) {
+        auto start = Clock::now();
+        fleet.publishPositions();
+        result.latency.record(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+    }
+    fleet.disconnect();
+    measurement.finish(result, static_cast<uint64_t>(fleet.size()) * opts.ticks);
+    return result;
+}
+
+struct Check {
+    std::string name;
+    bool passed = false;
+    std::string detail;
+};
+
+// A loop of points a few meters apart, so vehicles cross segments every tick
+// and the kernels' crossing fix-up is exercised as much as the vector pass
+Route denseLoop() {
+    std::vector<double> lat, lon;
+    for (int i = 0; i < 720; i++) {
+        double angle = i * M_PI / 360.0;
+        lat.push_back(28.6139 + 0.01 * std::sin(angle));
+        lon.push_back(77.2090 + 0.01 * std::cos(angle));
+    }
+    return Route(std::move(lat), std::move(lon));
+}
+
+// The AVX2 kernel against the scalar one on the same seeded fleet: every
+// stored field must match bit for bit after every tick. The fleet size is not
+// a multiple of four, so the scalar tail after the vector pass runs too.
+Check checkKinematics(const Options& opts, const Route& route, const std::string& name) {
+    Check check;
+    check.name = name;
+    size_t vehicles = opts.vehicles | 3;
+    FleetKinematics vector(vehicles, 42);
+    FleetKinematics scalar(vehicles, 42);
+    if (!vector.vectorized()) {
+        check.passed = true;
+        check.detail = "no vector kernel on this CPU";
+        return check;
+    }
+    scalar.setVectorized(false);
+    for (size_t i = 0; i < vehicles; i++) {
+        size_t segment = route.empty() ? 0 : i * route.size() / vehicles;
+        vector.place(i, segment);
+        scalar.place(i, segment);
+    }
+    // Uneven steps, a first one of zero like a fleet's first tick
+    for (size_t t = 0; t < opts.ticks * 10; t++) {
+        double dt = t == 0 ? 0.0 : 0.25 + (t % 7) * 0.25;
+        vector.step(route, 0, vehicles, dt);
+        scalar.step(route, 0, vehicles, dt);
+        size_t differs = vector.firstDifference(scalar);
+        if (differs != vehicles) {
+            check.detail = "tick " + std::to_string(t) + ": vehicle " + std::to_string(differs) + " differs";
+            return check;
+        }
+    }
+    check.passed = true;
+    check.detail = std::to_string(vehicles) + " vehicles, " + std::to_string(opts.ticks * 10) + " ticks";
+    return check;
+}
+
+// Compact records encoded per vehicle and decoded as one stream must give
+// back the quantized values exactly; after a lost frame a vehicle's deltas
+// are dropped until its next keyframe, then it decodes exactly again
+Check checkCompactCodec(const Options& opts, const Route& route) {
+    Check check;
+    check.name = "compact_codec";
+    constexpr size_t kVehicles = 64;
+    constexpr uint32_t kKeyframeInterval = 8;
+    FleetKinematics kin(kVehicles, 7);
+    for (size_t i = 0; i < kVehicles; i++) kin.place(i, i * route.size() / kVehicles);
+    std::vector<CompactEncoder> encoders;
+    for (size_t i = 0; i < kVehicles; i++) encoders.emplace_back(static_cast<uint32_t>(i), kKeyframeInterval);
+
+    CompactDecoder decoder;
+    std::vector<uint8_t> frame;
+    std::vector<compact::Sample> expected, decoded;
+    size_t ticks = std::max<size_t>(opts.ticks * 5, 3 * kKeyframeInterval);
+    size_t lost_tick = kKeyframeInterval + 2;
+    size_t resync_tick = (lost_tick / kKeyframeInterval + 1) * kKeyframeInterval;
+    size_t records = 0;
+    for (size_t t = 0; t < ticks; t++) {
+        kin.step(route, 0, kVehicles, 1.0);
+        int64_t timestamp = 1700000000000 + static_cast<int64_t>(t) * 1000 + static_cast<int64_t>(t % 3);
+        frame.clear();
+        expected.clear();
+        for (size_t i = 0; i < kVehicles; i++) {
+            uint32_t seq = static_cast<uint32_t>(t);
+            uint8_t record[compact::kMaxRecordSize];
+            size_t size = encoders[i].encode(kin.lat(i), kin.lon(i), kin.speed(i), kin.heading(i), timestamp, seq,
+                                             record);
+            frame.insert(frame.end(), record, record + size);
+            // From the lost frame until the next keyframe nothing decodes
+            if (t < lost_tick || t >= resync_tick) {
+                expected.push_back({static_cast<uint32_t>(i), compact::toFixed(kin.lat(i)) / compact::kCoordScale,
+                                    compact::toFixed(kin.lon(i)) / compact::kCoordScale,
+                                    std::lround(kin.speed(i) * 100.0) / 100.0,
+                                    std::lround(kin.heading(i) * 10.0) / 10.0, timestamp, seq});
+            }
+        }
+        if (t == lost_tick) continue;
+        decoded.clear();
+        if (!decoder.decode(frame.data(), frame.size(), decoded)) {
+            check.detail = "tick " + std::to_string(t) + ": malformed frame";
+            return check;
+        }
+        if (decoded.size() != expected.size()) {
+            check.detail = "tick " + std::to_string(t) + ": decoded " + std::to_string(decoded.size()) +
+                           " records, expected " + std::to_string(expected.size());
+            return check;
+        }
+        for (size_t j = 0; j < decoded.size(); j++) {
+            const compact::Sample& a = decoded[j];
+            const compact::Sample& b = expected[j];
+            if (a.vehicle != b.vehicle || a.lat != b.lat || a.lon != b.lon || a.speed != b.speed ||
+                a.heading != b.heading || a.timestamp != b.timestamp || a.seq != b.seq) {
+                check.detail = "tick " + std::to_string(t) + ": vehicle " + std::to_string(a.vehicle) +
+                               " decoded differently";
+                return check;
+            }
+        }
+        records += decoded.size();
+    }
+    check.passed = true;
+    check.detail = std::to_string(records) + " records, " + std::to_string(decoder.dropped()) +
+                   " dropped after the lost frame";
+    return check;
+}
+
+// A scratch file for checks, removed again by the check
+std::string scratchFile(const std::string& name) {
+    const char* dir = std::getenv("TMPDIR");
+    return std::string(dir && *dir ? dir : "/tmp") + "/geovan-verify-" + std::to_string(getpid()) + "-" + name;
+}
+
+// A spill file must have its whole budget allocated once open, not be sparse
+Check checkSpillAllocation() {
+    Check check;
+    check.name = "spill_allocation";
+    constexpr uint64_t kBudget = 8ull << 20;
+    std::string filename = scratchFile("alloc.spill");
+    unlink(filename.c_str());
+    {
+        SpillFile spill;
+        struct stat st;
+        if (!spill.open(filename, kBudget)) {
+            check.detail = "could not open " + filename;
+        } else if (stat(filename.c_str(), &st) != 0) {
+            check.detail = "could not stat " + filename;
+        } else if (static_cast<uint64_t>(st.st_blocks) * 512 < kBudget) {
+            check.detail = std::to_string(st.st_blocks * 512) + " bytes allocated of a " + std::to_string(kBudget) +
+                           "-byte budget";
+        } else {
+            check.passed = true;
+            check.detail = std::to_string(st.st_blocks * 512) + " bytes allocated";
+        }
+    }
+    unlink(filename.c_str());
+    return check;
+}
+
+// A backlog resumes up to its first torn record: one with a corrupt payload
+// byte (caught by its CRC) and, separately, one whose length runs past the
+// write offset
+Check checkSpillResume() {
+    Check check;
+    check.name = "spill_resume";
+    std::string filename = scratchFile("resume.spill");
+    // Records start after the 64-byte header; each is a 12-byte record header,
+    // topic "t" and a 3-byte payload
+    constexpr off_t kSecondRecord = 64 + 12 + 1 + 3;
+    struct Corruption {
+        off_t offset;
+        uint32_t value;
+        size_t bytes;
+    };
+    const Corruption corruptions[] = {{kSecondRecord + 12 + 1, 'X', 1}, {kSecondRecord, 0x7FFFFFFF, 4}};
+    for (const Corruption& corruption : corruptions) {
+        unlink(filename.c_str());
+        {
+            SpillFile spill;
+            if (!spill.open(filename, 1 << 16)) {
+                check.detail = "could not open " + filename;
+                return check;
+            }
+            spill.append("t", "one", 0);
+            spill.append("t", "two", 0);
+            spill.append("t", "six", 0);
+        }
+        int fd = ::open(filename.c_str(), O_RDWR);
+        bool written = fd >= 0 && pwrite(fd, &corruption.value, corruption.bytes, corruption.offset) > 0;
+        if (fd >= 0) ::close(fd);
+        SpillFile resumed;
+        if (!written || !resumed.open(filename, 1 << 16)) {
+            check.detail = "could not corrupt and reopen " + filename;
+            unlink(filename.c_str());
+            return check;
+        }
+        std::string topic, payload;
+        int qos;
+        if (resumed.records() != 1) {
+            check.detail = "resumed " + std::to_string(resumed.records()) + " records, expected 1";
+            unlink(filename.c_str());
+            return check;
+        }
+        resumed.front(topic, payload, qos);
+        if (payload != "one") {
+            check.detail = "resumed record reads " + payload;
+            unlink(filename.c_str());
+            return check;
+        }
+    }
+    unlink(filename.c_str());
+    check.passed = true;
+    check.detail = "stopped at a torn payload and at a torn length";
+    return check;
+}
+
+// A non-blocking UDP socket on a loopback port for checks to send to; sets
+// destination to its host:port. Returns -1 if none could be bound.
+int bindLoopback(std::string& destination) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(addr);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &size) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    destination = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+    return fd;
+}
+
+// Every datagram waiting on fd
+std::vector<std::string> receiveAll(int fd) {
+    std::vector<std::string> datagrams;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) >= 0) datagrams.emplace_back(buffer, n);
+    return datagrams;
+}
+
+// A fleet restored from a snapshot publishes every vehicle in full on its
+// first tick, even under a dead-reckoning policy that suppressed them all on
+// the tick before the snapshot: its consumers have not seen that basis
+Check checkSnapshotRestore(std::shared_ptr<const Route> route) {
+    Check check;
+    check.name = "snapshot_restore";
+    constexpr size_t kVehicles = 64;
+    std::string destination;
+    int fd = bindLoopback(destination);
+    if (fd < 0) {
+        check.detail = "could not bind a loopback UDP socket";
+        return check;
+    }
+    DeadReckoningPolicy policy;
+    policy.distance_m = 1e9;
+    policy.heading_deg = 360.0;
+    policy.heartbeat = std::chrono::hours(1);
+    auto makeFleet = [&]() {
+        auto fleet = std::make_unique<Fleet>("geovan-verify", std::vector<std::string>{"tcp://127.0.0.1:1"},
+                                             "verify", route, kVehicles, 1, 0, 10);
+        fleet->setSeed(42);
+        fleet->setFixedStep(1.0);
+        fleet->setDeadReckoning(policy);
+        fleet->enableCompact(0, 16);
+        return fleet;
+    };
+    std::string filename = scratchFile("fleet.snapshot");
+    size_t before = 0, after = 0, keyframes = 0;
+    {
+        auto fleet = makeFleet();
+        if (!fleet->enableDatagram(destination, 1)) {
+            check.detail = "could not open a UDP sender to " + destination;
+            ::close(fd);
+            return check;
+        }
+        fleet->publishPositions();
+        receiveAll(fd);
+        fleet->publishPositions();
+        before = receiveAll(fd).size();
+        if (!fleet->saveSnapshot(filename)) {
+            check.detail = "could not save " + filename;
+            ::close(fd);
+            return check;
+        }
+    }
+    {
+        auto fleet = makeFleet();
+        if (!fleet->enableDatagram(destination, 1) || !fleet->loadSnapshot(filename)) {
+            check.detail = "could not restore " + filename;
+            ::close(fd);
+            unlink(filename.c_str());
+            return check;
+        }
+        fleet->publishPositions();
+        // One-record frames: the record's flags follow the frame header
+        for (const std::string& datagram : receiveAll(fd)) {
+            after++;
+            if (datagram.size() > PositionBatcher::kHeaderSize &&
+                (datagram[PositionBatcher::kHeaderSize] & compact::kKeyframe)) {
+                keyframes++;
+            }
+        }
+    }
+    ::close(fd);
+    unlink(filename.c_str());
+    if (before != 0) {
+        check.detail = std::to_string(before) + " vehicles published on the suppressed tick, expected 0";
+    } else if (after != kVehicles || keyframes != kVehicles) {
+        check.detail = std::to_string(after) + " vehicles published after restoring, " + std::to_string(keyframes) +
+                       " as keyframes, expected " + std::to_string(kVehicles);
+    } else {
+        check.passed = true;
+        check.detail = std::to_string(after) + " keyframes on the first tick after restoring";
+    }
+    return check;
+}
+
+// A payload of kMaxDatagram bytes goes out as one datagram; one byte more is
+// dropped and counted rather than sent to be fragmented
+Check checkDatagramLimit() {
+    Check check;
+    check.name = "datagram_limit";
+    std::string destination;
+    int fd = bindLoopback(destination);
+    if (fd < 0) {
+        check.detail = "could not bind a loopback UDP socket";
+        return check;
+    }
+    DatagramSender sender(4);
+    if (!sender.open(destination)) {
+        check.detail = "could not open a UDP sender to " + destination;
+        ::close(fd);
+        return check;
+    }
+    constexpr size_t kLimit = DatagramSender::kMaxDatagram;
+    bool fits = sender.send(mqtt::make_message("t", std::string(kLimit, 'x'), 0, false));
+    bool oversize = sender.send(mqtt::make_message("t", std::string(kLimit + 1, 'x'), 0, false));
+    sender.flush();
+    std::vector<std::string> received = receiveAll(fd);
+    ::close(fd);
+    if (!fits || oversize) {
+        check.detail = std::string("the ") + (fits ? "oversize payload was accepted" : "largest payload was refused");
+    } else if (received.size() != 1 || received[0].size() != kLimit) {
+        check.detail = std::to_string(received.size()) + " datagrams received, expected one of " +
+                       std::to_string(kLimit) + " bytes";
+    } else if (sender.dropped() != 1) {
+        check.detail = std::to_string(sender.dropped()) + " datagrams counted as dropped, expected 1";
+    } else {
+        check.passed = true;
+        check.detail = "sent " + std::to_string(kLimit) + " bytes, dropped " + std::to_string(kLimit + 1);
+    }
+    return check;
+}
+
+// A compiled route whose point count is forged so that every array size
+// wraps around to what the file really holds must be rejected, not mapped
+// with that count
+Check checkRouteBounds(const Route& route) {
+    Check check;
+    check.name = "route_bounds";
+    std::string filename = scratchFile("forged.route");
+    Route loaded;
+    if (!compileRoute(route, filename, true) || !loadRouteFile(filename, loaded) || loaded.size() != route.size()) {
+        check.detail = "could not compile and load " + filename;
+        unlink(filename.c_str());
+        return check;
+    }
+    // Fixed-point coordinates and bearings are 4 bytes, distances 8: 2^62
+    // more points than written make each size the same modulo 2^64
+    uint64_t forged = route.size() + (1ull << 62);
+    int fd = ::open(filename.c_str(), O_RDWR);
+    bool written = fd >= 0 && pwrite(fd, &forged, sizeof(forged), offsetof(RouteFileHeader, point_count)) ==
+                                  static_cast<ssize_t>(sizeof(forged));
+    if (fd >= 0) ::close(fd);
+    Route forged_route;
+    if (!written) {
+        check.detail = "could not forge " + filename;
+    } else if (loadRouteFile(filename, forged_route)) {
+        check.detail = "mapped a route of " + std::to_string(forged_route.size()) + " points from " +
+                       std::to_string(route.size());
+    } else {
+        check.passed = true;
+        check.detail = "rejected a point count of " + std::to_string(forged);
+    }
+    unlink(filename.c_str());
+    return check;
+}
+
+// Just enough of an MQTT broker on a loopback port for a fleet's shards to
+// come up: each connection's first packet (its CONNECT) is acknowledged and
+// everything after it discarded, which suffices for QoS 0 publishes
+class LoopbackBroker {
+private:
+    int fd_;
+    int wake_[2];
+    int port_;
+    std::thread thread_;
+
+public:
+    LoopbackBroker() : fd_(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)), wake_{-1, -1}, port_(0) {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t size = sizeof(addr);
+        if (fd_ < 0 || bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd_, 16) != 0 ||
+            getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &size) != 0 || pipe(wake_) != 0) {
+            return;
+        }
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this] { serve(); });
+    }
+
+    ~LoopbackBroker() {
+        if (thread_.joinable()) {
+            char stop = 0;
+            if (write(wake_[1], &stop, 1) == 1) thread_.join();
+            else thread_.detach();
+        }
+        for (int fd : {fd_, wake_[0], wake_[1]}) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+
+    LoopbackBroker(const LoopbackBroker&) = delete;
+    LoopbackBroker& operator=(const LoopbackBroker&) = delete;
+
+    bool ok() const { return port_ != 0; }
+    std::string url() const { return "tcp://127.0.0.1:" + std::to_string(port_); }
+
+private:
+    void serve() {
+        std::vector<pollfd> fds = {{wake_[0], POLLIN, 0}, {fd_, POLLIN, 0}};
+        std::vector<bool> acknowledged(2, true);
+        char buffer[4096];
+        while (poll(fds.data(), fds.size(), -1) >= 0 && !(fds[0].revents & POLLIN)) {
+            if (fds[1].revents & POLLIN) {
+                int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0) {
+                    fds.push_back({client, POLLIN, 0});
+                    acknowledged.push_back(false);
+                }
+            }
+            for (size_t k = 2; k < fds.size(); k++) {
+                if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                ssize_t n = read(fds[k].fd, buffer, sizeof(buffer));
+                if (n > 0 && !acknowledged[k]) {
+                    static const unsigned char kConnack[] = {0x20, 0x02, 0x00, 0x00};
+                    acknowledged[k] = write(fds[k].fd, kConnack, sizeof(kConnack)) == sizeof(kConnack);
+                } else if (n <= 0) {
+                    ::close(fds[k].fd);
+                    fds.erase(fds.begin() + static_cast<std::ptrdiff_t>(k));
+                    acknowledged.erase(acknowledged.begin() + static_cast<std::ptrdiff_t>(k));
+                    k--;
+                }
+            }
+        }
+        for (size_t k = 2; k < fds.size(); k++) ::close(fds[k].fd);
+    }
+};
+
+// Vehicles of a shard not yet ready have never been stepped and have no
+// position; they must stay out of the spatial index rather than sit at
+// (0, 0), where they would all be in range of each other and, once their
+// shard comes up and they leave, raise exits from a fence around that point.
+// One shard connects to a loopback broker, the other's broker refuses until
+// the readiness deadline passes.
+Check checkSpatialReadiness(std::shared_ptr<const Route> route) {
+    Check check;
+    check.name = "spatial_readiness";
+    constexpr size_t kVehicles = 64;
+    const auto kTimeout = std::chrono::milliseconds(1000);
+    LoopbackBroker broker;
+    if (!broker.ok()) {
+        check.detail = "could not start a loopback broker";
+        return check;
+    }
+    std::string fence_file = scratchFile("fences.csv");
+    {
+        std::ofstream out(fence_file);
+        out << "null_island,0,0,1000\n";
+    }
+    auto geofences = std::make_shared<GeofenceSet>();
+    bool loaded = geofences->load(fence_file);
+    unlink(fence_file.c_str());
+    if (!loaded) {
+        check.detail = "could not load " + fence_file;
+        return check;
+    }
+
+    Fleet fleet("geovan-verify", {broker.url(), "tcp://127.0.0.1:1"}, "verify", route, kVehicles, 2, 0, 100);
+    fleet.setSeed(42);
+    fleet.setFixedStep(1.0);
+    fleet.enableSpatialEvents(1.0, geofences, "verify/events");
+    fleet.startConnecting(BackoffPolicy(), kTimeout);
+    auto deadline = std::chrono::steady_clock::now() + kTimeout;
+    auto tickUntilReady = [&](size_t shards, std::chrono::steady_clock::time_point until) {
+        while (true) {
+            fleet.publishPositions();
+            if (fleet.readyShards() >= shards || std::chrono::steady_clock::now() >= until) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return fleet.readyShards();
+    };
+    size_t ready = tickUntilReady(1, deadline);
+    if (ready != 1) {
+        check.detail = std::to_string(ready) + " of 2 shards ready before the deadline, expected 1";
+    } else {
+        // The first update records the starting state; it raises no events
+        fleet.updateSpatialEvents();
+        ready = tickUntilReady(2, deadline + kTimeout);
+        // Vehicles starting on the same route point are in range of each other
+        // for real; only the fence events must not happen
+        const metrics::Counter& fence_events = metrics::registry().geofence_events;
+        uint64_t fence_events_before = fence_events.value();
+        size_t events = fleet.updateSpatialEvents();
+        uint64_t exits = fence_events.value() - fence_events_before;
+        if (ready != 2) {
+            check.detail = std::to_string(ready) + " of 2 shards ready after the deadline";
+        } else if (exits != 0) {
+            check.detail = std::to_string(exits) + " exits from a fence at (0, 0) once the second shard came up";
+        } else {
+            check.passed = true;
+            check.detail = std::to_string(events) + " proximity events and no fence exits once the second shard "
+                           "came up";
+        }
+    }
+    fleet.disconnect();
+    return check;
+}
+
+std::string jsonString(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            quoted += ' ';
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+void writeLatency(std::ostream& out, const LatencyHistogram& latency) {
+    out << "{\"count\": " << latency.count() << ", \"p50\": " << latency.percentile(0.50)
+        << ", \"p99\": " << latency.percentile(0.99) << ", \"p999\": " << latency.percentile(0.999)
+        << ", \"max\": " << latency.max() << ", \"mean\": " << latency.mean() << "}";
+}
+
+void writeResult(std::ostream& out, const Result& result) {
+    out << "    {\"name\": " << jsonString(result.name);
+    if (!result.skipped.empty()) {
+        out << ", \"skipped\": " << jsonString(result.skipped) << "}";
+        return;
+    }
+    double messages = static_cast<double>(result.messages);
+    out << ", \"messages\": " << result.messages
+        << ", \"seconds\": " << result.seconds
+        << ", \"msgs_per_sec\": " << (result.seconds > 0 ? messages / result.seconds : 0.0)
+        << ", \"allocs_per_msg\": " << (messages > 0 ? result.allocations / messages : 0.0)
+        << ", \"cpu_ms_per_1k_msgs\": " << (messages > 0 ? result.cpu_seconds * 1e6 / messages : 0.0);
+    if (!result.latency_kind.empty()) {
+        out << ", \"latency_kind\": " << jsonString(result.latency_kind) << ", \"latency_us\": ";
+        writeLatency(out, result.latency);
+    }
+    out << "}";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--broker" && i + 1 < argc) {
+            opts.broker_url = argv[++i];
+        } else if (arg == "--topic" && i + 1 < argc) {
+            opts.topic = argv[++i];
+        } else if (arg == "--route" && i + 1 < argc) {
+            opts.route_file = argv[++i];
+        } else if (arg == "--messages" && i + 1 < argc) {
+            opts.messages = std::stoull(argv[++i]);
+        } else if (arg == "--vehicles" && i + 1 < argc) {
+            opts.vehicles = std::stoul(argv[++i]);
+        } else if (arg == "--ticks" && i + 1 < argc) {
+            opts.ticks = std::stoul(argv[++i]);
+        } else if (arg == "--connections" && i + 1 < argc) {
+            opts.connections = std::stoul(argv[++i]);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            opts.threads = std::stoul(argv[++i]);
+        } else if (arg == "--qos" && i + 1 < argc) {
+            opts.qos = std::stoi(argv[++i]);
+        } else if (arg == "--max-inflight" && i + 1 < argc) {
+            opts.max_in_flight = std::stoul(argv[++i]);
+        } else if (arg == "--verify") {
+            opts.verify = true;
+        } else if (arg == "--no-broker") {
+            opts.broker = false;
+        } else if (arg == "--help") {
+            std::cout << "Usage: " << argv[0] << " [options]\n"
+                      << "Options:\n"
+                      << "  --broker <url>           Broker for the publish and end-to-end runs (default: tcp://localhost:1883)\n"
+                      << "  --topic <topic>          Topic to publish on (default: geovan/bench)\n"
+                      << "  --route <file>           Route for stepping and end-to-end runs (default: built-in)\n"
+                      << "  --messages <n>           Messages for serialize and publish runs (default: 200000)\n"
+                      << "  --vehicles <n>           Fleet size for route-step and end-to-end runs (default: 100000)\n"
+                      << "  --ticks <n>              Fleet ticks per run (default: 20)\n"
+                      << "  --connections <n>        End-to-end fleet connections (default: 1)\n"
+                      << "  --threads <n>            End-to-end fleet worker threads (default: 1)\n"
+                      << "  --qos <0|1|2>            Publish QoS (default: 0)\n"
+                      << "  --max-inflight <n>       Max unacknowledged publishes per connection (default: 1000)\n"
+                      << "  --no-broker              Only run the benchmarks that need no broker\n"
+                      << "  --verify                 Check the AVX2 kinematics kernel against the scalar one, the\n"
+                      << "                           compact codec round trip, the spill file, snapshot restore,\n"
+                      << "                           spatial events, route file bounds and the datagram size limit\n"
+                      << "                           instead; exit 1 on any failure\n"
+                      << "  --help                   Show this help message\n";
+            return 0;
+        }
+    }
+    if (opts.vehicles == 0) opts.vehicles = 1;
+
+    // The agent classes log to std::cout; keep stdout for the JSON report
+    std::ostream json(std::cout.rdbuf());
+    std::cout.rdbuf(std::cerr.rdbuf());
+
+    auto route = std::make_shared<Route>(defaultRoute());
+    if (!opts.route_file.empty() && !loadRouteFile(opts.route_file, *route)) {
+        return 1;
+    }
+
+    if (opts.verify) {
+        std::vector<Check> checks;
+        checks.push_back(checkKinematics(opts, *route, "kinematics_kernels"));
+        checks.push_back(checkKinematics(opts, denseLoop(), "kinematics_kernels_dense"));
+        checks.push_back(checkCompactCodec(opts, denseLoop()));
+        checks.push_back(checkSpillAllocation());
+        checks.push_back(checkSpillResume());
+        checks.push_back(checkSnapshotRestore(route));
+        checks.push_back(checkSpatialReadiness(route));
+        checks.push_back(checkRouteBounds(denseLoop()));
+        checks.push_back(checkDatagramLimit());
+        bool passed = true;
+        json << "{\n"
+             << "  \"benchmark\": \"vehicle_agent_bench\",\n"
+             << "  \"timestamp\": " << std::time(nullptr) << ",\n"
+             << "  \"checks\": [\n";
+        for (size_t i = 0; i < checks.size(); i++) {
+            const Check& check = checks[i];
+            std::cerr << (check.passed ? "PASS " : "FAIL ") << check.name << ": " << check.detail << std::endl;
+            json << "    {\"name\": " << jsonString(check.name) << ", \"passed\": " << (check.passed ? "true" : "false")
+                 << ", \"detail\": " << jsonString(check.detail) << "}" << (i + 1 < checks.size() ? ",\n" : "\n");
+            passed = passed && check.passed;
+        }
+        json << "  ]\n}" << std::endl;
+        return passed ? 0 : 1;
+    }
+
+    std::vector<Result> results;
+    std::cerr << "Running serialize" << std::endl;
+    results.push_back(benchSerialize(opts));
+    std::cerr << "Running route_step" << std::endl;
+    results.push_back(benchRouteStep(opts, *route));
+    if (opts.broker) {
+        std::cerr << "Running publish against " << opts.broker_url << std::endl;
+        results.push_back(benchPublish(opts));
+        std::cerr << "Running end_to_end against " << opts.broker_url << std::endl;
+        results.push_back(benchEndToEnd(opts, route));
+    }
+
+    json << "{\n"
+         << "  \"benchmark\": \"vehicle_agent_bench\",\n"
+         << "  \"timestamp\": " << std::time(nullptr) << ",\n"
+         << "  \"config\": {\"broker\": " << jsonString(opts.broker_url) << ", \"qos\": " << opts.qos
+         << ", \"messages\": " << opts.messages << ", \"vehicles\": " << opts.vehicles
+         << ", \"ticks\": " << opts.ticks << ", \"route_points\": " << route->size()
+         << ", \"connections\": " << opts.connections << ", \"threads\": " << opts.threads
+         << ", \"max_inflight\": " << opts.max_in_flight << "},\n"
+         << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        writeResult(json, results[i]);
+        json << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ]\n}" << std::endl;
+    return 0;
+}
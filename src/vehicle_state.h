@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include "compact_codec.h"
+
+// What a vehicle's publish path remembers between positions, packed so a
+// fleet of a million keeps it in 24 MB next to its FleetKinematics. The last
+// published fix is both what the backend dead-reckons from (DeadReckoning)
+// and what the next compact record is a delta against, so it is kept once:
+// coordinates in the compact records' 1e-7 degrees, speed and heading in
+// hundredths, and only the low 32 bits of the timestamp, since nothing takes
+// a difference of more than a few weeks between two of a vehicle's fixes.
+struct VehicleState {
+    int32_t lat_e7;
+    int32_t lon_e7;
+    uint32_t published_ms;    // low 32 bits of the last published timestamp
+    uint32_t seq;             // next sequence number, so also positions published
+    uint16_t speed_cms;
+    uint16_t heading_cdeg;
+    uint16_t since_keyframe;  // compact records since the last keyframe
+    uint16_t topic;           // index of the vehicle's topic and payload pool
+
+    // Largest keyframe interval since_keyframe can count up to
+    static constexpr uint32_t kMaxKeyframeInterval = UINT16_MAX;
+    // Topics topic can tell apart
+    static constexpr uint32_t kMaxTopics = UINT16_MAX + 1;
+    // heading_cdeg while the backend has no fix to predict from; out of range for a heading
+    static constexpr uint16_t kNoBasis = UINT16_MAX;
+
+    VehicleState()
+        : lat_e7(0), lon_e7(0), published_ms(0), seq(0), speed_cms(0), heading_cdeg(kNoBasis),
+          since_keyframe(kMaxKeyframeInterval), topic(0) {}
+
+    // Whether the last published fix reached the publish path, so the backend
+    // predicts from it and compact deltas may be taken against it
+    bool hasBasis() const { return heading_cdeg != kNoBasis; }
+
+    double lat() const { return lat_e7 / compact::kCoordScale; }
+    double lon() const { return lon_e7 / compact::kCoordScale; }
+    double speed() const { return speed_cms / 100.0; }
+    double heading() const { return heading_cdeg / 100.0; }
+
+    // Time from the last published fix to timestamp (ms), wrapping like the stored bits
+    int64_t millisSincePublished(int64_t timestamp) const {
+        return static_cast<int32_t>(static_cast<uint32_t>(timestamp) - published_ms);
+    }
+
+    // A position was lost before it was handed on: the backend still predicts
+    // from an older fix than the one kept here, and a consumer missed a
+    // record, so the next position goes out in full and as a keyframe
+    void basisLost() {
+        heading_cdeg = kNoBasis;
+        since_keyframe = kMaxKeyframeInterval;
+    }
+
+    // The fix just published becomes the basis for the next one
+    void recordPublished(int32_t lat_fixed, int32_t lon_fixed, double speed_mps, double heading_deg,
+                         int64_t timestamp) {
+        lat_e7 = lat_fixed;
+        lon_e7 = lon_fixed;
+        published_ms = static_cast<uint32_t>(timestamp);
+        speed_cms = static_cast<uint16_t>(std::lround(std::clamp(speed_mps * 100.0, 0.0, 65535.0)));
+        heading_cdeg = static_cast<uint16_t>(std::lround(std::clamp(heading_deg * 100.0, 0.0, 35999.0)));
+    }
+};
+static_assert(sizeof(VehicleState) == 24, "VehicleState packing");
+
+// Vehicle IDs, interned as the prefix every fleet vehicle shares: the ID of
+// vehicle i is "<base>-<i>", formatted where it is needed instead of kept per
+// vehicle. A standalone agent has one fixed ID.
+class VehicleIds {
+private:
+    std::string prefix_;
+    bool numbered_;
+
+    VehicleIds(std::string prefix, bool numbered) : prefix_(std::move(prefix)), numbered_(numbered) {}
+
+public:
+    VehicleIds() : numbered_(false) {}
+
+    static VehicleIds single(const std::string& id) { return VehicleIds(id, false); }
+    static VehicleIds numbered(const std::string& base) { return VehicleIds(base + "-", true); }
+
+    // Overwrite out with vehicle's ID; reuses out's capacity
+    void format(uint32_t vehicle, std::string& out) const {
+        out.assign(prefix_);
+        if (!numbered_) return;
+        char digits[10];
+        auto end = std::to_chars(digits, digits + sizeof(digits), vehicle).ptr;
+        out.append(digits, static_cast<size_t>(end - digits));
+    }
+
+    std::string operator()(uint32_t vehicle) const {
+        std::string id;
+        format(vehicle, id);
+        return id;
+    }
+};
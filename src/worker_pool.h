@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Fixed pool of worker threads, each pinned to a core, that runs batches of
+// indexed tasks. Task t is queued on its home worker (t % workers) so the same
+// worker keeps touching the same shard's memory tick after tick; a worker that
+// runs out of tasks steals from the front of another worker's queue, which
+// evens out shards that take longer than others.
+//
+// run() blocks until the whole batch is done. With fewer than two threads the
+// tasks run inline on the caller and no threads are started.
+class WorkerPool {
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<std::thread> threads_;
+    std::vector<Queue> queues_;
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable batch_done_;
+    uint64_t generation_;
+    bool stopping_;
+    // Current batch: a type-erased callable invoked with each task index
+    void (*invoke_)(void*, size_t);
+    void* job_;
+    std::atomic<size_t> remaining_;
+    std::exception_ptr error_;
+    std::atomic<uint64_t> steals_;
+
+public:
+    explicit WorkerPool(size_t threads)
+        : queues_(threads > 1 ? threads : 0), generation_(0), stopping_(false),
+          invoke_(nullptr), job_(nullptr), remaining_(0), steals_(0) {
+        if (threads < 2) return;
+        std::vector<int> cpus = allowedCpus();
+        threads_.reserve(threads);
+        for (size_t w = 0; w < threads; w++) {
+            threads_.emplace_back([this, w] { workerLoop(w); });
+            if (!cpus.empty()) pin(threads_.back(), cpus[w % cpus.size()]);
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_ready_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    size_t threadCount() const { return threads_.empty() ? 1 : threads_.size(); }
+    // Tasks run by a worker other than their home worker
+    uint64_t steals() const { return steals_; }
+
+    // Call fn(t) for every t in [0, count) and wait for all of them. The first
+    // exception thrown by a task is rethrown here once the batch has finished.
+    template <typename Fn>
+    void run(size_t count, Fn& fn) {
+        if (threads_.empty()) {
+            for (size_t t = 0; t < count; t++) fn(t);
+            return;
+        }
+        if (count == 0) return;
+
+        // The job is published before its tasks are queued: a worker still
+        // draining queues from the previous batch may pick a task up early
+        std::unique_lock<std::mutex> lock(mutex_);
+        job_ = &fn;
+        invoke_ = [](void* job, size_t t) { (*static_cast<Fn*>(job))(t); };
+        remaining_ = count;
+        error_ = nullptr;
+        for (size_t t = 0; t < count; t++) {
+            Queue& queue = queues_[t % queues_.size()];
+            std::lock_guard<std::mutex> queue_lock(queue.mutex);
+            queue.tasks.push_back(t);
+        }
+        generation_++;
+        work_ready_.notify_all();
+        batch_done_.wait(lock, [this] { return remaining_ == 0; });
+
+        if (error_) {
+            std::exception_ptr error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    static std::vector<int> allowedCpus() {
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+            }
+        }
+#endif
+        return cpus;
+    }
+
+    static void pin(std::thread& thread, int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+        (void)thread;
+        (void)cpu;
+#endif
+    }
+
+    // Own queue from the back, then other queues from the front
+    bool takeTask(size_t self, size_t& task) {
+        {
+            Queue& own = queues_[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues_.size(); k++) {
+            Queue& victim = queues_[(self + k) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                steals_++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                work_ready_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+                if (stopping_) return;
+                seen = generation_;
+            }
+
+            // The queue lock taken in takeTask orders this read of the job after run() set it
+            size_t task;
+            while (takeTask(self, task)) {
+                try {
+                    invoke_(job_, task);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (!error_) error_ = std::current_exception();
+                }
+                if (--remaining_ == 0) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    batch_done_.notify_all();
+                }
+            }
+        }
+    }
+};